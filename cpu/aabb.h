@@ -0,0 +1,82 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <utility>
+
+class aabb
+{
+public:
+    aabb() : minimum(infinity, infinity, infinity), maximum(-infinity, -infinity, -infinity) {}
+    aabb(const point3 &a, const point3 &b) : minimum(a), maximum(b) {}
+
+    point3 min() const { return minimum; }
+    point3 max() const { return maximum; }
+
+    point3 centroid() const
+    {
+        return 0.5f * (minimum + maximum);
+    }
+
+    // Index of the axis along which the box is largest
+    int max_extent() const
+    {
+        vec3 d = maximum - minimum;
+        if (d.x() > d.y() && d.x() > d.z())
+            return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
+    float surface_area() const
+    {
+        vec3 d = maximum - minimum;
+        if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+            return 0;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    // Factor on a slab's exit distance that covers the rounding in computing
+    // it, so a ray that only touches a box is never culled (Ize, "Robust
+    // BVH Ray Traversal", JCGT 2013)
+    static constexpr float far_scale = 1 + 2 * rounding_gamma(3);
+
+    // Slab test against a ray with precomputed reciprocal direction.
+    inline bool hit(const ray &r, const vec3 &inv_dir, float t_min, float t_max) const
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            auto t0 = (minimum[a] - r.orig[a]) * inv_dir[a];
+            auto t1 = (maximum[a] - r.orig[a]) * inv_dir[a];
+            if (inv_dir[a] < 0.0f)
+                std::swap(t0, t1);
+            t1 *= far_scale;
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    point3 minimum;
+    point3 maximum;
+};
+
+inline aabb surrounding_box(const aabb &box0, const aabb &box1)
+{
+    point3 small(std::fmin(box0.min().x(), box1.min().x()),
+                 std::fmin(box0.min().y(), box1.min().y()),
+                 std::fmin(box0.min().z(), box1.min().z()));
+
+    point3 big(std::fmax(box0.max().x(), box1.max().x()),
+               std::fmax(box0.max().y(), box1.max().y()),
+               std::fmax(box0.max().z(), box1.max().z()));
+
+    return aabb(small, big);
+}
+
+inline aabb surrounding_box(const aabb &box, const point3 &p)
+{
+    return surrounding_box(box, aabb(p, p));
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "integrator.h"
+#include "kernels.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct adaptive_settings
+{
+    int min_samples = 8;   // every pixel gets at least this many
+    int max_samples = 256; // and never more than this
+    int pass_samples = 8;  // added to each unconverged block per pass
+    int block_size = 4;    // pixels are judged in blocks of block_size x block_size
+    float error = 0.01f;   // target standard error of the displayed pixel value
+};
+
+// Running estimate of one pixel: the colour sum, plus mean and squared
+// deviations of the luminance (Welford), which drive the error estimate
+struct pixel_estimate
+{
+    color sum;
+    float mean = 0, m2 = 0;
+    int samples = 0;
+
+    void add(const color &c)
+    {
+        sum += c;
+        float y = 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+        samples++;
+        float delta = y - mean;
+        mean += delta / samples;
+        m2 += delta * (y - mean);
+    }
+
+    float variance() const { return samples > 1 ? m2 / (samples - 1) : 0.0f; }
+};
+
+// Renders in passes. The first pass gives every pixel min_samples samples;
+// each later pass adds pass_samples to the blocks whose error is still above
+// the target, until none are left or they reach max_samples.
+//
+// The error of a pixel is the standard error of its mean after the output's
+// gamma 2 curve: since d sqrt(m) = dm / (2 sqrt(m)), the same noise shows
+// more in dark pixels. Each pixel is judged with the average variance of
+// its block rather than its own, because paths ended by Russian roulette
+// make many samples exactly zero, and a pixel whose first few samples all
+// came back zero would otherwise look perfectly converged. A block stops
+// once the RMS error of its pixels is below the target.
+//
+// Sample s of a pixel always uses rng(pixel, s), so a pixel that runs to N
+// samples gets exactly the samples a fixed N spp render would give it.
+// ctx.pixel_colors receives the per-pixel mean, not the sum, so write the
+// image with samples_per_pixel = 1.
+class adaptive_renderer
+{
+public:
+    adaptive_renderer(int width, int height, const adaptive_settings &settings);
+
+    void render(const render_context &ctx, tile_scheduler &scheduler, bool use_threads);
+
+    uint64_t total_samples() const;
+    int passes() const { return pass_count; }
+
+public:
+    std::vector<pixel_estimate> pixels;
+
+private:
+    int block_of(int i, int j) const { return (j / settings.block_size) * blocks_x + i / settings.block_size; }
+    // Marks converged blocks done and returns how many are still sampling
+    int update_blocks();
+
+    int width, height;
+    adaptive_settings settings;
+    int blocks_x, blocks_y;
+    std::vector<uint8_t> block_done;
+    int pass_count = 0;
+};
+
+adaptive_renderer::adaptive_renderer(int width, int height, const adaptive_settings &settings)
+    : pixels(width * height), width(width), height(height), settings(settings)
+{
+    this->settings.block_size = std::max(1, settings.block_size);
+    this->settings.max_samples = std::max(settings.min_samples, settings.max_samples);
+    blocks_x = (width + this->settings.block_size - 1) / this->settings.block_size;
+    blocks_y = (height + this->settings.block_size - 1) / this->settings.block_size;
+}
+
+void adaptive_renderer::render(const render_context &ctx, tile_scheduler &scheduler, bool use_threads)
+{
+    std::fill(pixels.begin(), pixels.end(), pixel_estimate());
+    block_done.assign(blocks_x * blocks_y, 0);
+    pass_count = 0;
+
+    int active = blocks_x * blocks_y;
+    while (active > 0)
+    {
+        int count = pass_count == 0 ? settings.min_samples : settings.pass_samples;
+        scheduler.run([&](const tile &t, int)
+                      {
+                          for (int j = t.y0; j < t.y1; ++j)
+                          {
+                              for (int i = t.x0; i < t.x1; ++i)
+                              {
+                                  if (block_done[block_of(i, j)])
+                                      continue;
+
+                                  uint32_t pixel = j * width + i;
+                                  pixel_estimate &est = pixels[pixel];
+                                  int end = std::min(est.samples + count, settings.max_samples);
+                                  for (int s = est.samples; s < end; s++)
+                                  {
+                                      rng rand(pixel, s, 0, ctx.pattern);
+                                      ray r = camera_ray(ctx, i, j, rand);
+                                      est.add(ray_color(r, ctx.world, ctx.materials, ctx.max_depth, rand));
+                                  }
+                                  ctx.pixel(i, j) = est.sum / (float)est.samples;
+                              }
+                          }
+                          flush_path_counters();
+                      },
+                      use_threads);
+        pass_count++;
+        active = update_blocks();
+    }
+}
+
+int adaptive_renderer::update_blocks()
+{
+    int active = 0;
+    for (int by = 0; by < blocks_y; by++)
+    {
+        for (int bx = 0; bx < blocks_x; bx++)
+        {
+            uint8_t &done = block_done[by * blocks_x + bx];
+            if (done)
+                continue;
+
+            int x0 = bx * settings.block_size, x1 = std::min(x0 + settings.block_size, width);
+            int y0 = by * settings.block_size, y1 = std::min(y0 + settings.block_size, height);
+            int n = (x1 - x0) * (y1 - y0);
+
+            float variance = 0;
+            int samples = settings.max_samples;
+            for (int j = y0; j < y1; j++)
+            {
+                for (int i = x0; i < x1; i++)
+                {
+                    variance += pixels[j * width + i].variance();
+                    samples = std::min(samples, pixels[j * width + i].samples);
+                }
+            }
+            variance /= n;
+
+            float squared_error = 0;
+            for (int j = y0; j < y1; j++)
+            {
+                for (int i = x0; i < x1; i++)
+                {
+                    const pixel_estimate &est = pixels[j * width + i];
+                    squared_error += variance / est.samples / (4 * std::max(est.mean, 1e-4f));
+                }
+            }
+
+            done = samples >= settings.max_samples || sqrt(squared_error / n) <= settings.error;
+            active += !done;
+        }
+    }
+    return active;
+}
+
+uint64_t adaptive_renderer::total_samples() const
+{
+    uint64_t total = 0;
+    for (const auto &est : pixels)
+        total += est.samples;
+    return total;
+}
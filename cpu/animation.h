@@ -0,0 +1,173 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "transform.h"
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+// Camera and object motion of one animation frame. motion[k] moves object k
+// of the scene's list away from where the scene put it: a sphere's centre
+// goes through it, and an instance's placement is composed with it. Objects
+// past the end of motion, and other kinds of object, stay where they are.
+struct animation_frame
+{
+    scene_camera_record camera;
+    std::vector<affine> motion;
+};
+
+// A turntable of `frames` frames: the camera circles its look-at point at
+// its own height, small spheres (radius up to 1) bounce, and instances spin
+// on their vertical axis. The last frame leads back into the first.
+std::vector<animation_frame> turntable_animation(const hittable_list &world, const scene_camera_record &camera,
+                                                 int frames);
+
+// A scene whose objects move between frames, and a bvh that follows them.
+// Each frame refits the tree, one pass over the nodes, and the tree is only
+// rebuilt once its nodes' surface areas have grown by rebuild_threshold
+// times, on average, since the last build. The average is over nodes rather
+// than weighted by area, as SAH would, so that a huge ground sphere near
+// the root does not hide a loosening subtree where the camera looks. The
+// objects are shared with the list the scene was made from and are moved in
+// place.
+class animated_scene
+{
+public:
+    animated_scene(const hittable_list &world, float rebuild_threshold);
+
+    // Moves every object to where `frame` puts it and updates the tree
+    void set_frame(const animation_frame &frame);
+
+    const bvh &accel() const { return *tree; }
+
+    // Mean ratio of each node's surface area to its area when built
+    float growth() const;
+
+public:
+    int refits = 0, rebuilds = 0;
+    double refit_seconds = 0, rebuild_seconds = 0;
+    double initial_build_seconds = 0;
+    bool rebuilt = false; // whether the last set_frame rebuilt the tree
+
+private:
+    void rebuild();
+
+    hittable_list world;
+    std::vector<point3> rest_centers;    // per object, used for spheres
+    std::vector<affine> rest_placements; // per object, used for instances
+    float rebuild_threshold;
+    std::unique_ptr<bvh> tree;
+    std::vector<float> built_areas; // per node, at the last build
+};
+
+std::vector<animation_frame> turntable_animation(const hittable_list &world, const scene_camera_record &camera,
+                                                 int frames)
+{
+    point3 lookat(camera.lookat[0], camera.lookat[1], camera.lookat[2]);
+    vec3 offset = point3(camera.lookfrom[0], camera.lookfrom[1], camera.lookfrom[2]) - lookat;
+    const vec3 up(0, 1, 0);
+
+    std::vector<animation_frame> animation(frames);
+    for (int f = 0; f < frames; f++)
+    {
+        float turn = (float)f / frames; // fraction of the full circle
+        animation_frame &frame = animation[f];
+        frame.camera = camera;
+        point3 lookfrom = lookat + affine::rotate(up, 360 * turn).apply_vector(offset);
+        for (int i = 0; i < 3; i++)
+            frame.camera.lookfrom[i] = lookfrom[i];
+
+        frame.motion.resize(world.objects.size());
+        for (size_t k = 0; k < world.objects.size(); k++)
+        {
+            const hittable *object = world.objects[k].get();
+            if (auto s = dynamic_cast<const sphere *>(object))
+            {
+                if (s->radius > 1)
+                    continue;
+                // Two bounces per turn, each sphere at its own phase
+                float phase = hash_uint((uint32_t)k) * 0x1p-32f;
+                float height = 3 * s->radius * std::fabs(std::sin(2 * pi * (2 * turn + phase)));
+                frame.motion[k] = affine::translate(vec3(0, height, 0));
+            }
+            else if (auto copy = dynamic_cast<const instance *>(object))
+            {
+                vec3 center = copy->bounds.centroid();
+                frame.motion[k] = affine::translate(center) * affine::rotate(up, 360 * turn) * affine::translate(-center);
+            }
+        }
+    }
+    return animation;
+}
+
+animated_scene::animated_scene(const hittable_list &world, float rebuild_threshold)
+    : world(world), rebuild_threshold(rebuild_threshold)
+{
+    for (const auto &object : world.objects)
+    {
+        auto s = dynamic_cast<const sphere *>(object.get());
+        auto copy = dynamic_cast<const instance *>(object.get());
+        rest_centers.push_back(s ? s->center : point3());
+        rest_placements.push_back(copy ? copy->object_to_world : affine());
+    }
+    rebuild();
+    initial_build_seconds = rebuild_seconds;
+    rebuilds = 0;
+    rebuild_seconds = 0;
+}
+
+void animated_scene::rebuild()
+{
+    auto start = std::chrono::steady_clock::now();
+    tree.reset(new bvh(world));
+    built_areas.resize(tree->node_count);
+    for (int n = 0; n < tree->node_count; n++)
+        built_areas[n] = tree->nodes[n].bounds().surface_area();
+    rebuild_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    rebuilds++;
+}
+
+void animated_scene::set_frame(const animation_frame &frame)
+{
+    for (size_t k = 0; k < world.objects.size() && k < frame.motion.size(); k++)
+    {
+        hittable *object = world.objects[k].get();
+        if (auto s = dynamic_cast<sphere *>(object))
+            s->center = frame.motion[k].apply_point(rest_centers[k]);
+        else if (auto copy = dynamic_cast<instance *>(object))
+            copy->place(frame.motion[k] * rest_placements[k]);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    tree->refit();
+    refit_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    refits++;
+
+    rebuilt = growth() > rebuild_threshold;
+    if (rebuilt)
+        rebuild();
+}
+
+float animated_scene::growth() const
+{
+    double sum = 0;
+    int counted = 0;
+    for (int n = 0; n < tree->node_count; n++)
+    {
+        if (built_areas[n] > 0)
+        {
+            sum += tree->nodes[n].bounds().surface_area() / built_areas[n];
+            counted++;
+        }
+    }
+    return counted ? (float)(sum / counted) : 1.0f;
+}
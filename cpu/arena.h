@@ -0,0 +1,164 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Bytes per chunk of one type's storage
+const size_t arena_chunk_bytes = 64 * 1024;
+
+// Storage for a scene's objects. Each type gets its own run of chunks that
+// are filled in order, so objects made one after another sit next to each
+// other, and an object never moves once made; the k-th object of a type
+// keeps index k. make() hands objects out as shared_ptrs that share the
+// arena's one reference count: making an object costs no allocation of its
+// own, and the whole scene is freed in one go, a chunk at a time, when the
+// arena and the last pointer into it are gone. Not thread-safe.
+class scene_arena
+{
+public:
+    scene_arena();
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args &&...args);
+
+    // Objects of type T made so far, and the one made index-th
+    template <typename T>
+    size_t count() const;
+    template <typename T>
+    T &get(size_t index) const;
+
+    // Bytes of chunks allocated, over every type
+    size_t bytes() const;
+
+private:
+    class pool_base
+    {
+    public:
+        virtual ~pool_base() {}
+        virtual size_t bytes() const = 0;
+    };
+
+    template <typename T>
+    class pool;
+
+    struct storage
+    {
+        std::vector<std::unique_ptr<pool_base>> pools; // by type slot
+    };
+
+    // Small per-type number, handed out on first use
+    static size_t next_slot()
+    {
+        static std::atomic<size_t> slots{0};
+        return slots++;
+    }
+
+    template <typename T>
+    static size_t slot()
+    {
+        static const size_t s = next_slot();
+        return s;
+    }
+
+    template <typename T>
+    pool<T> *find() const;
+
+    shared_ptr<storage> owner;
+};
+
+template <typename T>
+class scene_arena::pool : public pool_base
+{
+public:
+    static constexpr size_t per_chunk = arena_chunk_bytes / sizeof(T) > 0 ? arena_chunk_bytes / sizeof(T) : 1;
+
+    ~pool()
+    {
+        for (size_t c = 0; c < chunks.size(); c++)
+        {
+            // Trivially destructible types, such as spheres, skip straight to
+            // freeing the chunks
+            if constexpr (!std::is_trivially_destructible<T>::value)
+            {
+                size_t n = std::min(per_chunk, count - c * per_chunk);
+                for (size_t i = 0; i < n; i++)
+                    chunks[c][i].T::~T();
+            }
+            ::operator delete(chunks[c], std::align_val_t(alignof(T)));
+        }
+    }
+
+    template <typename... Args>
+    T *make(Args &&...args)
+    {
+        if (count == chunks.size() * per_chunk)
+            chunks.push_back(static_cast<T *>(::operator new(per_chunk * sizeof(T), std::align_val_t(alignof(T)))));
+        T *object = chunks.back() + count % per_chunk;
+        new (object) T(std::forward<Args>(args)...);
+        count++;
+        return object;
+    }
+
+    T &get(size_t index) const { return chunks[index / per_chunk][index % per_chunk]; }
+
+    size_t bytes() const override { return chunks.size() * per_chunk * sizeof(T); }
+
+public:
+    std::vector<T *> chunks;
+    size_t count = 0;
+};
+
+scene_arena::scene_arena() : owner(std::make_shared<storage>()) {}
+
+template <typename T>
+scene_arena::pool<T> *scene_arena::find() const
+{
+    size_t s = slot<T>();
+    if (s >= owner->pools.size() || !owner->pools[s])
+        return nullptr;
+    return static_cast<pool<T> *>(owner->pools[s].get());
+}
+
+template <typename T, typename... Args>
+shared_ptr<T> scene_arena::make(Args &&...args)
+{
+    pool<T> *p = find<T>();
+    if (!p)
+    {
+        size_t s = slot<T>();
+        if (s >= owner->pools.size())
+            owner->pools.resize(s + 1);
+        p = new pool<T>();
+        owner->pools[s].reset(p);
+    }
+    // Aliasing constructor: points at the object, counts on the arena
+    return shared_ptr<T>(owner, p->make(std::forward<Args>(args)...));
+}
+
+template <typename T>
+size_t scene_arena::count() const
+{
+    pool<T> *p = find<T>();
+    return p ? p->count : 0;
+}
+
+template <typename T>
+T &scene_arena::get(size_t index) const
+{
+    return find<T>()->get(index);
+}
+
+size_t scene_arena::bytes() const
+{
+    size_t total = 0;
+    for (const auto &p : owner->pools)
+        total += p ? p->bytes() : 0;
+    return total;
+}
@@ -0,0 +1,306 @@
+/*
+    Scene arena benchmark
+
+    Builds the same large grid of spheres three ways and traces one batch of
+    rays through a bvh with scalar leaves, which reaches every sphere
+    through its pointer:
+
+    - heap: one make_shared per sphere, as the scenes used to;
+    - aged heap: the same after a previous scene was freed in random order,
+      as in a process that has been running for a while;
+    - arena: every sphere made in one scene_arena.
+
+    For each it reports the time to make the objects, sweep over them in
+    list order, build the bvh, trace the rays and free the scene; the heap
+    bytes each object took; how often consecutive objects of the list and
+    of the bvh's leaf order sit next to each other in memory; and, where the
+    kernel exposes hardware counters, L1 data and last-level cache misses
+    per ray.
+
+    Build: g++ -O3 -march=native -o arena_bench arena_bench.cc
+    Usage: ./arena_bench [--side N] [--rays N] [--reps N]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+/* Results are folded into this so the compiler can't drop the work */
+volatile int sink;
+
+double seconds_since(clock_type::time_point start)
+{
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+/* One hardware counter of this thread, user space only. Reads -1 where
+   perf events are unavailable, e.g. in most containers and VMs. */
+class perf_counter
+{
+public:
+    perf_counter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~perf_counter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void start()
+    {
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    int64_t stop()
+    {
+        uint64_t value;
+        if (fd < 0)
+            return -1;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        return read(fd, &value, sizeof(value)) == sizeof(value) ? (int64_t)value : -1;
+    }
+
+private:
+    int fd;
+};
+
+/* Sphere centers and radii of a side x side grid, jittered like random_scene */
+struct sphere_spec
+{
+    point3 center;
+    float radius;
+};
+
+std::vector<sphere_spec> grid_specs(int side)
+{
+    std::vector<sphere_spec> specs;
+    for (int a = 0; a < side; a++)
+        for (int b = 0; b < side; b++)
+            specs.push_back({point3(a + 0.9f * random_float(), 0.2f, b + 0.9f * random_float()), 0.2f});
+    return specs;
+}
+
+/* Makes a previous scene's worth of spheres and frees most of them in a
+   random order, as reloading a scene in a long-running process would. The
+   allocator hands the freed blocks back last in, first out, so the next
+   scene's objects land all over the old one's footprint. The returned
+   eighth stay allocated until the caller drops them. */
+std::vector<shared_ptr<sphere>> age_heap(size_t count)
+{
+    std::vector<shared_ptr<sphere>> previous;
+    for (size_t i = 0; i < count; i++)
+        previous.push_back(make_shared<sphere>(point3(), 1.0f, 0));
+    for (size_t i = count; i > 1; i--)
+        std::swap(previous[i - 1], previous[hash_uint((uint32_t)i) % i]);
+
+    std::vector<shared_ptr<sphere>> kept;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % 8 == 0)
+            kept.push_back(previous[i]);
+        previous[i].reset();
+    }
+    return kept;
+}
+
+/* Fraction of neighbours in `objects` whose addresses are at most 256
+   bytes apart, i.e. that a sequential prefetcher would already have
+   brought in */
+double near_fraction(const std::vector<shared_ptr<hittable>> &objects)
+{
+    int near = 0;
+    for (size_t i = 1; i < objects.size(); i++)
+    {
+        intptr_t d = (intptr_t)objects[i].get() - (intptr_t)objects[i - 1].get();
+        near += d >= -256 && d <= 256;
+    }
+    return objects.size() > 1 ? (double)near / (objects.size() - 1) : 1.0;
+}
+
+struct variant_result
+{
+    string name;
+    double make_ms = 0, sweep_ms = 0, build_ms = 0, trace_ms = 0, free_ms = 0;
+    double bytes_per_object = 0; // heap growth while making the objects
+    double list_near = 0, leaf_near = 0; // consecutive primitives within 256 bytes
+    int64_t l1_misses = -1, llc_misses = -1;
+};
+
+enum class storage_kind
+{
+    heap,
+    aged_heap,
+    arena
+};
+
+variant_result run_variant(const string &name, storage_kind kind, const std::vector<sphere_spec> &specs,
+                           const std::vector<ray> &rays, int reps)
+{
+    variant_result result;
+    result.name = name;
+    result.make_ms = result.sweep_ms = result.build_ms = result.trace_ms = result.free_ms = 1e30;
+    perf_counter l1(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    perf_counter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    for (int rep = 0; rep < reps; rep++)
+    {
+        std::vector<shared_ptr<sphere>> aged;
+        if (kind == storage_kind::aged_heap)
+            aged = age_heap(specs.size());
+
+        auto world = std::unique_ptr<hittable_list>(new hittable_list());
+        world->objects.reserve(specs.size());
+        size_t heap_before = mallinfo2().uordblks;
+        auto start = clock_type::now();
+        {
+            scene_arena arena;
+            for (const sphere_spec &s : specs)
+            {
+                if (kind == storage_kind::arena)
+                    world->add(arena.make<sphere>(s.center, s.radius, 0));
+                else
+                    world->add(make_shared<sphere>(s.center, s.radius, 0));
+            }
+        }
+        result.make_ms = std::min(result.make_ms, 1000 * seconds_since(start));
+        result.bytes_per_object = (double)(mallinfo2().uordblks - heap_before) / specs.size();
+
+        // One pass over every object in list order
+        aabb box;
+        start = clock_type::now();
+        world->bounding_box(box);
+        result.sweep_ms = std::min(result.sweep_ms, 1000 * seconds_since(start));
+        sink = (int)box.max().x();
+
+        // Scalar leaves, so every primitive test goes through its pointer
+        start = clock_type::now();
+        auto accel = std::unique_ptr<bvh>(new bvh(*world, 4, false));
+        result.build_ms = std::min(result.build_ms, 1000 * seconds_since(start));
+
+        result.list_near = near_fraction(world->objects);
+        result.leaf_near = near_fraction(accel->primitives);
+
+        hit_record rec;
+        int hits = 0;
+        start = clock_type::now();
+        l1.start();
+        llc.start();
+        for (const ray &r : rays)
+            hits += accel->hit(r, 0.001f, infinity, rec);
+        int64_t l1_misses = l1.stop(), llc_misses = llc.stop();
+        double trace_ms = 1000 * seconds_since(start);
+        sink = hits;
+        if (trace_ms < result.trace_ms)
+        {
+            result.trace_ms = trace_ms;
+            result.l1_misses = l1_misses;
+            result.llc_misses = llc_misses;
+        }
+
+        start = clock_type::now();
+        accel.reset();
+        world.reset();
+        result.free_ms = std::min(result.free_ms, 1000 * seconds_since(start));
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int side = 400;
+    int num_rays = 1 << 18;
+    int reps = 3;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--side" && i + 1 < argc)
+            side = std::max(1, atoi(argv[++i]));
+        else if (arg == "--rays" && i + 1 < argc)
+            num_rays = std::max(1, atoi(argv[++i]));
+        else if (arg == "--reps" && i + 1 < argc)
+            reps = std::max(1, atoi(argv[++i]));
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--side N] [--rays N] [--reps N]" << endl;
+            return 1;
+        }
+    }
+
+    std::vector<sphere_spec> specs = grid_specs(side);
+
+    /* From above the grid down onto random points of it, so most rays hit */
+    std::vector<ray> rays;
+    for (int i = 0; i < num_rays; i++)
+    {
+        point3 origin(random_float(0, (float)side), 10, random_float(0, (float)side));
+        point3 target(random_float(0, (float)side), 0, random_float(0, (float)side));
+        rays.push_back(ray(origin, target - origin));
+    }
+
+    cout << specs.size() << " spheres, " << num_rays << " rays, best of " << reps << endl;
+    std::vector<variant_result> results = {
+        run_variant("heap", storage_kind::heap, specs, rays, reps),
+        run_variant("aged heap", storage_kind::aged_heap, specs, rays, reps),
+        run_variant("arena", storage_kind::arena, specs, rays, reps),
+    };
+
+    cout << std::left << std::setw(12) << "storage" << std::right << std::setw(10) << "make ms" << std::setw(10)
+         << "sweep ms" << std::setw(10) << "bvh ms" << std::setw(10) << "trace ms" << std::setw(10) << "free ms"
+         << std::setw(10) << "B/object" << std::setw(12) << "list near" << std::setw(12) << "leaf near" << std::setw(14) << "L1D miss/ray"
+         << std::setw(14) << "LLC miss/ray" << endl;
+    for (const variant_result &r : results)
+    {
+        auto per_ray = [&](int64_t misses)
+        {
+            return misses < 0 ? string("n/a") : std::to_string((double)misses / num_rays).substr(0, 6);
+        };
+        cout << std::left << std::setw(12) << r.name << std::right << std::fixed << std::setprecision(2)
+             << std::setw(10) << r.make_ms << std::setw(10) << r.sweep_ms << std::setw(10) << r.build_ms
+             << std::setw(10) << r.trace_ms << std::setw(10) << r.free_ms << std::setprecision(1) << std::setw(10)
+             << r.bytes_per_object << std::setw(11)
+             << 100 * r.list_near << "%" << std::setw(11) << 100 * r.leaf_near << "%" << std::setw(14)
+             << per_ray(r.l1_misses)
+             << std::setw(14) << per_ray(r.llc_misses) << endl;
+    }
+    if (results[0].l1_misses < 0)
+        cout << "Cache counters unavailable here; the near columns stand in for locality" << endl;
+}
@@ -0,0 +1,331 @@
+/*
+    Kernel microbenchmarks
+
+    Times the building blocks of the renderer (sphere::hit, each material's
+    scatter, camera::get_ray, vec3 operations, the random number sources)
+    and the end-to-end sample kernels on the benchmark scene. Every
+    benchmark runs a few untimed warm-up repetitions first, then reports the
+    min, median and 95th percentile of the timed ones and a throughput
+    (calls or rays per second) based on the median.
+
+    A table goes to stderr and the results go to stdout as JSON, so runs on
+    the same machine can be compared between releases.
+
+    Build: g++ -O3 -march=native -pthread -o bench bench.cc
+    Usage: ./bench [--reps N] [--warmup N] [--filter TEXT] [--json FILE]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "kernels.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "wavefront.h"
+
+/* Same render settings as main.cc */
+#define MAX_DEPTH 50
+#define SAMPLES_PER_PIXEL 20
+#define ASPECT_RATIO (16.0f / 9.0f)
+#define IMG_WIDTH 120
+#define IMG_HEIGHT static_cast<int>(IMG_WIDTH / ASPECT_RATIO)
+
+/* Inputs per microbenchmark pass, and passes per timed repetition */
+#define BATCH 4096
+#define PASSES 32
+
+/* Results are folded into this so the compiler can't drop the work */
+volatile float sink;
+
+struct bench_result
+{
+    string name;
+    string unit;  // what one item is, e.g. "call" or "ray"
+    double items; // items processed per repetition
+    std::vector<double> seconds;
+
+    double percentile(double p) const
+    {
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        size_t rank = (size_t)std::ceil(p * sorted.size());
+        return sorted[rank > 0 ? rank - 1 : 0];
+    }
+
+    double min() const { return *std::min_element(seconds.begin(), seconds.end()); }
+    double median() const
+    {
+        std::vector<double> sorted = seconds;
+        std::sort(sorted.begin(), sorted.end());
+        size_t n = sorted.size();
+        return n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+    }
+    double rate() const { return items / median(); }
+};
+
+struct bench_config
+{
+    int warmup = 2;
+    int reps = 10;
+    string filter;
+};
+
+/*
+    Runs `passes` calls of body() as one repetition, warm-up + reps times, timing
+    the reps. body returns the number of items it processed.
+*/
+template <typename F>
+void measure(std::vector<bench_result> &results, const bench_config &config,
+             const string &name, const string &unit, int passes, F &&body)
+{
+    if (!config.filter.empty() && name.find(config.filter) == string::npos)
+        return;
+
+    bench_result result;
+    result.name = name;
+    result.unit = unit;
+    for (int i = 0; i < config.warmup; i++)
+        body();
+    for (int i = 0; i < config.reps; i++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        result.items = 0;
+        for (int pass = 0; pass < passes; pass++)
+            result.items += body();
+        auto end = std::chrono::high_resolution_clock::now();
+        result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+
+    cerr << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(3)
+         << std::setw(12) << result.min() * 1000 << std::setw(12) << result.median() * 1000
+         << std::setw(12) << result.percentile(0.95) * 1000 << std::setw(14) << result.rate() / 1e6
+         << " M" << unit << "/s" << endl;
+    results.push_back(result);
+}
+
+void write_json(std::ostream &out, const std::vector<bench_result> &results, const bench_config &config)
+{
+    auto quoted = [](const string &s)
+    {
+        string q = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                q += '\\';
+            q += c;
+        }
+        return q + "\"";
+    };
+
+    out << std::setprecision(9);
+    out << "{\n";
+    out << "  \"compiler\": " << quoted(__VERSION__) << ",\n";
+    out << "  \"simd_lanes\": " << packed_spheres::lanes << ",\n";
+    out << "  \"warmup\": " << config.warmup << ",\n";
+    out << "  \"reps\": " << config.reps << ",\n";
+    out << "  \"image\": {\"width\": " << IMG_WIDTH << ", \"height\": " << IMG_HEIGHT
+        << ", \"samples_per_pixel\": " << SAMPLES_PER_PIXEL << ", \"max_depth\": " << MAX_DEPTH << "},\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result &r = results[i];
+        out << "    {\"name\": " << quoted(r.name) << ", \"unit\": " << quoted(r.unit)
+            << ", \"items\": " << r.items
+            << ", \"min_s\": " << r.min() << ", \"median_s\": " << r.median()
+            << ", \"p95_s\": " << r.percentile(0.95)
+            << ", \"items_per_s\": " << r.rate() << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+    bench_config config;
+    string json_path;
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        if (arg == "--reps" && a + 1 < argc)
+            config.reps = std::max(1, atoi(argv[++a]));
+        else if (arg == "--warmup" && a + 1 < argc)
+            config.warmup = std::max(0, atoi(argv[++a]));
+        else if (arg == "--filter" && a + 1 < argc)
+            config.filter = argv[++a];
+        else if (arg == "--json" && a + 1 < argc)
+            json_path = argv[++a];
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--reps N] [--warmup N] [--filter TEXT] [--json FILE]" << endl;
+            return 1;
+        }
+    }
+
+    // Scene first, so it matches main.cc's
+    material_table materials;
+    auto world = set_scene(materials);
+    bvh world_bvh(world);
+    camera cam = scene_camera(ASPECT_RATIO);
+
+    // Inputs for the microbenchmarks
+    std::vector<ray> rays;
+    std::vector<hit_record> recs(BATCH);
+    std::vector<float> us, vs;
+    std::vector<vec3> va, vb;
+    sphere target(point3(0, 0, 0), 1.0f, 0);
+    for (int i = 0; i < BATCH; i++)
+    {
+        // Aimed near the unit sphere, so about half of them hit
+        point3 origin = 5.0f * unit_vector(vec3::random(-1, 1));
+        ray r(origin, vec3::random(-0.7f, 0.7f) - origin);
+        rays.push_back(r);
+        target.hit(ray(r.orig, -r.orig), 0.001f, infinity, recs[i]);
+        us.push_back(random_float());
+        vs.push_back(random_float());
+        va.push_back(vec3::random(-1, 1));
+        vb.push_back(vec3::random(-1, 1));
+    }
+
+    uint32_t lambertian_id = materials.add(lambertian(color(0.5f, 0.5f, 0.5f)));
+    uint32_t metal_id = materials.add(metal(color(0.7f, 0.6f, 0.5f), 0.3f));
+    uint32_t dielectric_id = materials.add(dielectric(1.5f));
+
+    std::vector<bench_result> results;
+    cerr << std::left << std::setw(36) << "benchmark" << std::right << std::setw(12) << "min ms"
+         << std::setw(12) << "median ms" << std::setw(12) << "p95 ms" << std::setw(14) << "rate" << endl;
+
+    measure(results, config, "sphere::hit", "call", PASSES, [&]
+            {
+                hit_record rec;
+                int hits = 0;
+                for (const auto &r : rays)
+                    hits += target.hit(r, 0.001f, infinity, rec);
+                sink = hits;
+                return (double)rays.size(); });
+
+    const char *material_names[] = {"lambertian::scatter", "metal::scatter", "dielectric::scatter"};
+    uint32_t material_ids[] = {lambertian_id, metal_id, dielectric_id};
+    for (int m = 0; m < 3; m++)
+    {
+        measure(results, config, material_names[m], "call", PASSES, [&]
+                {
+                    const material &mat = materials[material_ids[m]];
+                    float acc = 0;
+                    for (int i = 0; i < BATCH; i++)
+                    {
+                        rng rand(i, 0);
+                        ray scattered;
+                        color attenuation;
+                        if (mat.scatter(rays[i], recs[i], attenuation, scattered, rand))
+                            acc += scattered.dir.x();
+                    }
+                    sink = acc;
+                    return (double)BATCH; });
+    }
+
+    measure(results, config, "camera::get_ray", "call", PASSES, [&]
+            {
+                float acc = 0;
+                for (int i = 0; i < BATCH; i++)
+                {
+                    rng rand(i, 0);
+                    acc += cam.get_ray(us[i], vs[i], rand).dir.x();
+                }
+                sink = acc;
+                return (double)BATCH; });
+
+    measure(results, config, "vec3 dot", "call", PASSES, [&]
+            {
+                float acc = 0;
+                for (int i = 0; i < BATCH; i++)
+                    acc += dot(va[i], vb[i]);
+                sink = acc;
+                return (double)BATCH; });
+
+    measure(results, config, "vec3 cross", "call", PASSES, [&]
+            {
+                vec3 acc;
+                for (int i = 0; i < BATCH; i++)
+                    acc += cross(va[i], vb[i]);
+                sink = acc.x() + acc.y() + acc.z();
+                return (double)BATCH; });
+
+    measure(results, config, "vec3 unit_vector", "call", PASSES, [&]
+            {
+                vec3 acc;
+                for (int i = 0; i < BATCH; i++)
+                    acc += unit_vector(va[i]);
+                sink = acc.x() + acc.y() + acc.z();
+                return (double)BATCH; });
+
+    measure(results, config, "random_float", "call", PASSES, [&]
+            {
+                float acc = 0;
+                for (int i = 0; i < BATCH; i++)
+                    acc += random_float();
+                sink = acc;
+                return (double)BATCH; });
+
+    measure(results, config, "rng::next_float", "call", PASSES, [&]
+            {
+                rng rand(1, 2);
+                float acc = 0;
+                for (int i = 0; i < BATCH; i++)
+                    acc += rand.next_float();
+                sink = acc;
+                return (double)BATCH; });
+
+    // End-to-end: the whole image on one thread, counting every traced segment as a ray
+    std::vector<color> pixel_colors(IMG_WIDTH * IMG_HEIGHT);
+    render_context ctx{cam, world_bvh, materials, pixel_colors.data(), IMG_WIDTH, IMG_HEIGHT, SAMPLES_PER_PIXEL, MAX_DEPTH};
+    for (int k = 0; k < num_sample_kernels; k++)
+    {
+        measure(results, config, string("kernel ") + sample_kernels[k].name, "ray", 1, [&]
+                {
+                    reset_path_counters();
+                    for (int j = 0; j < IMG_HEIGHT; ++j)
+                        for (int i = 0; i < IMG_WIDTH; ++i)
+                            sample_kernels[k].func(ctx, i, j);
+                    flush_path_counters();
+                    return (double)total_segments; });
+    }
+
+    wavefront_renderer renderer(IMG_WIDTH, IMG_HEIGHT, SAMPLES_PER_PIXEL, MAX_DEPTH);
+    tile_scheduler scheduler(IMG_WIDTH, IMG_HEIGHT, 16, 1);
+    measure(results, config, "kernel Wavefront", "ray", 1, [&]
+            {
+                reset_path_counters();
+                scheduler.run([&](const tile &t, int)
+                              { renderer.render_tile(cam, world_bvh, materials, pixel_colors.data(), t); },
+                              false);
+                flush_path_counters();
+                return (double)total_segments; });
+
+    if (json_path.empty())
+        write_json(cout, results, config);
+    else
+    {
+        std::ofstream out(json_path);
+        write_json(out, results, config);
+        if (!out)
+        {
+            cerr << "Could not write " << json_path << endl;
+            return 1;
+        }
+    }
+}
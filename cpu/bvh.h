@@ -0,0 +1,441 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "packed_spheres.h"
+#include "sphere.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// One node of the flattened BVH. Nodes are stored depth-first, so an interior
+// node's first child sits right after it and only the second child's index
+// needs storing. Leaves store a contiguous range of primitives instead.
+// 32 bytes, so two nodes share a cache line; the bounds are kept as plain
+// floats because a padded vec3 would not fit.
+struct alignas(32) bvh_node
+{
+    float lower[3], upper[3];
+    int32_t offset;      // leaf: first primitive, interior: second child
+    uint16_t prim_count; // 0 for interior nodes
+    uint8_t axis;        // split axis, used to order traversal
+    uint8_t pad;
+
+    aabb bounds() const { return aabb(point3(lower[0], lower[1], lower[2]), point3(upper[0], upper[1], upper[2])); }
+
+    void set_bounds(const aabb &box)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lower[a] = box.minimum[a];
+            upper[a] = box.maximum[a];
+        }
+    }
+};
+
+static_assert(sizeof(bvh_node) == 32, "two nodes per cache line");
+
+// Deepest tree the traversal stacks hold. The builder switches to median
+// splits past bvh_median_depth; those halve the range, so the at most 2^31
+// primitives below take no more than 31 further levels.
+const int bvh_max_depth = 96;
+const int bvh_median_depth = bvh_max_depth - 32;
+
+// A primitive as the builder sees it
+struct bvh_build_prim
+{
+    aabb bounds;
+    point3 centroid;
+    int index; // caller's primitive index
+};
+
+// Binned SAH builder producing the flattened layout above. The tree only
+// refers to primitives by position in `order`, which lists the callers'
+// primitive indices so that every leaf covers a contiguous range of it.
+class bvh_builder
+{
+public:
+    // leaf_width is how many primitives one intersection step tests, e.g. the
+    // SIMD width of a packed leaf test
+    bvh_builder(int max_prims_in_leaf, int leaf_width)
+        : max_leaf(std::max(std::min(max_prims_in_leaf, 255), leaf_width)), leaf_width(leaf_width) {}
+
+    void build(std::vector<bvh_build_prim> &prims, std::vector<bvh_node> &nodes, std::vector<int> &order);
+
+private:
+    int build(int start, int end, int depth);
+    int median_split(int start, int end, int axis);
+    int make_leaf(int node_index, int start, int end);
+
+    // Leaf cost in units of one intersection step, for SAH
+    float leaf_cost(int n) const { return (float)((n + leaf_width - 1) / leaf_width); }
+
+    int max_leaf;
+    int leaf_width;
+    std::vector<bvh_build_prim> *prims = nullptr;
+    std::vector<bvh_node> *nodes = nullptr;
+    std::vector<int> *order = nullptr;
+};
+
+// Walks a flattened tree front to back and calls
+// leaf(first, count, t_max) for every leaf the ray reaches, which tests
+// primitives [first, first + count) and returns true if it found a hit
+// closer than t_max, lowering t_max to it.
+template <typename LeafTest>
+inline bool traverse_bvh(const bvh_node *nodes, const ray &r, float t_min, float t_max, LeafTest &&leaf)
+{
+    vec3 inv_dir(1 / r.dir.x(), 1 / r.dir.y(), 1 / r.dir.z());
+    bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+    int stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = 0;
+    bool hit_anything = false;
+
+    while (true)
+    {
+        const bvh_node &node = nodes[current];
+        STAT_ADD(node_tests, 1);
+        if (node.bounds().hit(r, inv_dir, t_min, t_max))
+        {
+            if (node.prim_count > 0)
+            {
+                STAT_ADD(primitive_tests, node.prim_count);
+                if (leaf(node.offset, (int)node.prim_count, t_max))
+                    hit_anything = true;
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+            else if (dir_is_neg[node.axis])
+            {
+                // Visit the near child first so t_max shrinks before the far one
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            }
+            else
+            {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        }
+        else
+        {
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+    }
+
+    return hit_anything;
+}
+
+class bvh : public hittable
+{
+public:
+    bvh() {}
+    // When every object is a sphere and pack_spheres is set, leaves are tested
+    // with the SIMD packed_spheres intersector instead of per-object hit calls.
+    bvh(const hittable_list &list, int max_prims_in_leaf = 4, bool pack_spheres = true);
+    // A prebuilt tree over spheres, e.g. from a mapped scene file. Both the
+    // nodes and the spheres are used in place.
+    bvh(const bvh_node *nodes, int node_count, packed_spheres &&spheres)
+        : nodes(nodes), node_count(node_count), packed(std::move(spheres)), use_packed(true) {}
+
+    // `nodes` may point into this object's own storage
+    bvh(const bvh &) = delete;
+    bvh &operator=(const bvh &) = delete;
+
+    virtual bool hit(
+        const ray &r, float t_min, float t_max, hit_record &rec) const override;
+
+    virtual bool bounding_box(aabb &output_box) const override;
+
+    // True when leaves are tested through `packed` rather than `primitives`
+    bool packed_leaves() const { return use_packed; }
+
+    // Recomputes every node's bounds, bottom up, after primitives moved.
+    // The topology is kept, so the tree stays valid but gets looser as the
+    // motion grows, until a rebuild pays off. Only for trees built by this
+    // object, not prebuilt ones.
+    void refit();
+
+public:
+    // Primitives reordered so every leaf references a contiguous range
+    std::vector<shared_ptr<hittable>> primitives;
+    const bvh_node *nodes = nullptr;
+    int node_count = 0;
+
+    // Spheres in primitive order, used for leaf tests when use_packed is set
+    packed_spheres packed;
+
+private:
+    bool use_packed = false;
+    std::vector<bvh_node> node_storage;
+};
+
+void bvh_builder::build(std::vector<bvh_build_prim> &prims, std::vector<bvh_node> &nodes, std::vector<int> &order)
+{
+    this->prims = &prims;
+    this->nodes = &nodes;
+    this->order = &order;
+    nodes.clear();
+    order.clear();
+    if (prims.empty())
+        return;
+
+    order.reserve(prims.size());
+    nodes.reserve(2 * prims.size());
+    build(0, (int)prims.size(), 0);
+    nodes.shrink_to_fit();
+}
+
+bvh::bvh(const hittable_list &list, int max_prims_in_leaf, bool pack_spheres)
+{
+    use_packed = pack_spheres && !list.objects.empty();
+    for (const auto &object : list.objects)
+    {
+        if (!dynamic_cast<const sphere *>(object.get()))
+        {
+            use_packed = false;
+            break;
+        }
+    }
+
+    std::vector<bvh_build_prim> prims;
+    prims.reserve(list.objects.size());
+    for (int i = 0; i < (int)list.objects.size(); i++)
+    {
+        aabb box;
+        if (!list.objects[i]->bounding_box(box))
+        {
+            std::cerr << "No bounding box in bvh constructor.\n";
+            continue;
+        }
+        prims.push_back({box, box.centroid(), i});
+    }
+
+    // A SIMD leaf test costs the same for up to `lanes` spheres
+    std::vector<int> order;
+    bvh_builder(max_prims_in_leaf, use_packed ? packed_spheres::lanes : 1).build(prims, node_storage, order);
+    nodes = node_storage.data();
+    node_count = (int)node_storage.size();
+
+    primitives.reserve(order.size());
+    for (int index : order)
+        primitives.push_back(list.objects[index]);
+
+    if (use_packed)
+    {
+        for (const auto &object : primitives)
+            packed.add(*static_cast<const sphere *>(object.get()));
+    }
+}
+
+int bvh_builder::make_leaf(int node_index, int start, int end)
+{
+    (*nodes)[node_index].offset = (int32_t)order->size();
+    (*nodes)[node_index].prim_count = (uint16_t)(end - start);
+    for (int i = start; i < end; i++)
+        order->push_back((*prims)[i].index);
+    return node_index;
+}
+
+// Splits [start, end) at its middle by centroid along `axis`
+int bvh_builder::median_split(int start, int end, int axis)
+{
+    int mid = (start + end) / 2;
+    std::nth_element(prims->begin() + start, prims->begin() + mid, prims->begin() + end,
+                     [axis](const bvh_build_prim &a, const bvh_build_prim &b)
+                     { return a.centroid[axis] < b.centroid[axis]; });
+    return mid;
+}
+
+int bvh_builder::build(int start, int end, int depth)
+{
+    std::vector<bvh_build_prim> &prims = *this->prims;
+    std::vector<bvh_node> &nodes = *this->nodes;
+
+    int node_index = (int)nodes.size();
+    nodes.emplace_back();
+
+    aabb bounds, centroid_bounds;
+    for (int i = start; i < end; i++)
+    {
+        bounds = surrounding_box(bounds, prims[i].bounds);
+        centroid_bounds = surrounding_box(centroid_bounds, prims[i].centroid);
+    }
+    nodes[node_index].set_bounds(bounds);
+
+    int n = end - start;
+    if (n == 1)
+        return make_leaf(node_index, start, end);
+
+    int axis = centroid_bounds.max_extent();
+    float cmin = centroid_bounds.min()[axis];
+    float cmax = centroid_bounds.max()[axis];
+    int mid;
+
+    if (cmax == cmin || depth >= bvh_median_depth)
+    {
+        // All centroids coincide, so no plane separates them, or the tree is
+        // as deep as traversal allows
+        if (n <= max_leaf)
+            return make_leaf(node_index, start, end);
+        mid = cmax == cmin ? (start + end) / 2 : median_split(start, end, axis);
+    }
+    else
+    {
+        // Binned SAH: drop centroids into buckets along the widest axis and
+        // sweep the bucket boundaries for the cheapest split.
+        const int n_buckets = 16;
+        struct bucket
+        {
+            int count = 0;
+            aabb bounds;
+        };
+        bucket buckets[n_buckets];
+
+        auto bucket_of = [&](const bvh_build_prim &p)
+        {
+            int b = (int)(n_buckets * ((p.centroid[axis] - cmin) / (cmax - cmin)));
+            return b < n_buckets ? b : n_buckets - 1;
+        };
+
+        for (int i = start; i < end; i++)
+        {
+            int b = bucket_of(prims[i]);
+            buckets[b].count++;
+            buckets[b].bounds = surrounding_box(buckets[b].bounds, prims[i].bounds);
+        }
+
+        float cost[n_buckets - 1];
+        int left_count[n_buckets - 1];
+        aabb left;
+        int count = 0;
+        for (int i = 0; i < n_buckets - 1; i++)
+        {
+            left = surrounding_box(left, buckets[i].bounds);
+            count += buckets[i].count;
+            left_count[i] = count;
+            cost[i] = leaf_cost(count) * left.surface_area();
+        }
+        aabb right;
+        count = 0;
+        for (int i = n_buckets - 1; i > 0; i--)
+        {
+            right = surrounding_box(right, buckets[i].bounds);
+            count += buckets[i].count;
+            cost[i - 1] += leaf_cost(count) * right.surface_area();
+        }
+
+        int min_bucket = -1;
+        float min_cost = infinity;
+        for (int i = 0; i < n_buckets - 1; i++)
+        {
+            if (left_count[i] == 0 || left_count[i] == n)
+                continue;
+            if (cost[i] < min_cost)
+            {
+                min_cost = cost[i];
+                min_bucket = i;
+            }
+        }
+
+        // Relative cost of one traversal step against one primitive test
+        const float traversal_cost = 0.125f;
+        float split_cost = traversal_cost + min_cost / bounds.surface_area();
+        if (n <= max_leaf && split_cost >= leaf_cost(n))
+            return make_leaf(node_index, start, end);
+
+        // Every cost is inf or NaN when the boxes' areas overflow, and then
+        // no bucket is chosen
+        mid = start;
+        if (min_bucket >= 0)
+        {
+            auto pmid = std::partition(
+                prims.begin() + start, prims.begin() + end,
+                [&](const bvh_build_prim &p)
+                { return bucket_of(p) <= min_bucket; });
+            mid = (int)(pmid - prims.begin());
+        }
+        if (mid == start || mid == end)
+            mid = median_split(start, end, axis);
+    }
+
+    nodes[node_index].axis = (uint8_t)axis;
+    build(start, mid, depth + 1);
+    nodes[node_index].offset = build(mid, end, depth + 1);
+    return node_index;
+}
+
+bool bvh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+    if (node_count == 0)
+        return false;
+
+    if (use_packed)
+    {
+        return traverse_bvh(nodes, r, t_min, t_max, [&](int first, int count, float &closest)
+                            {
+                                if (!packed.hit_range(r, first, count, t_min, closest, rec))
+                                    return false;
+                                closest = rec.t;
+                                return true; });
+    }
+
+    // A hittable only writes rec when it reports a closer hit
+    return traverse_bvh(nodes, r, t_min, t_max, [&](int first, int count, float &closest)
+                        {
+                            bool hit_anything = false;
+                            for (int i = first; i < first + count; i++)
+                            {
+                                if (primitives[i]->hit(r, t_min, closest, rec))
+                                {
+                                    hit_anything = true;
+                                    closest = rec.t;
+                                }
+                            }
+                            return hit_anything; });
+}
+
+void bvh::refit()
+{
+    if (node_storage.empty())
+        return;
+
+    // Children always come after their parent, so a backwards sweep sees
+    // both children of a node before the node itself
+    for (int n = node_count - 1; n >= 0; n--)
+    {
+        bvh_node &node = node_storage[n];
+        if (node.prim_count == 0)
+        {
+            node.set_bounds(surrounding_box(node_storage[n + 1].bounds(), node_storage[node.offset].bounds()));
+            continue;
+        }
+
+        aabb bounds;
+        for (int i = node.offset; i < node.offset + node.prim_count; i++)
+        {
+            aabb box;
+            primitives[i]->bounding_box(box);
+            bounds = surrounding_box(bounds, box);
+            if (use_packed)
+                packed.set(i, *static_cast<const sphere *>(primitives[i].get()));
+        }
+        node.set_bounds(bounds);
+    }
+}
+
+bool bvh::bounding_box(aabb &output_box) const
+{
+    if (node_count == 0)
+        return false;
+    output_box = nodes[0].bounds();
+    return true;
+}
@@ -0,0 +1,108 @@
+/*
+    BVH crossover benchmark
+
+    Traces the same batch of random rays against N random spheres through
+    the flat hittable_list, the flat SIMD packed_spheres, and the bvh with
+    scalar and packed leaves, doubling N each round, and reports where the
+    BVH starts to win over the linear list.
+
+    Build: g++ -O3 -march=native -o bvh_bench bvh_bench.cc
+    Usage: ./bvh_bench [max_primitives] [rays]
+*/
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "packed_spheres.h"
+#include "sphere.h"
+
+/* Spheres scattered through a cube that grows with N so density stays constant */
+hittable_list sphere_cloud(int n, uint32_t mat)
+{
+    hittable_list world;
+    scene_arena arena;
+    float extent = 4.0f * std::cbrt((float)n);
+    for (int i = 0; i < n; i++)
+    {
+        point3 center = vec3::random(-extent, extent);
+        world.add(arena.make<sphere>(center, random_float(0.2f, 1.0f), mat));
+    }
+    return world;
+}
+
+/* Returns seconds per ray and writes the hit count so the work can't be optimized away */
+double time_rays(const hittable &world, const std::vector<ray> &rays, int &hits)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    hit_record rec;
+    hits = 0;
+    for (const auto &r : rays)
+        hits += world.hit(r, 0.001f, infinity, rec);
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count() / rays.size();
+}
+
+int main(int argc, char **argv)
+{
+    int max_prims = argc > 1 ? atoi(argv[1]) : 1 << 17;
+    int num_rays = argc > 2 ? atoi(argv[2]) : 1 << 16;
+
+    // Only intersection is timed, so every sphere uses material 0
+    uint32_t mat = 0;
+    int crossover = -1;
+
+    cout << "SIMD lanes: " << packed_spheres::lanes << "\n\n";
+    cout << "primitives\tlist ns/ray\tpacked ns/ray\tbvh ns/ray\tbvh+packed ns/ray\tbuild ms\tspeedup" << endl;
+    for (int n = 1; n <= max_prims; n *= 2)
+    {
+        auto world = sphere_cloud(n, mat);
+
+        auto build_start = std::chrono::high_resolution_clock::now();
+        bvh world_bvh(world);
+        auto build_end = std::chrono::high_resolution_clock::now();
+        double build_ms = std::chrono::duration<double, std::milli>(build_end - build_start).count();
+
+        // Keep the linear scan's total work bounded at large N
+        int rays_this_round = std::max(256, std::min(num_rays, (1 << 24) / n));
+        std::vector<ray> rays;
+        rays.reserve(rays_this_round);
+        for (int i = 0; i < rays_this_round; i++)
+            rays.push_back(ray(vec3::random(-1, 1), unit_vector(vec3::random(-1, 1))));
+
+        packed_spheres packed(world);
+        bvh scalar_bvh(world, 4, false);
+
+        int list_hits, packed_hits, scalar_bvh_hits, bvh_hits;
+        double list_time = time_rays(world, rays, list_hits);
+        double packed_time = time_rays(packed, rays, packed_hits);
+        double scalar_bvh_time = time_rays(scalar_bvh, rays, scalar_bvh_hits);
+        double bvh_time = time_rays(world_bvh, rays, bvh_hits);
+
+        // The SIMD path may round differently on grazing hits, so only the
+        // scalar BVH has to agree exactly with the list
+        if (list_hits != scalar_bvh_hits)
+            cerr << "Hit count mismatch at N=" << n << ": " << list_hits << " vs " << scalar_bvh_hits << endl;
+        if (std::abs(list_hits - packed_hits) > rays_this_round / 1000 || std::abs(list_hits - bvh_hits) > rays_this_round / 1000)
+            cerr << "Packed hit count off at N=" << n << ": " << list_hits << " vs " << packed_hits << ", " << bvh_hits << endl;
+        if (crossover < 0 && bvh_time < list_time)
+            crossover = n;
+
+        cout << n << "\t\t" << list_time * 1e9 << "\t\t" << packed_time * 1e9 << "\t\t"
+             << scalar_bvh_time * 1e9 << "\t\t" << bvh_time * 1e9 << "\t\t"
+             << build_ms << "\t\t" << list_time / bvh_time << endl;
+    }
+
+    if (crossover > 0)
+        cout << "\nBVH is faster from " << crossover << " primitives" << endl;
+    else
+        cout << "\nBVH never overtook the linear list" << endl;
+}
@@ -29,9 +29,9 @@ public:
 
         lens_radius = aperture / 2;
     }
-    ray get_ray(float s, float t) const
+    ray get_ray(float s, float t, rng &rand) const
     {
-        vec3 rd = lens_radius * random_in_unit_disk();
+        vec3 rd = lens_radius * random_in_unit_disk(rand);
         vec3 offset = u * rd.x() + v * rd.y();
 
         return ray(
@@ -46,4 +46,39 @@ private:
     vec3 vertical;
     vec3 u, v, w;
     float lens_radius;
-};
\ No newline at end of file
+};
+
+// camera() arguments other than the aspect ratio, which comes from the image
+struct scene_camera_record
+{
+    float lookfrom[3];
+    float lookat[3];
+    float vup[3];
+    float vfov; // vertical field-of-view in degrees
+    float aperture;
+    float focus_dist;
+};
+
+inline camera make_camera(const scene_camera_record &c, float aspect_ratio)
+{
+    return camera(point3(c.lookfrom[0], c.lookfrom[1], c.lookfrom[2]),
+                  point3(c.lookat[0], c.lookat[1], c.lookat[2]),
+                  vec3(c.vup[0], c.vup[1], c.vup[2]),
+                  c.vfov, aspect_ratio, c.aperture, c.focus_dist);
+}
+
+inline scene_camera_record camera_settings(point3 lookfrom, point3 lookat, vec3 vup, float vfov, float aperture,
+                                           float focus_dist)
+{
+    scene_camera_record c;
+    for (int i = 0; i < 3; i++)
+    {
+        c.lookfrom[i] = lookfrom[i];
+        c.lookat[i] = lookat[i];
+        c.vup[i] = vup[i];
+    }
+    c.vfov = vfov;
+    c.aperture = aperture;
+    c.focus_dist = focus_dist;
+    return c;
+}
@@ -0,0 +1,314 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "integrator.h"
+#include "kernels.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Checkpoint file: a header followed by the per-pixel colour sums and
+// sample counts of a render in progress. Like scene files, values are in
+// native byte order; the header names the image size, sampler settings,
+// sample kernel and scene fingerprint, so a checkpoint only resumes the
+// render it came from. The kernel is part of that: kernels sum a pixel's
+// samples in different orders, so a render finished with another kernel
+// would differ in the last bits from one that never stopped.
+
+const char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0'};
+const uint32_t checkpoint_version = 2;
+
+struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t max_depth;
+    uint32_t pattern;
+    uint32_t kernel; // index into sample_kernels
+    uint64_t fingerprint;
+    uint64_t total_samples; // sum of the per-pixel counts
+};
+
+// Accumulates samples in passes, keeping a sum and a sample count per pixel,
+// and writes them to a checkpoint file from a background thread so a
+// preempted render can pick up where it stopped.
+//
+// Each pass adds up to pass_samples samples to every pixel, as whole tiles.
+// A finished tile is merged under a lock, and the checkpoint thread copies
+// the buffers under the same lock and writes them outside it, so rendering
+// never waits on the disk. Sample s of a pixel always uses rng(pixel, s),
+// so a resumed or extended render draws exactly the samples an
+// uninterrupted one would; only the order of the additions differs.
+class progressive_renderer
+{
+public:
+    progressive_renderer(int width, int height, const render_context &ctx, int kernel, uint64_t fingerprint);
+
+    // Continues from `path` if it holds a checkpoint of this render.
+    // Returns false with a reason in `error` if it does not; a missing file
+    // is not an error and leaves `resumed` unset.
+    bool resume(const std::string &path, bool &resumed, std::string &error);
+
+    // Renders until every pixel has `target` samples or `stop` is set,
+    // writing a checkpoint to `path` every `interval` seconds and once at
+    // the end. Returns false if stopped early.
+    bool render(const render_context &ctx, ray_function func, tile_scheduler &scheduler, int target,
+                int pass_samples, const std::string &path, double interval, const std::atomic<bool> &stop);
+
+    // Mean of every pixel, for writing with samples_per_pixel = 1
+    void resolve(color *pixel_colors) const;
+
+    uint64_t total_samples() const;
+    int checkpoints_written() const { return checkpoints; }
+    double checkpoint_seconds() const { return checkpoint_time; }
+
+public:
+    std::vector<color> sums;
+    std::vector<uint32_t> counts;
+
+private:
+    bool write(const std::string &path, std::string &error);
+    checkpoint_header make_header() const;
+
+    int width, height;
+    uint32_t max_depth, pattern, kernel;
+    uint64_t fingerprint;
+    std::vector<color> scratch; // one pass of kernel output
+
+    std::mutex merge_lock;
+    // Snapshot written by the checkpoint thread
+    std::vector<color> saved_sums;
+    std::vector<uint32_t> saved_counts;
+    int checkpoints = 0;
+    double checkpoint_time = 0;
+};
+
+// The sample kernel a checkpoint was started with, or -1 if `path` holds
+// no checkpoint this build reads
+int checkpoint_kernel(const std::string &path)
+{
+    std::FILE *in = std::fopen(path.c_str(), "rb");
+    if (!in)
+        return -1;
+    checkpoint_header header;
+    bool ok = std::fread(&header, sizeof(header), 1, in) == 1 &&
+              std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) == 0 &&
+              header.version == checkpoint_version && header.kernel < (uint32_t)num_sample_kernels;
+    std::fclose(in);
+    return ok ? (int)header.kernel : -1;
+}
+
+progressive_renderer::progressive_renderer(int width, int height, const render_context &ctx, int kernel,
+                                           uint64_t fingerprint)
+    : sums(width * height), counts(width * height, 0), width(width), height(height), max_depth(ctx.max_depth),
+      pattern((uint32_t)ctx.pattern), kernel(kernel), fingerprint(fingerprint), scratch(width * height)
+{
+}
+
+checkpoint_header progressive_renderer::make_header() const
+{
+    checkpoint_header header = {};
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.width = width;
+    header.height = height;
+    header.max_depth = max_depth;
+    header.pattern = pattern;
+    header.kernel = kernel;
+    header.fingerprint = fingerprint;
+    return header;
+}
+
+bool progressive_renderer::resume(const std::string &path, bool &resumed, std::string &error)
+{
+    resumed = false;
+    std::FILE *in = std::fopen(path.c_str(), "rb");
+    if (!in)
+        return true;
+
+    checkpoint_header expected = make_header(), header;
+    bool ok = std::fread(&header, sizeof(header), 1, in) == 1;
+    if (!ok || std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0)
+        error = path + " is not a checkpoint";
+    else if (header.version != checkpoint_version)
+        error = path + " is checkpoint version " + std::to_string(header.version) +
+                ", this build reads version " + std::to_string(checkpoint_version);
+    else if (header.width != expected.width || header.height != expected.height ||
+             header.max_depth != expected.max_depth || header.pattern != expected.pattern ||
+             header.fingerprint != expected.fingerprint)
+        error = path + " is a checkpoint of a different scene or different settings";
+    else if (header.kernel != expected.kernel)
+        error = path + " was started with --kernel " + std::to_string(header.kernel) + ", not " +
+                std::to_string(expected.kernel);
+    else
+    {
+        // Sums are stored as three floats per pixel, without color's padding
+        std::vector<float> flat(sums.size() * 3);
+        if (std::fread(flat.data(), sizeof(float), flat.size(), in) != flat.size() ||
+            std::fread(counts.data(), sizeof(uint32_t), counts.size(), in) != counts.size())
+            error = path + " is truncated";
+        else
+        {
+            for (size_t p = 0; p < sums.size(); p++)
+                sums[p] = color(flat[p * 3], flat[p * 3 + 1], flat[p * 3 + 2]);
+            resumed = true;
+        }
+    }
+    std::fclose(in);
+
+    if (!resumed)
+    {
+        std::fill(sums.begin(), sums.end(), color());
+        std::fill(counts.begin(), counts.end(), 0);
+    }
+    return resumed;
+}
+
+// Writes the last snapshot to a temporary file and renames it over `path`,
+// so a crash while writing leaves the previous checkpoint intact
+bool progressive_renderer::write(const std::string &path, std::string &error)
+{
+    auto start = std::chrono::steady_clock::now();
+    checkpoint_header header = make_header();
+    for (uint32_t c : saved_counts)
+        header.total_samples += c;
+
+    std::string temporary = path + ".tmp";
+    std::FILE *out = std::fopen(temporary.c_str(), "wb");
+    if (!out)
+    {
+        error = "cannot create " + temporary;
+        return false;
+    }
+    std::vector<float> flat;
+    flat.reserve(saved_sums.size() * 3);
+    for (const color &sum : saved_sums)
+        flat.insert(flat.end(), sum.e, sum.e + 3);
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(flat.data(), sizeof(float), flat.size(), out) == flat.size() &&
+              std::fwrite(saved_counts.data(), sizeof(uint32_t), saved_counts.size(), out) == saved_counts.size();
+    ok = std::fclose(out) == 0 && ok;
+    ok = ok && std::rename(temporary.c_str(), path.c_str()) == 0;
+    if (!ok)
+    {
+        error = "cannot write " + path;
+        std::remove(temporary.c_str());
+        return false;
+    }
+    checkpoints++;
+    checkpoint_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+bool progressive_renderer::render(const render_context &ctx, ray_function func, tile_scheduler &scheduler,
+                                  int target, int pass_samples, const std::string &path, double interval,
+                                  const std::atomic<bool> &stop)
+{
+    pass_samples = std::max(1, pass_samples);
+
+    auto snapshot = [&]
+    {
+        std::lock_guard<std::mutex> guard(merge_lock);
+        saved_sums = sums;
+        saved_counts = counts;
+    };
+
+    std::mutex wait_lock;
+    std::condition_variable wake;
+    bool finished = false;
+    std::thread writer([&]
+                       {
+                           std::unique_lock<std::mutex> guard(wait_lock);
+                           while (!wake.wait_for(guard, std::chrono::duration<double>(interval), [&]
+                                                 { return finished; }))
+                           {
+                               guard.unlock();
+                               snapshot();
+                               std::string error;
+                               if (!write(path, error))
+                                   fprintf(stderr, "%s\n", error.c_str());
+                               guard.lock();
+                           }
+                       });
+
+    render_context pass = ctx;
+    pass.pixel_colors = scratch.data();
+    bool complete = false;
+    while (!complete && !stop)
+    {
+        scheduler.run([&](const tile &t, int)
+                      {
+                          if (stop)
+                              return;
+                          render_context local = pass;
+                          for (int j = t.y0; j < t.y1; ++j)
+                          {
+                              for (int i = t.x0; i < t.x1; ++i)
+                              {
+                                  int index = (height - j - 1) * width + i;
+                                  local.first_sample = counts[index];
+                                  local.samples_per_pixel = std::min(target, local.first_sample + pass_samples);
+                                  if (local.first_sample < local.samples_per_pixel)
+                                      func(local, i, j);
+                              }
+                          }
+                          flush_path_counters();
+
+                          std::lock_guard<std::mutex> guard(merge_lock);
+                          for (int j = t.y0; j < t.y1; ++j)
+                          {
+                              for (int i = t.x0; i < t.x1; ++i)
+                              {
+                                  int index = (height - j - 1) * width + i;
+                                  int end = std::min(target, (int)counts[index] + pass_samples);
+                                  if ((int)counts[index] < end)
+                                  {
+                                      sums[index] += scratch[index];
+                                      counts[index] = end;
+                                  }
+                              }
+                          }
+                      });
+        complete = std::all_of(counts.begin(), counts.end(), [&](uint32_t c)
+                               { return (int)c >= target; });
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(wait_lock);
+        finished = true;
+    }
+    wake.notify_all();
+    writer.join();
+
+    snapshot();
+    std::string error;
+    if (!write(path, error))
+        fprintf(stderr, "%s\n", error.c_str());
+    return complete;
+}
+
+void progressive_renderer::resolve(color *pixel_colors) const
+{
+    for (size_t p = 0; p < sums.size(); p++)
+        pixel_colors[p] = counts[p] ? sums[p] / (float)counts[p] : color();
+}
+
+uint64_t progressive_renderer::total_samples() const
+{
+    uint64_t total = 0;
+    for (uint32_t c : counts)
+        total += c;
+    return total;
+}
@@ -1,14 +1,15 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "aabb.h"
 
-class material;
+#include <cstdint>
 
 struct hit_record
 {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    uint32_t mat_id; // index into the scene's material_table
     float t;
     bool front_face;
 
@@ -23,4 +24,5 @@ class hittable
 {
 public:
     virtual bool hit(const ray &r, float t_min, float t_max, hit_record &rec) const = 0;
+    virtual bool bounding_box(aabb &output_box) const = 0;
 };
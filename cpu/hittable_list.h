@@ -3,6 +3,7 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "stats.h"
 
 #include <memory>
 #include <vector>
@@ -19,6 +20,8 @@ public:
     virtual bool hit(
         const ray &r, float t_min, float t_max, hit_record &rec) const override;
 
+    virtual bool bounding_box(aabb &output_box) const override;
+
 public:
     std::vector<shared_ptr<hittable>> objects;
 };
@@ -28,6 +31,7 @@ bool hittable_list::hit(const ray &r, float t_min, float t_max, hit_record &rec)
     hit_record temp_rec;
     auto hit_anything = false;
     auto closest_so_far = t_max;
+    STAT_ADD(primitive_tests, objects.size());
 
     for (const auto &object : objects)
     {
@@ -41,3 +45,21 @@ bool hittable_list::hit(const ray &r, float t_min, float t_max, hit_record &rec)
 
     return hit_anything;
 }
+
+bool hittable_list::bounding_box(aabb &output_box) const
+{
+    if (objects.empty())
+        return false;
+
+    aabb temp_box;
+    output_box = aabb();
+
+    for (const auto &object : objects)
+    {
+        if (!object->bounding_box(temp_box))
+            return false;
+        output_box = surrounding_box(output_box, temp_box);
+    }
+
+    return true;
+}
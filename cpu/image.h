@@ -0,0 +1,408 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// Output formats for the accumulated image
+//
+//   p3  - ASCII PPM, gamma 2, 8 bits (the original output)
+//   p6  - binary PPM, gamma 2, 8 bits
+//   pfm - linear 32-bit float RGB, unclamped
+//   exr - linear 16-bit half RGB in an uncompressed scanline OpenEXR file
+//
+// The float formats keep the HDR average of the samples, so the image can be
+// composited or tonemapped later.
+enum class image_format
+{
+    p3,
+    p6,
+    pfm,
+    exr
+};
+
+inline bool parse_image_format(const std::string &name, image_format &format)
+{
+    if (name == "p3")
+        format = image_format::p3;
+    else if (name == "p6" || name == "ppm")
+        format = image_format::p6;
+    else if (name == "pfm")
+        format = image_format::pfm;
+    else if (name == "exr")
+        format = image_format::exr;
+    else
+        return false;
+    return true;
+}
+
+// Gamma 2, clamp and quantize every channel in one pass. Colors are padded
+// to four floats, so the padding lane is skipped rather than read as a
+// flat run of floats.
+inline void tonemap_8bit(const color *pixels, size_t count, int samples_per_pixel, uint8_t *out)
+{
+    const float scale = 1.0f / (float)samples_per_pixel;
+    for (size_t i = 0; i < count; i++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            float v = sqrtf(scale * pixels[i].e[c]);
+            v = std::min(std::max(v, 0.0f), 0.999f);
+            out[i * 3 + c] = (uint8_t)(int)(256 * v);
+        }
+    }
+}
+
+// IEEE binary16 from binary32, rounding to nearest even
+inline uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7FFFFFFF;
+
+    if (abs >= 0x7F800000) // inf or NaN
+        return sign | 0x7C00 | (abs > 0x7F800000 ? 0x200 : 0);
+    if (abs >= 0x477FF000) // rounds past the largest half
+        return sign | 0x7C00;
+    if (abs < 0x38800000) // half subnormal or zero
+    {
+        if (abs < 0x33000000)
+            return sign;
+        uint32_t mant = (abs & 0x7FFFFF) | 0x800000;
+        int shift = 126 - (abs >> 23);
+        uint32_t half = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+
+    uint32_t half = ((abs - 0x38000000) >> 13);
+    uint32_t rest = abs & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | half;
+}
+
+inline void floats_to_halves(const float *in, uint16_t *out, size_t n)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)(out + i), h);
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = float_to_half(in[i]);
+}
+
+namespace image_detail
+{
+    inline size_t exr_line_size(int width)
+    {
+        return 8 + (size_t)width * 3 * sizeof(uint16_t);
+    }
+
+    inline uint8_t *put(uint8_t *p, const void *data, size_t n)
+    {
+        std::memcpy(p, data, n);
+        return p + n;
+    }
+
+    inline uint8_t *put_i32(uint8_t *p, int32_t v) { return put(p, &v, 4); }
+    inline uint8_t *put_f32(uint8_t *p, float v) { return put(p, &v, 4); }
+
+    inline uint8_t *put_attribute(uint8_t *p, const char *name, const char *type, int32_t size)
+    {
+        p = put(p, name, std::strlen(name) + 1);
+        p = put(p, type, std::strlen(type) + 1);
+        return put_i32(p, size);
+    }
+
+    inline uint8_t *write_exr_header(uint8_t *p, int width, int height)
+    {
+        const uint8_t magic[8] = {0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0};
+        p = put(p, magic, 8);
+
+        // Channels must be listed in alphabetical order
+        p = put_attribute(p, "channels", "chlist", 55);
+        for (const char *name : {"B", "G", "R"})
+        {
+            p = put(p, name, 2);
+            p = put_i32(p, 1); // HALF
+            const uint8_t linear_and_reserved[4] = {0, 0, 0, 0};
+            p = put(p, linear_and_reserved, 4);
+            p = put_i32(p, 1); // x sampling
+            p = put_i32(p, 1); // y sampling
+        }
+        *p++ = 0;
+
+        p = put_attribute(p, "compression", "compression", 1);
+        *p++ = 0; // NO_COMPRESSION
+
+        for (const char *window : {"dataWindow", "displayWindow"})
+        {
+            p = put_attribute(p, window, "box2i", 16);
+            p = put_i32(p, 0);
+            p = put_i32(p, 0);
+            p = put_i32(p, width - 1);
+            p = put_i32(p, height - 1);
+        }
+
+        p = put_attribute(p, "lineOrder", "lineOrder", 1);
+        *p++ = 0; // INCREASING_Y
+
+        p = put_attribute(p, "pixelAspectRatio", "float", 4);
+        p = put_f32(p, 1.0f);
+        p = put_attribute(p, "screenWindowCenter", "v2f", 8);
+        p = put_f32(p, 0.0f);
+        p = put_f32(p, 0.0f);
+        p = put_attribute(p, "screenWindowWidth", "float", 4);
+        p = put_f32(p, 1.0f);
+
+        *p++ = 0;
+        return p;
+    }
+
+    // The same for every image size, and asked for once per encoded tile
+    inline size_t exr_header_size()
+    {
+        static const size_t size = []
+        {
+            uint8_t header[512];
+            return (size_t)(write_exr_header(header, 1, 1) - header);
+        }();
+        return size;
+    }
+
+    inline int ppm_header(char *buf, size_t size, const char *magic, int width, int height)
+    {
+        return std::snprintf(buf, size, "%s\n%d %d\n255\n", magic, width, height);
+    }
+}
+
+// Upper bound on the encoded size. Exact for every format except p3, whose
+// lines vary in length.
+inline size_t max_encoded_size(image_format format, int width, int height)
+{
+    size_t pixels = (size_t)width * height;
+    switch (format)
+    {
+    case image_format::p3:
+        return 64 + pixels * 12; // "255 255 255\n"
+    case image_format::p6:
+        return image_detail::ppm_header(nullptr, 0, "P6", width, height) + pixels * 3;
+    case image_format::pfm:
+        return std::snprintf(nullptr, 0, "PF\n%d %d\n-1.0\n", width, height) + pixels * 3 * sizeof(float);
+    case image_format::exr:
+        return image_detail::exr_header_size() + (size_t)height * 8 + height * image_detail::exr_line_size(width);
+    }
+    return 0;
+}
+
+// Whether every pixel of `format` has a fixed place in the file, so spans of
+// it can be encoded in any order. p3's numbers vary in length.
+inline bool fixed_layout(image_format format)
+{
+    return format != image_format::p3;
+}
+
+// Writes everything of a fixed-layout image but its pixels into `image`,
+// which must hold max_encoded_size() bytes: the header, and for exr the
+// offset table and the head of every scanline chunk
+void encode_layout(image_format format, int width, int height, uint8_t *image)
+{
+    using namespace image_detail;
+    char header[64];
+    switch (format)
+    {
+    case image_format::p3:
+        break;
+    case image_format::p6:
+        put(image, header, ppm_header(header, sizeof(header), "P6", width, height));
+        break;
+    case image_format::pfm:
+        // Negative scale marks little-endian data; rows go bottom to top
+        put(image, header, std::snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height));
+        break;
+    case image_format::exr:
+    {
+        uint8_t *p = write_exr_header(image, width, height);
+
+        // One scanline per chunk, each chunk after the offset table
+        uint64_t offset = (p - image) + (uint64_t)height * 8;
+        for (int j = 0; j < height; j++)
+        {
+            p = put(p, &offset, 8);
+            offset += exr_line_size(width);
+        }
+        for (int j = 0; j < height; j++)
+        {
+            p = put_i32(p, j);
+            p = put_i32(p, width * 3 * sizeof(uint16_t));
+            p += width * 3 * sizeof(uint16_t);
+        }
+        break;
+    }
+    }
+}
+
+// Encodes the pixels in rows [row0, row1) (top row 0) and columns [x0, x1)
+// into `image`, a whole image of a fixed-layout format, at the bytes they
+// take in it. `pixels` is the whole accumulated image, as for
+// encode_image().
+void encode_rect(image_format format, const color *pixels, int width, int height, int samples_per_pixel,
+                 int row0, int row1, int x0, int x1, uint8_t *image)
+{
+    using namespace image_detail;
+    const float scale = 1.0f / (float)samples_per_pixel;
+    const int count = x1 - x0;
+
+    switch (format)
+    {
+    case image_format::p3:
+        break;
+    case image_format::p6:
+    {
+        uint8_t *data = image + max_encoded_size(format, width, height) - (size_t)width * height * 3;
+        for (int row = row0; row < row1; row++)
+        {
+            size_t first = (size_t)row * width + x0;
+            tonemap_8bit(pixels + first, count, samples_per_pixel, data + first * 3);
+        }
+        break;
+    }
+    case image_format::pfm:
+    {
+        uint8_t *data = image + max_encoded_size(format, width, height) - (size_t)width * height * 3 * sizeof(float);
+        for (int row = row0; row < row1; row++)
+        {
+            const color *span = pixels + (size_t)row * width + x0;
+            uint8_t *p = data + ((size_t)(height - 1 - row) * width + x0) * 3 * sizeof(float);
+            for (int i = 0; i < count; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    float v = span[i][c] * scale;
+                    std::memcpy(p, &v, sizeof(float));
+                    p += sizeof(float);
+                }
+            }
+        }
+        break;
+    }
+    case image_format::exr:
+    {
+        uint8_t *lines = image + exr_header_size() + (size_t)height * 8;
+        float channel[256];
+        for (int row = row0; row < row1; row++)
+        {
+            const color *span = pixels + (size_t)row * width + x0;
+            uint8_t *line = lines + row * exr_line_size(width) + 8;
+            for (int c = 2; c >= 0; c--) // B, G, R planes
+            {
+                uint16_t *plane = (uint16_t *)(line + (2 - c) * width * sizeof(uint16_t));
+                for (int start = 0; start < count; start += 256)
+                {
+                    int n = std::min(256, count - start);
+                    for (int i = 0; i < n; i++)
+                        channel[i] = span[start + i][c] * scale;
+                    floats_to_halves(channel, plane + x0 + start, n);
+                }
+            }
+        }
+        break;
+    }
+    }
+}
+
+// Encodes the accumulated pixel sums (top row first, samples_per_pixel
+// samples each) into out, which must hold max_encoded_size() bytes. Returns
+// the number of bytes written.
+size_t encode_image(image_format format, const color *pixels, int width, int height,
+                    int samples_per_pixel, uint8_t *out)
+{
+    using namespace image_detail;
+
+    if (fixed_layout(format))
+    {
+        encode_layout(format, width, height, out);
+        encode_rect(format, pixels, width, height, samples_per_pixel, 0, height, 0, width, out);
+        return max_encoded_size(format, width, height);
+    }
+
+    const size_t count = (size_t)width * height;
+    uint8_t *p = out;
+    char header[64];
+    p = put(p, header, ppm_header(header, sizeof(header), "P3", width, height));
+
+    std::vector<uint8_t> bytes(count * 3);
+    tonemap_8bit(pixels, count, samples_per_pixel, bytes.data());
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        unsigned v = bytes[i];
+        if (v >= 100)
+            *p++ = '0' + v / 100;
+        if (v >= 10)
+            *p++ = '0' + v / 10 % 10;
+        *p++ = '0' + v % 10;
+        *p++ = i % 3 == 2 ? '\n' : ' ';
+    }
+    return p - out;
+}
+
+// Encodes the image and writes it in one go. "-" writes to stdout with a
+// single write; a path is sized up front, mapped, and encoded straight into
+// the page cache. Returns false if the file could not be written.
+bool write_image(const std::string &path, image_format format, const color *pixels,
+                 int width, int height, int samples_per_pixel)
+{
+    size_t capacity = max_encoded_size(format, width, height);
+
+    if (path == "-")
+    {
+        std::vector<uint8_t> buffer(capacity);
+        size_t size = encode_image(format, pixels, width, height, samples_per_pixel, buffer.data());
+        std::fflush(stdout);
+        return std::fwrite(buffer.data(), 1, size, stdout) == size && std::fflush(stdout) == 0;
+    }
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, capacity) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = encode_image(format, pixels, width, height, samples_per_pixel, (uint8_t *)map);
+    bool ok = munmap(map, capacity) == 0;
+    // p3 may come in under the bound
+    ok = ok && ftruncate(fd, size) == 0;
+    return close(fd) == 0 && ok;
+}
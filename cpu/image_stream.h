@@ -0,0 +1,193 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "image.h"
+#include "scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Writes an image to its file while the frame is still rendering. Workers
+// push each tile as they finish it onto a lock-free queue; a background
+// encoder thread, asleep on a condition variable while the queue is empty,
+// takes the tiles off in the order they were pushed and encodes their pixels
+// straight into the mapped file, which was sized and given its header and
+// layout up front. Only fixed-layout formats stream, since a tile's bytes
+// must have a known place before the rows above it are done. Once the last
+// tile is in, only that tile is left to encode, instead of the whole image.
+class image_stream
+{
+public:
+    image_stream() {}
+    ~image_stream() { close(); }
+
+    image_stream(const image_stream &) = delete;
+    image_stream &operator=(const image_stream &) = delete;
+
+    // Whether write_image() would go to `path` in `format` in a way that can
+    // be streamed: a file rather than stdout, in a fixed-layout format
+    static bool can_stream(const std::string &path, image_format format)
+    {
+        return path != "-" && fixed_layout(format);
+    }
+
+    // Creates `path` for a width x height image of the pixel sums in
+    // `pixels` and starts the encoder, which expects `tiles` tiles. Returns
+    // false with the reason in `error` if the file could not be made.
+    bool open(const std::string &path, image_format format, const color *pixels, int width, int height,
+              int samples_per_pixel, size_t tiles, std::string &error);
+
+    // Hands over a tile whose pixels are final. Safe from any thread; never
+    // waits for the encoder, as the queue has a slot for every tile of the
+    // frame.
+    void push(const tile &t);
+
+    // Waits for every pushed tile to be written, then unmaps and closes the
+    // file. Returns false if it could not be written in full.
+    bool close();
+
+    // Time the encoder spent encoding, overlapped with the render but for
+    // the tiles still queued when close() was called
+    double encode_seconds = 0;
+
+private:
+    struct slot
+    {
+        tile t;
+        std::atomic<bool> ready{false};
+    };
+
+    void encoder_loop();
+
+    image_format format;
+    const color *pixels = nullptr;
+    int width = 0, height = 0, samples_per_pixel = 1;
+
+    int fd = -1;
+    uint8_t *image = nullptr;
+    size_t size = 0;
+
+    std::unique_ptr<slot[]> slots;
+    size_t capacity = 0;
+    std::atomic<size_t> pushed{0};
+    size_t written = 0; // by the encoder; read once it has been joined
+    std::atomic<bool> closing{false};
+    // The encoder waits on `wake` for the next slot or for close()
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::thread encoder;
+};
+
+bool image_stream::open(const std::string &path, image_format format, const color *pixels, int width, int height,
+                        int samples_per_pixel, size_t tiles, std::string &error)
+{
+    this->format = format;
+    this->pixels = pixels;
+    this->width = width;
+    this->height = height;
+    this->samples_per_pixel = samples_per_pixel;
+    size = max_encoded_size(format, width, height);
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        error = "Could not create " + path;
+        return false;
+    }
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        ::close(fd);
+        fd = -1;
+        error = "Could not map " + path;
+        return false;
+    }
+    image = (uint8_t *)map;
+    encode_layout(format, width, height, image);
+
+    capacity = tiles;
+    slots.reset(new slot[capacity]);
+    pushed = 0;
+    written = 0;
+    closing = false;
+    encoder = std::thread([this]
+                          { encoder_loop(); });
+    return true;
+}
+
+void image_stream::push(const tile &t)
+{
+    // Claiming a slot is the only contended step; the release store then
+    // publishes both the tile and the pixels the worker wrote before it
+    size_t index = pushed.fetch_add(1, std::memory_order_relaxed);
+    if (index >= capacity)
+        return;
+    slots[index].t = t;
+    slots[index].ready.store(true, std::memory_order_release);
+    // Taking the lock orders the store with the encoder's check, so it
+    // cannot miss this wake-up between testing the slot and waiting
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+    }
+    wake.notify_one();
+}
+
+void image_stream::encoder_loop()
+{
+    auto busy = std::chrono::high_resolution_clock::duration::zero();
+    while (written < capacity)
+    {
+        slot &next = slots[written];
+        if (!next.ready.load(std::memory_order_acquire))
+        {
+            std::unique_lock<std::mutex> guard(wake_lock);
+            wake.wait(guard, [&]
+                      { return next.ready.load(std::memory_order_acquire) || closing.load(std::memory_order_acquire); });
+            // Every push happens before close(), so once it has been called
+            // an empty slot stays empty
+            if (!next.ready.load(std::memory_order_acquire))
+                break;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        const tile &t = next.t; // y counts up from the bottom, rows down from the top
+        encode_rect(format, pixels, width, height, samples_per_pixel, height - t.y1, height - t.y0, t.x0, t.x1,
+                    image);
+        busy += std::chrono::high_resolution_clock::now() - start;
+        written++;
+    }
+    encode_seconds = std::chrono::duration<double>(busy).count();
+}
+
+bool image_stream::close()
+{
+    if (fd < 0)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> guard(wake_lock);
+        closing.store(true, std::memory_order_release);
+    }
+    wake.notify_one();
+    encoder.join();
+
+    bool ok = written == capacity;
+    ok = munmap(image, size) == 0 && ok;
+    ok = ::close(fd) == 0 && ok;
+    fd = -1;
+    image = nullptr;
+    slots.reset();
+    return ok;
+}
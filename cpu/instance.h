@@ -0,0 +1,79 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "transform.h"
+
+#include <cstdint>
+
+// A placement of shared geometry. The geometry, typically a bvh or a
+// triangle_mesh with its own tree, is referenced rather than copied, so a
+// thousand instances cost a thousand transforms plus one copy of the
+// geometry. Putting instances in a bvh gives a two-level structure: the top
+// level over instance boxes, and each geometry's own tree below it.
+//
+// Rays are moved into object space for the geometry's hit test. The
+// direction is transformed without normalizing, so t means the same in
+// both spaces and needs no conversion.
+class instance : public hittable
+{
+public:
+    // Used as material to keep the geometry's own materials
+    static constexpr uint32_t keep_material = 0xFFFFFFFFu;
+
+    instance() {}
+    instance(shared_ptr<const hittable> geometry, const affine &object_to_world,
+             uint32_t mat_id = keep_material);
+
+    virtual bool hit(
+        const ray &r, float t_min, float t_max, hit_record &rec) const override;
+
+    virtual bool bounding_box(aabb &output_box) const override;
+
+    // Moves the instance; the bvh holding it needs a refit afterwards
+    void place(const affine &object_to_world);
+
+public:
+    shared_ptr<const hittable> geometry;
+    affine object_to_world;
+    affine world_to_object;
+    aabb bounds; // world space
+    uint32_t mat_id = keep_material;
+};
+
+instance::instance(shared_ptr<const hittable> geometry, const affine &object_to_world, uint32_t mat_id)
+    : geometry(geometry), mat_id(mat_id)
+{
+    place(object_to_world);
+}
+
+void instance::place(const affine &object_to_world)
+{
+    this->object_to_world = object_to_world;
+    world_to_object = object_to_world.inverse();
+    aabb object_bounds;
+    if (geometry->bounding_box(object_bounds))
+        bounds = object_to_world.apply_box(object_bounds);
+}
+
+bool instance::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+    ray local(world_to_object.apply_point(r.orig), world_to_object.apply_vector(r.dir));
+    if (!geometry->hit(local, t_min, t_max, rec))
+        return false;
+
+    // Normals go through the inverse transpose. front_face carries over
+    // unchanged, since dot(direction, normal) is the same in both spaces.
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(world_to_object.apply_transpose(rec.normal));
+    if (mat_id != keep_material)
+        rec.mat_id = mat_id;
+    return true;
+}
+
+bool instance::bounding_box(aabb &output_box) const
+{
+    output_box = bounds;
+    return true;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+
+#include <atomic>
+#include <cstdint>
+
+// Russian roulette starts after this many bounces
+const int rr_min_bounces = 3;
+// Even bright paths are terminated with at least 5% probability
+const float rr_max_probability = 0.95f;
+
+// Path length counters. Each thread counts into its own copy and the
+// renderer folds them into the totals once per tile.
+thread_local uint64_t thread_paths = 0, thread_segments = 0;
+std::atomic<uint64_t> total_paths{0}, total_segments{0};
+
+inline void flush_path_counters()
+{
+    total_paths += thread_paths;
+    total_segments += thread_segments;
+    thread_paths = thread_segments = 0;
+    flush_ray_stats();
+}
+
+inline void reset_path_counters()
+{
+    total_paths = total_segments = 0;
+    reset_ray_stats();
+}
+
+inline double average_path_length()
+{
+    return total_paths ? (double)total_segments / total_paths : 0.0;
+}
+
+// Gradient based on the y value of the ray direction
+inline color sky_color(const vec3 &direction)
+{
+    vec3 unit_direction = unit_vector(direction);
+    auto t = 0.5f * (unit_direction.y() + 1.0f);
+    return (1.0f - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+}
+
+// Past the first few bounces, a path continues with probability equal to its
+// remaining throughput and is divided by it, so dim paths end early without
+// biasing the estimate. Returns false if the path is terminated.
+inline bool russian_roulette(int bounce, color &throughput, rng &rand)
+{
+    if (bounce < rr_min_bounces)
+        return true;
+
+    float p = std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z()));
+    p = p < rr_max_probability ? p : rr_max_probability;
+    if (rand.next_float() >= p)
+        return false;
+    throughput /= p;
+    return true;
+}
+
+// Follows a path whose first segment r has already been intersected: hit
+// says whether it hit anything, and if so rec holds the hit. Lets callers
+// that trace first segments some other way (e.g. in packets) continue the
+// path one ray at a time.
+color ray_color_from_hit(const ray &r, bool hit, hit_record &rec, const hittable &world,
+                         const material_table &materials, int depth, rng &rand)
+{
+    ray cur_ray = r;
+    color throughput(1, 1, 1);
+    thread_paths++;
+
+    for (int bounce = 1; bounce <= depth; bounce++)
+    {
+        thread_segments++;
+        STAT_ADD(segments, 1);
+        if (bounce > 1)
+            hit = world.hit(cur_ray, 0.001, infinity, rec);
+
+        if (!hit)
+        {
+            STAT_END_PATH(path_end::sky, bounce);
+            return throughput * sky_color(cur_ray.direction());
+        }
+
+        // Scatter based on the material that was hit. Each bounce draws from
+        // its own counter range so the sample stays reproducible.
+        ray scattered;
+        color attenuation;
+        rand.set_bounce(bounce);
+        STAT_ADD(scatter_calls, 1);
+        if (!materials[rec.mat_id].scatter(cur_ray, rec, attenuation, scattered, rand))
+        {
+            STAT_END_PATH(path_end::absorbed, bounce);
+            return color(0, 0, 0);
+        }
+
+        throughput = throughput * attenuation;
+        cur_ray = scattered;
+
+        if (!russian_roulette(bounce, throughput, rand))
+        {
+            STAT_END_PATH(path_end::roulette, bounce);
+            return color(0, 0, 0);
+        }
+    }
+
+    // Exceeded the bounce limit, no more light is gathered
+    STAT_END_PATH(path_end::depth_limit, depth > 0 ? depth : 0);
+    return color(0, 0, 0);
+}
+
+color ray_color(const ray &r, const hittable &world, const material_table &materials, int depth, rng &rand)
+{
+    hit_record rec;
+    bool hit = depth > 0 && world.hit(r, 0.001, infinity, rec);
+    return ray_color_from_hit(r, hit, rec, world, materials, depth, rand);
+}
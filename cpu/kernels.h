@@ -0,0 +1,210 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "material.h"
+#include "packet.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Everything a sample kernel needs to render one pixel
+struct render_context
+{
+    const camera &cam;
+    const hittable &world;
+    const material_table &materials;
+    color *pixel_colors;
+    int width, height;
+    int samples_per_pixel;
+    int max_depth;
+    sample_pattern pattern = sample_pattern::independent;
+    // Kernels render samples [first_sample, samples_per_pixel) of each pixel
+    int first_sample = 0;
+
+    color &pixel(int i, int j) const { return pixel_colors[(height - j - 1) * width + i]; }
+};
+
+// Renders pixel (i, j) into ctx.pixel_colors
+typedef void (*ray_function)(const render_context &, int, int);
+
+// Calls f(std::integral_constant<int, K>) for K = 0 .. N-1, expanded at
+// compile time so each call is a separate copy of the body
+template <typename F, int... K>
+inline void unroll_impl(F &&f, std::integer_sequence<int, K...>)
+{
+    (f(std::integral_constant<int, K>()), ...);
+}
+
+template <int N, typename F>
+inline void unroll(F &&f)
+{
+    unroll_impl(f, std::make_integer_sequence<int, N>());
+}
+
+inline ray camera_ray(const render_context &ctx, int i, int j, rng &rand)
+{
+    auto u = (i + rand.next_float()) / (ctx.width - 1);
+    auto v = (j + rand.next_float()) / (ctx.height - 1);
+    return ctx.cam.get_ray(u, v, rand);
+}
+
+// Traces Unroll samples per iteration, generating all their camera rays
+// before tracing any of them, and spreads them over Accumulators partial
+// sums so consecutive additions do not wait on each other. Leftover
+// samples run one at a time.
+template <int Unroll, int Accumulators>
+void ray_trace_sample(const render_context &ctx, int i, int j)
+{
+    static_assert(Unroll >= 1 && Accumulators >= 1 && Unroll % Accumulators == 0,
+                  "Unroll must be a multiple of Accumulators");
+
+    uint32_t pixel = j * ctx.width + i;
+    color sums[Accumulators];
+    int s = ctx.first_sample;
+    for (; s + Unroll <= ctx.samples_per_pixel; s += Unroll)
+    {
+        rng rands[Unroll];
+        ray rays[Unroll];
+        unroll<Unroll>([&](auto k)
+                       { rands[k] = rng(pixel, s + k, 0, ctx.pattern); });
+        unroll<Unroll>([&](auto k)
+                       { rays[k] = camera_ray(ctx, i, j, rands[k]); });
+        unroll<Unroll>([&](auto k)
+                       { sums[k * Accumulators / Unroll] += ray_color(rays[k], ctx.world, ctx.materials, ctx.max_depth, rands[k]); });
+    }
+    for (; s < ctx.samples_per_pixel; s++)
+    {
+        rng rand(pixel, s, 0, ctx.pattern);
+        ray r = camera_ray(ctx, i, j, rand);
+        sums[0] += ray_color(r, ctx.world, ctx.materials, ctx.max_depth, rand);
+    }
+
+    color pixel_color = sums[0];
+    for (int a = 1; a < Accumulators; a++)
+        pixel_color += sums[a];
+    ctx.pixel(i, j) = pixel_color;
+}
+
+// Primary rays traced through the BVH as coherent packets of N, then one ray
+// at a time after the first bounce
+template <int N>
+void ray_trace_packet(const render_context &ctx, int i, int j)
+{
+    uint32_t pixel = j * ctx.width + i;
+    auto accel = dynamic_cast<const bvh *>(&ctx.world);
+    color pixel_color(0, 0, 0);
+    for (int s0 = ctx.first_sample; s0 < ctx.samples_per_pixel; s0 += N)
+    {
+        int n = std::min(N, ctx.samples_per_pixel - s0);
+        ray_packet<N> packet;
+        rng rands[N];
+        for (int k = 0; k < n; k++)
+        {
+            rands[k] = rng(pixel, s0 + k, 0, ctx.pattern);
+            packet.add(camera_ray(ctx, i, j, rands[k]));
+        }
+        packet.finalize();
+
+        bool hit[N];
+        hit_record recs[N];
+        if (accel)
+            trace_packet(*accel, packet, 0.001f, hit, recs);
+        for (int k = 0; k < n; k++)
+        {
+            if (accel)
+                pixel_color += ray_color_from_hit(packet.get_ray(k), hit[k], recs[k], ctx.world, ctx.materials, ctx.max_depth, rands[k]);
+            else
+                pixel_color += ray_color(packet.get_ray(k), ctx.world, ctx.materials, ctx.max_depth, rands[k]);
+        }
+    }
+    ctx.pixel(i, j) = pixel_color;
+}
+
+struct kernel_variant
+{
+    const char *name;
+    ray_function func;
+};
+
+// Every per-pixel kernel, generated from the templates above
+const kernel_variant sample_kernels[] = {
+    {"Unoptimized", ray_trace_sample<1, 1>},
+    {"2x Unroll", ray_trace_sample<2, 1>},
+    {"4x Unroll", ray_trace_sample<4, 1>},
+    {"8x Unroll", ray_trace_sample<8, 1>},
+    {"2x Unroll, 2 Accumulators", ray_trace_sample<2, 2>},
+    {"4x Unroll, 2 Accumulators", ray_trace_sample<4, 2>},
+    {"4x Unroll, 4 Accumulators", ray_trace_sample<4, 4>},
+    {"8x Unroll, 2 Accumulators", ray_trace_sample<8, 2>},
+    {"8x Unroll, 4 Accumulators", ray_trace_sample<8, 4>},
+    {"Ray Packets x4", ray_trace_packet<4>},
+    {"Ray Packets x8", ray_trace_packet<8>},
+    {"Ray Packets x16", ray_trace_packet<16>},
+};
+const int num_sample_kernels = sizeof(sample_kernels) / sizeof(sample_kernels[0]);
+
+// A size x size tile around the image centre, where the scene usually is
+inline tile calibration_tile(int width, int height, int size)
+{
+    tile t;
+    t.x0 = std::max(0, width / 2 - size / 2);
+    t.y0 = std::max(0, height / 2 - size / 2);
+    t.x1 = std::min(width, t.x0 + size);
+    t.y1 = std::min(height, t.y0 + size);
+    t.seconds = 0;
+    return t;
+}
+
+// Samples per pixel the calibration renders, at most: enough to fill the
+// widest packet, so the packet kernels are timed as they will run, and no
+// more, so tuning costs the same whatever the frame's sample count
+const int calibration_samples = 16;
+
+// Samples autotune_kernels() traces for a frame of `samples_per_pixel`
+inline long long calibration_work(const tile &t, int repetitions, int samples_per_pixel)
+{
+    return (long long)num_sample_kernels * repetitions * (t.x1 - t.x0) * (t.y1 - t.y0) *
+           std::min(samples_per_pixel, calibration_samples);
+}
+
+// Renders the calibration tile with every kernel, keeping each one's best
+// time out of `repetitions` runs, and returns the index of the fastest.
+// The tile's pixels in ctx.pixel_colors are overwritten.
+int autotune_kernels(const render_context &ctx, const tile &t, int repetitions, std::vector<double> &seconds)
+{
+    render_context calibration = ctx;
+    calibration.first_sample = 0;
+    calibration.samples_per_pixel = std::min(ctx.samples_per_pixel, calibration_samples);
+
+    seconds.assign(num_sample_kernels, 0.0);
+    int best = 0;
+    for (int k = 0; k < num_sample_kernels; k++)
+    {
+        for (int rep = 0; rep < repetitions; rep++)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int j = t.y0; j < t.y1; ++j)
+                for (int i = t.x0; i < t.x1; ++i)
+                    sample_kernels[k].func(calibration, i, j);
+            auto end = std::chrono::high_resolution_clock::now();
+            double elapsed = std::chrono::duration<double>(end - start).count();
+            if (rep == 0 || elapsed < seconds[k])
+                seconds[k] = elapsed;
+        }
+        if (seconds[k] < seconds[best])
+            best = k;
+    }
+
+    // Calibration paths should not show up in the next render's statistics
+    flush_path_counters();
+    reset_path_counters();
+    return best;
+}
@@ -6,6 +6,12 @@
     https://raytracing.github.io/books/RayTracingInOneWeekend.html
 
 */
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <future>
 #include <string>
 #include <fstream>
 #include <iostream>
@@ -18,449 +24,776 @@ using std::string;
 
 #include "rtweekend.h"
 #include "color.h"
+#include "image.h"
+#include "image_stream.h"
 #include "hittable_list.h"
+#include "bvh.h"
 #include "sphere.h"
 #include "camera.h"
 #include "material.h"
+#include "integrator.h"
+#include "wavefront.h"
+#include "kernels.h"
+#include "scenes.h"
+#include "scene_file.h"
+#include "obj.h"
+#include "triangle_mesh.h"
+#include "adaptive.h"
+#include "animation.h"
+#include "checkpoint.h"
+#include "numa.h"
+#include "render_service.h"
 #include "Timer.h"
-#include <omp.h>
+#include "scheduler.h"
+#include "tile_farm.h"
 
-#define NUM_THREADS 16
+#define DEFAULT_TILE_SIZE 16
 #define MAX_DEPTH 50
+#define CALIBRATION_TILE_SIZE 8
+#define CALIBRATION_REPETITIONS 3
+#define UNTUNED_KERNEL 6
 #define SAMPLES_PER_PIXEL 20
+#define CHECKPOINT_PASS_SAMPLES 4
+#define CHECKPOINT_INTERVAL 60
+#define CHECKPOINT_MIN_INTERVAL 0.1
+#define REBUILD_THRESHOLD 1.3f
 #define ASPECT_RATIO (16.0f / 9.0f)
 #define IMG_WIDTH 120
-#define IMG_HEIGHT static_cast<int>(IMG_WIDTH / ASPECT_RATIO)
 
-typedef void (*ray_function)(camera &, hittable_list &, color[], int, int);
+/* Total render time, ray throughput and path length of the last render */
+void report_rate(double seconds)
+{
+    cerr << "  " << seconds * 1000 << " ms, " << total_segments / seconds / 1e6 << " Mrays/s" << endl;
+    cerr << "  average path length " << average_path_length() << " segments" << endl;
+    print_ray_stats(cerr);
+}
 
-void driver(ray_function func, string name, camera &cam, hittable_list &world, color pixel_colors[], int use_threads)
+/* Summarise the per-tile timings of the last render, optionally listing every tile */
+void report_tiles(const tile_scheduler &scheduler, bool list_tiles)
 {
-    string bla = use_threads ? "Multi-Threaded " : "Single-Threaded ";
-    cerr << "Testing " << bla << name << " Code..." << endl;
-#pragma omp parallel for if (use_threads)
-    for (int j = IMG_HEIGHT - 1; j >= 0; --j)
+    float total = 0, slowest = 0;
+    for (const auto &t : scheduler.tiles)
     {
-        for (int i = 0; i < IMG_WIDTH; ++i)
-        {
-            func(cam, world, pixel_colors, i, j);
-        }
+        total += t.seconds;
+        slowest = t.seconds > slowest ? t.seconds : slowest;
+        if (list_tiles)
+            cerr << "  tile " << t.x0 << "," << t.y0 << " " << (t.x1 - t.x0) << "x" << (t.y1 - t.y0)
+                 << "\t" << t.seconds * 1000 << " ms" << endl;
     }
+    cerr << "  " << scheduler.tiles.size() << " tiles, mean " << 1000 * total / scheduler.tiles.size()
+         << " ms, slowest " << 1000 * slowest << " ms" << endl;
 }
 
-color ray_color(const ray &r, const hittable &world, int depth)
+void driver(ray_function func, string name, const render_context &ctx,
+            tile_scheduler &scheduler, int use_threads, bool list_tiles, image_stream *stream = nullptr)
 {
-    hit_record rec;
-
-    /* If we've exceeded the ray bounce limit, no more light is gathered */
-    if (depth <= 0)
-        return color(0, 0, 0);
-
-    if (world.hit(r, 0.001, infinity, rec))
-    {
-        /* If we hit an object, calculate scattered rays based on the 
-        material of the object */
-        ray scattered;
-        color attenuation;
-        /* If we scatter, then we recurse on the attenuated scattered ray */
-        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-            return attenuation * ray_color(scattered, world, depth - 1);
-        return color(0, 0, 0);
-    }
-    /* If we hit nothing, return gradient based on y value */
-    vec3 unit_direction = unit_vector(r.direction());
-    auto t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    string bla = use_threads ? "Multi-Threaded " : "Single-Threaded ";
+    cerr << "Testing " << bla << name << " Code..." << endl;
+    reset_path_counters();
+    auto start = std::chrono::high_resolution_clock::now();
+    scheduler.run([&](const tile &t, int)
+                  {
+                      for (int j = t.y0; j < t.y1; ++j)
+                          for (int i = t.x0; i < t.x1; ++i)
+                              func(ctx, i, j);
+                      flush_path_counters();
+                      if (stream)
+                          stream->push(t);
+                  },
+                  use_threads);
+    auto end = std::chrono::high_resolution_clock::now();
+    report_tiles(scheduler, list_tiles);
+    report_rate(std::chrono::duration<double>(end - start).count());
 }
 
-/* predefined scene used for benchmarking */
-hittable_list set_scene()
+/* Opens `stream` on the output file if the frame can be encoded there while
+   it renders. Otherwise, or if the file could not be made, the image is
+   written in one go once the render is done. */
+bool open_stream(image_stream &stream, const string &output, image_format format, const render_context &ctx,
+                 size_t tiles)
 {
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++)
-    {
-        for (int b = -11; b < 11; b++)
-        {
-            auto choose_mat = random_float();
-            point3 center(a + 0.9, 0.2, b + 0.9);
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9)
-            {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8)
-                {
-                    // diffuse
-                    auto albedo = color::random(0.7, 0.7) * color::random(0.7, 0.7);
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95)
-                {
-                    // metal
-                    auto albedo = color::random(0.5, 0.5);
-                    auto fuzz = random_float(0, 0);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else
-                {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    return world;
+    if (!image_stream::can_stream(output, format))
+        return false;
+    string error;
+    if (stream.open(output, format, ctx.pixel_colors, ctx.width, ctx.height, ctx.samples_per_pixel, tiles, error))
+        return true;
+    cerr << error << endl;
+    return false;
 }
 
-hittable_list random_scene()
+/* Same as driver(), but each worker streams whole tiles through its own wavefront_renderer */
+void driver_wavefront(const render_context &ctx, std::vector<wavefront_renderer> &renderers, tile_scheduler &scheduler, int use_threads, bool list_tiles)
 {
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++)
-    {
-        for (int b = -11; b < 11; b++)
-        {
-            auto choose_mat = random_float();
-            point3 center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
-
-            if ((center - point3(4, 0.2, 0)).length() > 0.9)
-            {
-                shared_ptr<material> sphere_material;
-
-                if (choose_mat < 0.8)
-                {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95)
-                {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_float(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else
-                {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
-    }
-
-    auto material1 = make_shared<dielectric>(1.5f);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0f, material1));
+    string bla = use_threads ? "Multi-Threaded " : "Single-Threaded ";
+    cerr << "Testing " << bla << "Wavefront Code..." << endl;
+    reset_path_counters();
+    auto start = std::chrono::high_resolution_clock::now();
+    scheduler.run([&](const tile &t, int worker)
+                  {
+                      renderers[worker].render_tile(ctx.cam, ctx.world, ctx.materials, ctx.pixel_colors, t);
+                      flush_path_counters();
+                  },
+                  use_threads);
+    auto end = std::chrono::high_resolution_clock::now();
+    report_tiles(scheduler, list_tiles);
+    report_rate(std::chrono::duration<double>(end - start).count());
+}
 
-    auto material2 = make_shared<lambertian>(color(0.4f, 0.2f, 0.1f));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0f, material2));
+/* Renders in passes until every pixel's error estimate is under the target */
+void driver_adaptive(const render_context &ctx, const adaptive_settings &settings, tile_scheduler &scheduler, bool list_tiles)
+{
+    cerr << "Testing Multi-Threaded Adaptive Sampling (error " << settings.error << ", "
+         << settings.min_samples << "-" << settings.max_samples << " spp)..." << endl;
+    adaptive_renderer renderer(ctx.width, ctx.height, settings);
+    reset_path_counters();
+    auto start = std::chrono::high_resolution_clock::now();
+    renderer.render(ctx, scheduler, true);
+    auto end = std::chrono::high_resolution_clock::now();
+    report_tiles(scheduler, list_tiles);
+    report_rate(std::chrono::duration<double>(end - start).count());
+
+    double average = (double)renderer.total_samples() / (ctx.width * ctx.height);
+    cerr << "  " << renderer.passes() << " passes, " << average << " samples per pixel on average ("
+         << 100.0 * average / settings.max_samples << "% of max)" << endl;
+}
 
-    auto material3 = make_shared<metal>(color(0.7f, 0.6f, 0.5f), 0.0f);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0f, material3));
+/* Set by SIGINT or SIGTERM; a checkpointed render then saves its progress and stops, and a daemon shuts down */
+std::atomic<bool> stop_requested(false);
 
-    return world;
+void request_stop(int)
+{
+    stop_requested = true;
 }
 
-/* No loop unrolling or accumulators */
-void ray_trace_unopt(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Renders in passes, checkpointing to `path` so an interrupted render can be resumed or extended */
+bool driver_checkpointed(const render_context &ctx, int kernel_index, tile_scheduler &scheduler,
+                         uint64_t fingerprint, const string &path, double interval, bool list_tiles)
 {
-    color pixel_color(0, 0, 0);
-    for (int s = 0; s < SAMPLES_PER_PIXEL; ++s)
+    const kernel_variant &kernel = sample_kernels[kernel_index];
+    progressive_renderer renderer(ctx.width, ctx.height, ctx, kernel_index, fingerprint);
+    string error;
+    bool resumed;
+    if (!renderer.resume(path, resumed, error))
     {
-        auto u = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r = cam.get_ray(u, v);
-        pixel_color += ray_color(r, world, MAX_DEPTH);
+        cerr << error << endl;
+        return false;
     }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color.x(), pixel_color.y(), pixel_color.z());
+    int pixels = ctx.width * ctx.height;
+    cerr << "Testing Multi-Threaded " << kernel.name << " Code, checkpointing to " << path << "..." << endl;
+    if (resumed)
+        cerr << "  resumed at " << (double)renderer.total_samples() / pixels << " samples per pixel" << endl;
+
+    reset_path_counters();
+    auto start = std::chrono::high_resolution_clock::now();
+    bool complete = renderer.render(ctx, kernel.func, scheduler, ctx.samples_per_pixel, CHECKPOINT_PASS_SAMPLES,
+                                    path, interval, stop_requested);
+    auto end = std::chrono::high_resolution_clock::now();
+    report_tiles(scheduler, list_tiles);
+    report_rate(std::chrono::duration<double>(end - start).count());
+    cerr << "  " << renderer.checkpoints_written() << " checkpoints, " << renderer.checkpoint_seconds() * 1000
+         << " ms writing them" << endl;
+
+    renderer.resolve(ctx.pixel_colors);
+    if (!complete)
+        cerr << "Stopped at " << (double)renderer.total_samples() / pixels
+             << " samples per pixel; run again with the same checkpoint to resume" << endl;
+    return complete;
 }
 
-/* Loop unrolling x2 */
-void ray_trace_u2(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Frame f's file name from a printf pattern such as frame%04d.ppm */
+string frame_path(const string &pattern, int f)
 {
-    color pixel_color(0, 0, 0);
-    for (int s = 0; s < SAMPLES_PER_PIXEL; s += 2)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-        pixel_color += ray_color(r2, world, MAX_DEPTH);
-    }
-    if (SAMPLES_PER_PIXEL % 2)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color.x(), pixel_color.y(), pixel_color.z());
+    char name[4096];
+    snprintf(name, sizeof(name), pattern.c_str(), f);
+    return name;
 }
 
-/* Loop unrolling x4 */
-void ray_trace_u4(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Renders every frame of an animation, refitting the BVH between frames, and
+   writes each frame on a separate thread while the next one renders */
+bool driver_animation(const hittable_list &world, const material_table &materials,
+                      const std::vector<animation_frame> &frames, const kernel_variant &kernel,
+                      const render_context &settings, tile_scheduler &scheduler, float rebuild_threshold,
+                      image_format format, const string &pattern, bool list_tiles)
 {
-    color pixel_color(0, 0, 0);
-    for (int s = 0; s < SAMPLES_PER_PIXEL; s += 4)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u3 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u4 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v3 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v4 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        ray r3 = cam.get_ray(u3, v3);
-        ray r4 = cam.get_ray(u4, v4);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-        pixel_color += ray_color(r2, world, MAX_DEPTH);
-        pixel_color += ray_color(r3, world, MAX_DEPTH);
-        pixel_color += ray_color(r4, world, MAX_DEPTH);
-    }
-    for (int s = 0; s < SAMPLES_PER_PIXEL % 4; s++)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color.x(), pixel_color.y(), pixel_color.z());
-}
-
-/* Loop unrolling x8 */
-void ray_trace_u8(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
-{
-    color pixel_color(0, 0, 0);
-    int s;
-    for (s = 0; s < SAMPLES_PER_PIXEL; s += 8)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u3 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u4 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u5 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u6 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u7 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u8 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v3 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v4 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v5 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v6 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v7 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v8 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        ray r3 = cam.get_ray(u3, v3);
-        ray r4 = cam.get_ray(u4, v4);
-        ray r5 = cam.get_ray(u5, v5);
-        ray r6 = cam.get_ray(u6, v6);
-        ray r7 = cam.get_ray(u7, v7);
-        ray r8 = cam.get_ray(u8, v8);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-        pixel_color += ray_color(r2, world, MAX_DEPTH);
-        pixel_color += ray_color(r3, world, MAX_DEPTH);
-        pixel_color += ray_color(r4, world, MAX_DEPTH);
-        pixel_color += ray_color(r5, world, MAX_DEPTH);
-        pixel_color += ray_color(r6, world, MAX_DEPTH);
-        pixel_color += ray_color(r7, world, MAX_DEPTH);
-        pixel_color += ray_color(r8, world, MAX_DEPTH);
-    }
-    for (int s = 0; s < SAMPLES_PER_PIXEL % 8; s++)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color.x(), pixel_color.y(), pixel_color.z());
+    cerr << "Rendering " << frames.size() << " frames with " << kernel.name << "..." << endl;
+    animated_scene scene(world, rebuild_threshold);
+    std::vector<color> buffers[2];
+    for (auto &b : buffers)
+        b.resize(settings.width * settings.height);
+    std::future<bool> written; /* the previous frame, still being written */
+    bool ok = true;
+    double render_seconds = 0, wait_seconds = 0;
+
+    reset_path_counters();
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int f = 0; f < (int)frames.size(); f++)
+    {
+        double refit_before = scene.refit_seconds, rebuild_before = scene.rebuild_seconds;
+        scene.set_frame(frames[f]);
+        camera cam = make_camera(frames[f].camera, (float)settings.width / settings.height);
+        render_context ctx{cam, scene.accel(), materials, buffers[f % 2].data(), settings.width, settings.height,
+                           settings.samples_per_pixel, settings.max_depth, settings.pattern};
+
+        auto render_start = std::chrono::high_resolution_clock::now();
+        scheduler.run([&](const tile &t, int)
+                      {
+                          for (int j = t.y0; j < t.y1; ++j)
+                              for (int i = t.x0; i < t.x1; ++i)
+                                  kernel.func(ctx, i, j);
+                          flush_path_counters();
+                      });
+        auto render_end = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(render_end - render_start).count();
+        render_seconds += seconds;
+
+        /* The other buffer is free once the previous frame is on disk */
+        if (written.valid())
+            ok = written.get() && ok;
+        wait_seconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - render_end).count();
+        string path = frame_path(pattern, f);
+        const color *pixels = buffers[f % 2].data();
+        written = std::async(std::launch::async, [=]
+                             { return write_image(path, format, pixels, settings.width, settings.height,
+                                                  settings.samples_per_pixel); });
+
+        cerr << "  frame " << f << "\t" << (scene.rebuilt ? "rebuild " : "refit ")
+             << (scene.refit_seconds - refit_before + scene.rebuild_seconds - rebuild_before) * 1000 << " ms, render "
+             << seconds * 1000 << " ms, node growth " << scene.growth() << endl;
+        if (list_tiles)
+            report_tiles(scheduler, true);
+    }
+    if (written.valid())
+        ok = written.get() && ok;
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double total = std::chrono::duration<double>(end - start).count();
+    report_rate(total);
+    cerr << "  " << frames.size() / total << " frames/s, " << render_seconds * 1000 << " ms rendering, "
+         << wait_seconds * 1000 << " ms waiting for output" << endl;
+    cerr << "  " << scene.refits << " refits in " << scene.refit_seconds * 1000 << " ms, " << scene.rebuilds
+         << " rebuilds in " << scene.rebuild_seconds * 1000 << " ms; a rebuild every frame would take about "
+         << scene.initial_build_seconds * frames.size() * 1000 << " ms" << endl;
+    if (!ok)
+        cerr << "Could not write every frame of " << pattern << endl;
+    return ok;
 }
 
-/* Loop unrolling x2, 2 accumulators */
-void ray_trace_u2_a2(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Renders every tile with `func`, each worker against its own node's copy of
+   the scene, and returns the seconds it took. Finished tiles go to `stream`, if any. */
+double render_placed(ray_function func, const render_context &ctx, const numa_scene &scene,
+                     const numa_topology &topology, tile_scheduler &scheduler, image_stream *stream = nullptr)
 {
-    color pixel_color1(0, 0, 0);
-    color pixel_color2(0, 0, 0);
-    for (int s = 0; s < SAMPLES_PER_PIXEL; s += 2)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r2, world, MAX_DEPTH);
-    }
-    if (SAMPLES_PER_PIXEL % 2)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color1.x() + pixel_color2.x(), pixel_color1.y() + pixel_color2.y(), pixel_color1.z() + pixel_color2.z());
+    std::vector<render_context> contexts;
+    for (int n = 0; n < topology.nodes(); n++)
+        contexts.push_back(render_context{ctx.cam, scene.accel(n), scene.materials(n), ctx.pixel_colors, ctx.width,
+                                          ctx.height, ctx.samples_per_pixel, ctx.max_depth, ctx.pattern});
+    int workers = scheduler.num_threads();
+    auto start = std::chrono::high_resolution_clock::now();
+    scheduler.run([&](const tile &t, int worker)
+                  {
+                      const render_context &local = contexts[topology.worker_node(worker, workers)];
+                      for (int j = t.y0; j < t.y1; ++j)
+                          for (int i = t.x0; i < t.x1; ++i)
+                              func(local, i, j);
+                      flush_path_counters();
+                      if (stream)
+                          stream->push(t);
+                  });
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
 }
 
-/* Loop unrolling x4, 2 accumulators */
-void ray_trace_u4_a2(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Same as driver(), with the scene and framebuffer placed on the workers' NUMA nodes */
+void driver_numa(ray_function func, string name, const render_context &ctx, const numa_scene &scene,
+                 const numa_topology &topology, tile_scheduler &scheduler, bool list_tiles,
+                 image_stream *stream = nullptr)
 {
-    color pixel_color1(0, 0, 0);
-    color pixel_color2(0, 0, 0);
-    for (int s = 0; s < SAMPLES_PER_PIXEL; s += 4)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u3 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u4 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v3 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v4 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        ray r3 = cam.get_ray(u3, v3);
-        ray r4 = cam.get_ray(u4, v4);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-        pixel_color1 += ray_color(r2, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r3, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r4, world, MAX_DEPTH);
-    }
-    for (int s = 0; s < SAMPLES_PER_PIXEL % 4; s++)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color1.x() + pixel_color2.x(), pixel_color1.y() + pixel_color2.y(), pixel_color1.z() + pixel_color2.z());
+    cerr << "Testing Multi-Threaded " << name << " Code..." << endl;
+    reset_path_counters();
+    double seconds = render_placed(func, ctx, scene, topology, scheduler, stream);
+    report_tiles(scheduler, list_tiles);
+    report_rate(seconds);
 }
 
-/* Loop unrolling x8, 2 accumulators */
-void ray_trace_u8_a2(camera &cam, hittable_list &world, color pixel_colors[], int i, int j)
+/* Renders with 1, 2, 4 ... max_threads workers under each placement and
+   compares throughput, local against interleaved in particular */
+void driver_numa_report(ray_function func, string name, const render_context &ctx, const bvh &accel,
+                        const material_table &materials, const hittable_list &world, const numa_topology &topology,
+                        int max_threads, int tile_size)
 {
-    color pixel_color1(0, 0, 0);
-    color pixel_color2(0, 0, 0);
-    int s;
-    for (s = 0; s < SAMPLES_PER_PIXEL; s += 8)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u2 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u3 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u4 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u5 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u6 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u7 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto u8 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v2 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v3 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v4 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v5 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v6 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v7 = (j + random_float()) / (IMG_HEIGHT - 1);
-        auto v8 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        ray r2 = cam.get_ray(u2, v2);
-        ray r3 = cam.get_ray(u3, v3);
-        ray r4 = cam.get_ray(u4, v4);
-        ray r5 = cam.get_ray(u5, v5);
-        ray r6 = cam.get_ray(u6, v6);
-        ray r7 = cam.get_ray(u7, v7);
-        ray r8 = cam.get_ray(u8, v8);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-        pixel_color1 += ray_color(r2, world, MAX_DEPTH);
-        pixel_color1 += ray_color(r3, world, MAX_DEPTH);
-        pixel_color1 += ray_color(r4, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r5, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r6, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r7, world, MAX_DEPTH);
-        pixel_color2 += ray_color(r8, world, MAX_DEPTH);
-    }
-    for (int s = 0; s < SAMPLES_PER_PIXEL % 8; s++)
-    {
-        auto u1 = (i + random_float()) / (IMG_WIDTH - 1);
-        auto v1 = (j + random_float()) / (IMG_HEIGHT - 1);
-        ray r1 = cam.get_ray(u1, v1);
-        pixel_color1 += ray_color(r1, world, MAX_DEPTH);
-    }
-    pixel_colors[((IMG_HEIGHT - j - 1) * IMG_WIDTH) + i] = color(pixel_color1.x() + pixel_color2.x(), pixel_color1.y() + pixel_color2.y(), pixel_color1.z() + pixel_color2.z());
+    const numa_placement placements[] = {numa_placement::none, numa_placement::local, numa_placement::interleave};
+    cerr << "NUMA scaling of " << name << " over " << topology.nodes() << " node(s):" << endl;
+    cerr << "  threads	none		local		interleave	local/interleave" << endl;
+    max_threads = std::max(1, max_threads);
+    for (int threads = 1;; threads = std::min(2 * threads, max_threads))
+    {
+        double rates[3];
+        for (int p = 0; p < 3; p++)
+        {
+            numa_scene scene(accel, materials, world, placements[p], topology);
+            tile_scheduler scheduler(ctx.width, ctx.height, tile_size, threads,
+                                     placements[p] == numa_placement::none ? std::vector<int>()
+                                                                           : topology.worker_cpus(threads));
+            numa_buffer<color> framebuffer((size_t)ctx.width * ctx.height);
+            place_framebuffer(framebuffer, ctx.width, ctx.height, placements[p], topology, scheduler);
+            render_context placed = ctx;
+            placed.pixel_colors = framebuffer.data();
+
+            reset_path_counters();
+            double seconds = render_placed(func, placed, scene, topology, scheduler);
+            rates[p] = total_segments / seconds / 1e6;
+        }
+        cerr << "  " << threads << "		" << rates[0] << " Mrays/s	" << rates[1] << " Mrays/s	" << rates[2]
+             << " Mrays/s	" << rates[1] / rates[2] << endl;
+        if (threads == max_threads)
+            break;
+    }
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    int tile_size = DEFAULT_TILE_SIZE;
+    bool list_tiles = false;
+    image_format format = image_format::p6;
+    string output = "-";
+    bool compare = false;
+    bool adaptive = false;
+    adaptive_settings adaptive_config;
+    sample_pattern pattern = sample_pattern::independent;
+    string scene_path;
+    string obj_path;
+    int instances = 0;
+    int kernel = -1;
+    string listen_address;
+    string worker_address;
+    string serve_address;
+    string serve_output = ".";
+    int samples_per_pixel = SAMPLES_PER_PIXEL;
+    string checkpoint_path;
+    double checkpoint_interval = CHECKPOINT_INTERVAL;
+    int frames = 0;
+    float rebuild_threshold = REBUILD_THRESHOLD;
+    numa_placement placement = numa_placement::none;
+    bool numa_report = false;
+    int width = IMG_WIDTH;
+    bool stream_output = true;
+
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        if (arg == "--threads" && a + 1 < argc)
+            num_threads = atoi(argv[++a]);
+        else if (arg == "--tile" && a + 1 < argc)
+            tile_size = atoi(argv[++a]);
+        else if (arg == "--tile-times")
+            list_tiles = true;
+        else if (arg == "--format" && a + 1 < argc && parse_image_format(argv[a + 1], format))
+            a++;
+        else if (arg == "--output" && a + 1 < argc)
+            output = argv[++a];
+        else if (arg == "--sampler" && a + 1 < argc && parse_sample_pattern(argv[a + 1], pattern))
+            a++;
+        else if (arg == "--scene" && a + 1 < argc)
+            scene_path = argv[++a];
+        else if (arg == "--obj" && a + 1 < argc)
+            obj_path = argv[++a];
+        else if (arg == "--instances" && a + 1 < argc)
+            instances = std::max(0, atoi(argv[++a]));
+        else if (arg == "--kernel" && a + 1 < argc)
+            kernel = atoi(argv[++a]);
+        else if (arg == "--listen" && a + 1 < argc)
+            listen_address = argv[++a];
+        else if (arg == "--worker" && a + 1 < argc)
+            worker_address = argv[++a];
+        else if (arg == "--serve" && a + 1 < argc)
+            serve_address = argv[++a];
+        else if (arg == "--serve-output" && a + 1 < argc)
+            serve_output = argv[++a];
+        else if (arg == "--spp" && a + 1 < argc)
+            samples_per_pixel = std::max(1, atoi(argv[++a]));
+        else if (arg == "--checkpoint" && a + 1 < argc)
+            checkpoint_path = argv[++a];
+        else if (arg == "--checkpoint-interval" && a + 1 < argc)
+            checkpoint_interval = atof(argv[++a]);
+        else if (arg == "--frames" && a + 1 < argc)
+            frames = std::max(0, atoi(argv[++a]));
+        else if (arg == "--rebuild-threshold" && a + 1 < argc)
+            rebuild_threshold = atof(argv[++a]);
+        else if (arg == "--numa" && a + 1 < argc && parse_numa_placement(argv[a + 1], placement))
+            a++;
+        else if (arg == "--numa-report")
+            numa_report = true;
+        else if (arg == "--width" && a + 1 < argc)
+            width = std::max(1, atoi(argv[++a]));
+        else if (arg == "--no-stream")
+            stream_output = false;
+        else if (arg == "--compare")
+            compare = true;
+        else if (arg == "--adaptive")
+            adaptive = true;
+        else if (arg == "--error" && a + 1 < argc)
+            adaptive_config.error = atof(argv[++a]);
+        else if (arg == "--min-spp" && a + 1 < argc)
+            adaptive_config.min_samples = std::max(1, atoi(argv[++a]));
+        else if (arg == "--max-spp" && a + 1 < argc)
+            adaptive_config.max_samples = std::max(1, atoi(argv[++a]));
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--threads N] [--tile N] [--tile-times]"
+                 << " [--width N] [--format p3|p6|pfm|exr] [--output FILE [--no-stream]] [--compare]"
+                 << " [--sampler independent|sobol|rank1] [--scene FILE | --obj FILE [--instances N]]"
+                 << " [--adaptive [--error E] [--min-spp N] [--max-spp N]] [--kernel N]"
+                 << " [--listen ADDRESS | --worker ADDRESS | --serve unix:PATH [--serve-output DIR]] [--spp N]"
+                 << " [--checkpoint FILE [--checkpoint-interval SECONDS]]"
+                 << " [--frames N [--rebuild-threshold X]] [--numa none|local|interleave | --numa-report]" << endl;
+            return 1;
+        }
+    }
+    if (instances > 0 && obj_path.empty())
+    {
+        cerr << "--instances needs a mesh from --obj" << endl;
+        return 1;
+    }
+    if (kernel >= num_sample_kernels)
+    {
+        cerr << "--kernel must be below " << num_sample_kernels << endl;
+        return 1;
+    }
+    /* Each checkpoint rewrites the whole file, so this also catches 0,
+       negative and unparsable values, which would write it nonstop */
+    if (!(checkpoint_interval >= CHECKPOINT_MIN_INTERVAL))
+    {
+        cerr << "--checkpoint-interval must be at least " << CHECKPOINT_MIN_INTERVAL << " seconds" << endl;
+        return 1;
+    }
+    if ((!listen_address.empty() || !worker_address.empty()) && (compare || adaptive))
+    {
+        cerr << "--listen and --worker render whole frames, without --compare or --adaptive" << endl;
+        return 1;
+    }
+    if (!checkpoint_path.empty() && (compare || adaptive || !listen_address.empty() || !worker_address.empty()))
+    {
+        cerr << "--checkpoint renders on its own, without --compare, --adaptive, --listen or --worker" << endl;
+        return 1;
+    }
+    if (frames > 0 && (compare || adaptive || !listen_address.empty() || !worker_address.empty() ||
+                       !checkpoint_path.empty() || !scene_path.empty()))
+    {
+        cerr << "--frames animates a built-in or --obj scene, without --compare, --adaptive, --listen, --worker,"
+             << " --checkpoint or --scene" << endl;
+        return 1;
+    }
+    if ((placement != numa_placement::none || numa_report) &&
+        (compare || adaptive || !listen_address.empty() || !worker_address.empty() || !checkpoint_path.empty() ||
+         frames > 0))
+    {
+        cerr << "--numa and --numa-report render single frames, without --compare, --adaptive, --listen, --worker,"
+             << " --checkpoint or --frames" << endl;
+        return 1;
+    }
+    if (!serve_address.empty() &&
+        (compare || adaptive || !listen_address.empty() || !worker_address.empty() || !checkpoint_path.empty() ||
+         frames > 0 || placement != numa_placement::none || numa_report))
+    {
+        cerr << "--serve renders its clients' jobs, without --compare, --adaptive, --listen, --worker, --checkpoint,"
+             << " --frames or --numa" << endl;
+        return 1;
+    }
+    /* Clients are not authenticated, so only local ones the socket file lets in */
+    if (!serve_address.empty() && serve_address.compare(0, 5, "unix:") != 0)
+    {
+        cerr << "--serve only listens on a Unix socket, unix:PATH" << endl;
+        return 1;
+    }
+    if (frames > 0 && output.find('%') == string::npos)
+    {
+        cerr << "--frames needs an --output pattern with a frame number, such as frame%04d.ppm" << endl;
+        return 1;
+    }
 
     // Image
-    color *pixel_colors = new color[IMG_WIDTH * IMG_HEIGHT];
-
-    // World -- set_scene() is used for testing, change to random_scene() for different image output
-    auto world = set_scene();
+    int height = std::max(1, static_cast<int>(width / ASPECT_RATIO));
+    color *pixel_colors = new color[(size_t)width * height];
+
+    // World -- set_scene() is used for testing, change to random_scene() for different image output.
+    // A scene file from scene_convert replaces it, mapped and used in place, and an OBJ file
+    // replaces it with that mesh on a ground plane, or with a grid of instances of it.
+    scene_file file;
+    material_table materials;
+    std::unique_ptr<bvh> accel;
+    hittable_list world; /* the objects of a built-in or OBJ scene, for animation */
+    shared_ptr<triangle_mesh> mesh;
+    size_t primitive_count;
+    aabb instance_bounds;
+    auto load_start = std::chrono::high_resolution_clock::now();
+    if (!scene_path.empty())
+    {
+        string error;
+        if (!file.open(scene_path, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        materials = file.materials();
+        accel = file.make_bvh();
+        primitive_count = file.header().sphere_count;
+    }
+    else if (!obj_path.empty())
+    {
+        string error;
+        std::vector<point3> vertices;
+        std::vector<uint32_t> indices;
+        if (!load_obj(obj_path, vertices, indices, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        mesh = make_shared<triangle_mesh>(vertices, indices, materials.add(lambertian(color(0.73, 0.73, 0.73))));
+        world = instances > 0 ? instanced_scene(mesh, instances, materials, instance_bounds)
+                                   : mesh_scene(mesh, materials);
+        accel.reset(new bvh(world));
+        primitive_count = mesh->triangle_count() * std::max(1, instances) + 1;
+    }
+    else
+    {
+        // Acceleration structure -- every kernel traces against the BVH instead of the flat list
+        world = set_scene(materials);
+        accel.reset(new bvh(world));
+        primitive_count = world.objects.size();
+    }
+    auto load_end = std::chrono::high_resolution_clock::now();
+    const bvh &world_bvh = *accel;
 
     // Camera
-    point3 lookfrom(0, 5, 15);
-    point3 lookat(0, 0, 0);
-    vec3 vup(0, 1, 0);
-    float dist_to_focus = 15.8f;
-    float aperture = 0.1f;
-
-    camera cam(lookfrom, lookat, vup, 20, ASPECT_RATIO, aperture, dist_to_focus);
+    aabb mesh_bounds;
+    if (instances > 0)
+        mesh_bounds = instance_bounds;
+    else if (mesh)
+        mesh->bounding_box(mesh_bounds);
+    scene_camera_record view = file.has_camera() ? file.header().camera
+                               : mesh            ? framing_camera_settings(mesh_bounds)
+                                                 : scene_camera_settings();
+    camera cam = make_camera(view, ASPECT_RATIO);
 
     // Render
+    render_context ctx{cam, world_bvh, materials, pixel_colors, width, height, samples_per_pixel, MAX_DEPTH, pattern};
 
-    ray_function functions[7] = {ray_trace_unopt, ray_trace_u2, ray_trace_u4, ray_trace_u8, ray_trace_u2_a2, ray_trace_u4_a2, ray_trace_u8_a2};
-    string names[7] = {"Unoptimized", "2x Unroll", "4x Unroll", "8x Unroll", "2x Unroll, 2 Accumulators", "4x Unroll, 2 Accumulators", "8x Unroll, 8 Accumulators"};
+    cerr << "Image Size:\t" << width << "x" << height << endl;
+    cerr << "Max Depth:\t" << MAX_DEPTH << endl;
+    cerr << "Samples/Pixel:\t" << samples_per_pixel << endl;
+    cerr << "Sampler:\t" << sample_pattern_name(pattern) << endl;
+    cerr << "Scene:\t\t" << (!scene_path.empty() ? scene_path : !obj_path.empty() ? obj_path : "built in") << " ("
+         << std::chrono::duration<double>(load_end - load_start).count() * 1000 << " ms)" << endl;
+    cerr << "Primitives:\t" << primitive_count << endl;
+    if (mesh)
+        cerr << "Mesh:\t\t" << mesh->triangle_count() << " triangles, " << mesh->vertex_count() << " vertices, "
+             << mesh->memory_bytes() / 1e6 << " MB" << endl;
+    if (instances > 0)
+    {
+        /* One copy of the mesh plus a transform per instance, against a copy of the mesh per instance */
+        size_t shared = mesh->memory_bytes() + instances * sizeof(instance) + world_bvh.node_count * sizeof(bvh_node);
+        cerr << "Instances:	" << instances << ", " << shared / 1e6 << " MB (" << (double)mesh->memory_bytes() * instances / 1e6
+             << " MB if copied)" << endl;
+    }
+    cerr << "BVH Nodes:\t" << world_bvh.node_count << endl;
 
-    cout << "P3\n"
-         << IMG_WIDTH << ' ' << IMG_HEIGHT << "\n255\n";
+    /* A worker renders the tiles a coordinator hands it and writes no image of its own */
+    if (!worker_address.empty())
+    {
+        string error;
+        int fd = farm_connect(worker_address, 30, error);
+        if (fd < 0)
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        work_stealing_pool pool(num_threads);
+        cerr << "Worker of " << worker_address << " (" << pool.size() << " threads)" << endl;
+        int tiles_done;
+        bool ok = farm_work(fd, ctx, scene_fingerprint(world_bvh, materials), pool, tiles_done, error);
+        close(fd);
+        cerr << "  rendered " << tiles_done << " tiles" << endl;
+        if (!ok)
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        cerr << "\nDone.\n";
+        return 0;
+    }
 
-    cerr << "Image Size:\t" << IMG_WIDTH << "x" << IMG_HEIGHT << endl;
-    cerr << "Max Depth:\t" << MAX_DEPTH << endl;
-    cerr << "Samples/Pixel:\t" << SAMPLES_PER_PIXEL << endl;
+    /* Under a NUMA placement the workers are pinned, and the framebuffer is
+       first touched only once the scheduler knows which worker gets which tile */
+    numa_topology topology = detect_numa_topology();
+    tile_scheduler scheduler(width, height, tile_size, num_threads,
+                             placement == numa_placement::none ? std::vector<int>()
+                                                               : topology.worker_cpus(num_threads));
+    std::unique_ptr<numa_buffer<color>> framebuffer;
+    std::unique_ptr<numa_scene> placed_scene;
+    if (placement != numa_placement::none)
+    {
+        framebuffer.reset(new numa_buffer<color>((size_t)width * height));
+        place_framebuffer(*framebuffer, width, height, placement, topology, scheduler);
+        pixel_colors = framebuffer->data();
+        ctx.pixel_colors = pixel_colors;
+        placed_scene.reset(new numa_scene(world_bvh, materials, world, placement, topology));
+    }
+    cerr << "Threads:\t" << scheduler.num_threads() << endl;
+    cerr << "Tile Size:\t" << tile_size << endl;
+    if (placement != numa_placement::none || numa_report)
+        cerr << "NUMA:\t\t" << topology.nodes() << " node(s), " << numa_placement_name(placement) << " placement, "
+             << (placed_scene ? placed_scene->copy_count() : 0) << " scene copies" << endl;
+
+    /* Pick the fastest kernel for this scene and machine, unless one was
+       given or the frame is less work than trying them all */
+    int tuned = kernel;
+    /* A resumed render keeps the kernel it was started with, which checkpoint.h explains */
+    if (tuned < 0 && !checkpoint_path.empty())
+        tuned = checkpoint_kernel(checkpoint_path);
+    tile calibration = calibration_tile(width, height, CALIBRATION_TILE_SIZE);
+    if (tuned < 0 && calibration_work(calibration, CALIBRATION_REPETITIONS, samples_per_pixel) >
+                         (long long)width * height * samples_per_pixel)
+    {
+        tuned = UNTUNED_KERNEL;
+        cerr << "Kernel:\t\t" << sample_kernels[tuned].name << " (frame too small to calibrate)" << endl;
+    }
+    else if (tuned < 0)
+    {
+        std::vector<double> calibration_times;
+        tuned = autotune_kernels(ctx, calibration, CALIBRATION_REPETITIONS, calibration_times);
+        cerr << "Calibration (" << calibration.x1 - calibration.x0 << "x" << calibration.y1 - calibration.y0 << " tile, "
+             << std::min(samples_per_pixel, calibration_samples) << " spp):" << endl;
+        for (int k = 0; k < num_sample_kernels; k++)
+            cerr << (k == tuned ? "  * " : "    ") << sample_kernels[k].name << "\t" << calibration_times[k] * 1000 << " ms" << endl;
+    }
+    else
+        cerr << "Kernel:\t\t" << sample_kernels[tuned].name << endl;
 
-    omp_set_dynamic(0);
-    omp_set_num_threads(NUM_THREADS);
+    image_stream stream;
+    bool streaming = false;
+    if (!listen_address.empty())
+    {
+        string error;
+        int fd = farm_listen(listen_address, error);
+        if (fd < 0)
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        cerr << "Farming " << scheduler.tiles.size() << " tiles on " << listen_address << " with "
+             << sample_kernels[tuned].name << "..." << endl;
+        farm_report report;
+        auto start = std::chrono::high_resolution_clock::now();
+        farm_coordinate(fd, ctx, scene_fingerprint(world_bvh, materials), tuned, scheduler.tiles, report);
+        auto end = std::chrono::high_resolution_clock::now();
+        farm_unlisten(fd, listen_address);
+        report_tiles(scheduler, list_tiles);
+        cerr << "  " << std::chrono::duration<double>(end - start).count() * 1000 << " ms, " << report.workers
+             << " workers, " << report.lost << " tiles lost, " << report.reissued << " reissued, "
+             << report.refused << " refused" << endl;
+    }
+    else if (!serve_address.empty())
+    {
+        /* Jobs write their own images, so there is no single image to write below */
+        char output_dir[PATH_MAX];
+        struct stat st;
+        if (!realpath(serve_output.c_str(), output_dir) || stat(output_dir, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            cerr << "--serve-output " << serve_output << " is not a directory" << endl;
+            return 1;
+        }
+        string error;
+        int fd = farm_listen(serve_address, error);
+        if (fd < 0)
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        cerr << "Serving renders on " << serve_address << " into " << output_dir << " with "
+             << sample_kernels[tuned].name << "..." << endl;
+        render_service service(world_bvh, materials, view, tuned, scheduler, tile_size, output_dir);
+        service.serve(fd, stop_requested);
+        farm_unlisten(fd, serve_address);
+        cerr << "\nDone.\n";
+        return 0;
+    }
+    else if (numa_report)
+    {
+        driver_numa_report(sample_kernels[tuned].func, sample_kernels[tuned].name, ctx, world_bvh, materials, world,
+                           topology, scheduler.num_threads(), tile_size);
+        cerr << "\nDone.\n";
+        return 0;
+    }
+    else if (compare)
+    {
+        std::vector<wavefront_renderer> renderers(
+            scheduler.num_threads(), wavefront_renderer(width, height, samples_per_pixel, MAX_DEPTH, pattern));
 
-    /* Using OpenMP */
-    for (int i = 0; i < 7; i++)
+        /* Work-stealing tile pool */
+        for (int i = 0; i < num_sample_kernels; i++)
+        {
+            driver(sample_kernels[i].func, sample_kernels[i].name, ctx, scheduler, 1, list_tiles);
+        }
+        driver_wavefront(ctx, renderers, scheduler, 1, list_tiles);
+        /* Single-Threaded Code */
+        for (int i = 0; i < num_sample_kernels; i++)
+        {
+            driver(sample_kernels[i].func, sample_kernels[i].name, ctx, scheduler, 0, list_tiles);
+        }
+        driver_wavefront(ctx, renderers, scheduler, 0, list_tiles);
+    }
+    else if (frames > 0)
+    {
+        /* Every frame goes to its own file, so there is no single image to write below */
+        if (!driver_animation(world, materials, turntable_animation(world, view, frames), sample_kernels[tuned], ctx,
+                              scheduler, rebuild_threshold, format, output, list_tiles))
+            return 1;
+        cerr << "\nDone.\n";
+        return 0;
+    }
+    else if (!checkpoint_path.empty())
     {
-        driver(functions[i], names[i], cam, world, pixel_colors, 1);
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        if (!driver_checkpointed(ctx, tuned, scheduler, scene_fingerprint(world_bvh, materials),
+                                 checkpoint_path, checkpoint_interval, list_tiles))
+            return 1;
+        /* The checkpointed renderer leaves the mean of each pixel, not the sum */
+        samples_per_pixel = 1;
     }
-    /* Single-Threaded Code */
-    for (int i = 0; i < 7; i++)
+    else if (adaptive)
+    {
+        driver_adaptive(ctx, adaptive_config, scheduler, list_tiles);
+        /* The adaptive renderer leaves the mean of each pixel, not the sum */
+        samples_per_pixel = 1;
+    }
+    else if (placed_scene)
+    {
+        streaming = stream_output && open_stream(stream, output, format, ctx, scheduler.tiles.size());
+        driver_numa(sample_kernels[tuned].func, sample_kernels[tuned].name, ctx, *placed_scene, topology, scheduler,
+                    list_tiles, streaming ? &stream : nullptr);
+    }
+    else
+    {
+        streaming = stream_output && open_stream(stream, output, format, ctx, scheduler.tiles.size());
+        driver(sample_kernels[tuned].func, sample_kernels[tuned].name, ctx, scheduler, 1, list_tiles,
+               streaming ? &stream : nullptr);
+    }
+
+    /* A streamed image only has its last tiles left to encode */
+    auto write_start = std::chrono::high_resolution_clock::now();
+    if (streaming ? !stream.close() : !write_image(output, format, pixel_colors, width, height, samples_per_pixel))
     {
-        driver(functions[i], names[i], cam, world, pixel_colors, 0);
+        cerr << "Could not write " << output << endl;
+        return 1;
     }
-    write_colors(std::cout, pixel_colors, IMG_WIDTH * IMG_HEIGHT, SAMPLES_PER_PIXEL);
+    cerr << "Output:\t\t" << std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - write_start).count() * 1000
+         << " ms after the render";
+    if (streaming)
+        cerr << ", streamed (" << stream.encode_seconds * 1000 << " ms of encoding overlapped)";
+    cerr << endl;
 
     cerr << "\nDone.\n";
 }
\ No newline at end of file
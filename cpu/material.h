@@ -3,24 +3,30 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
 struct hit_record;
 
-class material
+// Concrete material types, so batched renderers can group hits by type
+enum class material_kind
 {
-public:
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const = 0;
+    lambertian,
+    metal,
+    dielectric,
+    count
 };
 
-class lambertian : public material
+class lambertian
 {
 public:
     lambertian(const color &a) : albedo(a) {}
 
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
+    bool scatter(
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &rand) const
     {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        auto scatter_direction = rec.normal + random_unit_vector(rand);
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
@@ -35,16 +41,16 @@ public:
     color albedo;
 };
 
-class metal : public material
+class metal
 {
 public:
     metal(const color &a, float f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
+    bool scatter(
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &rand) const
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
+        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(rand));
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -54,25 +60,25 @@ public:
     float fuzz;
 };
 
-class dielectric : public material
+class dielectric
 {
 public:
     dielectric(float index_of_refraction) : ir(index_of_refraction) {}
 
-    virtual bool scatter(
-        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
+    bool scatter(
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &rand) const
     {
-        attenuation = color(1.0, 1.0, 1.0);
-        float refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
+        attenuation = color(1.0f, 1.0f, 1.0f);
+        float refraction_ratio = rec.front_face ? (1.0f / ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
-        float cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-        float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+        float cos_theta = std::fmin(-dot(unit_direction, rec.normal), 1.0f);
+        float sin_theta = std::sqrt(1.0f - cos_theta * cos_theta);
 
-        bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+        bool cannot_refract = refraction_ratio * sin_theta > 1.0f;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_float())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > rand.next_float())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -88,8 +94,101 @@ private:
     static float reflectance(float cosine, float ref_idx)
     {
         // Use Schlick's approximation for reflectance.
-        auto r0 = (1 - ref_idx) / (1 + ref_idx);
+        float r0 = (1 - ref_idx) / (1 + ref_idx);
         r0 = r0 * r0;
-        return r0 + (1 - r0) * pow((1 - cosine), 5);
+        float x = 1 - cosine, x2 = x * x;
+        return r0 + (1 - r0) * (x2 * x2 * x);
+    }
+};
+
+// One of the concrete materials above, tagged by kind. scatter() dispatches
+// with a switch, so there is no virtual call and materials can sit by value
+// in a flat table.
+class material
+{
+public:
+    material(const lambertian &m) : kind(material_kind::lambertian), lambertian_mat(m) {}
+    material(const metal &m) : kind(material_kind::metal), metal_mat(m) {}
+    material(const dielectric &m) : kind(material_kind::dielectric), dielectric_mat(m) {}
+
+    bool scatter(
+        const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, rng &rand) const
+    {
+        switch (kind)
+        {
+        case material_kind::lambertian:
+            return lambertian_mat.scatter(r_in, rec, attenuation, scattered, rand);
+        case material_kind::metal:
+            return metal_mat.scatter(r_in, rec, attenuation, scattered, rand);
+        case material_kind::dielectric:
+            return dielectric_mat.scatter(r_in, rec, attenuation, scattered, rand);
+        default:
+            return false;
+        }
+    }
+
+    // The concrete material, for callers that already know the kind
+    template <typename M>
+    const M &as() const
+    {
+        if constexpr (std::is_same<M, lambertian>::value)
+            return lambertian_mat;
+        else if constexpr (std::is_same<M, metal>::value)
+            return metal_mat;
+        else
+            return dielectric_mat;
+    }
+
+public:
+    material_kind kind;
+
+private:
+    union
+    {
+        lambertian lambertian_mat;
+        metal metal_mat;
+        dielectric dielectric_mat;
+    };
+};
+
+// Every material of a scene in one contiguous array. Primitives and hit
+// records refer to materials by their 32-bit index in the table. The array
+// is either the table's own, grown with add(), or a view of materials stored
+// elsewhere, such as a mapped scene file.
+class material_table
+{
+public:
+    material_table() {}
+    material_table(const material *data, size_t count) : data(data), count(count) {}
+
+    // `data` may point into this table's own storage
+    material_table(const material_table &) = delete;
+    material_table &operator=(const material_table &) = delete;
+    material_table(material_table &&) = default;
+    material_table &operator=(material_table &&) = default;
+
+    // Only for tables that own their materials, not for views
+    uint32_t add(const material &m)
+    {
+        materials.push_back(m);
+        data = materials.data();
+        count = materials.size();
+        return (uint32_t)(count - 1);
     }
-};
\ No newline at end of file
+
+    const material &operator[](uint32_t id) const { return data[id]; }
+    size_t size() const { return count; }
+    void clear()
+    {
+        materials.clear();
+        data = nullptr;
+        count = 0;
+    }
+
+public:
+    std::vector<material> materials;
+
+private:
+    const material *data = nullptr;
+    size_t count = 0;
+};
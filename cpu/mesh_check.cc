@@ -0,0 +1,221 @@
+/*
+    Triangle mesh leak check
+
+    Aims rays exactly where a test that is not watertight lets them through:
+    at points on edges shared by two triangles, and at vertices shared by
+    several. Two meshes: a jittered, tilted grid of quads, each split along
+    a diagonal, shot at from both sides, and a closed sphere made by
+    subdividing an octahedron, shot at from points inside it. Every ray must
+    hit the mesh. Reports the misses of each kind and fails on any.
+
+    Build: g++ -O3 -march=native -o mesh_check mesh_check.cc
+           g++ -O3 -mavx2 -mfma -o mesh_check_avx2 mesh_check.cc
+           g++ -O3 -o mesh_check_scalar mesh_check.cc
+    Usage: ./mesh_check [--count N]
+*/
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "triangle_mesh.h"
+
+const int DEFAULT_COUNT = 500000;
+const int GRID_QUADS = 24;
+const int SPHERE_LEVELS = 5;
+
+struct mesh_data
+{
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;
+};
+
+/* Edges used by exactly two triangles, as vertex index pairs */
+std::vector<std::pair<uint32_t, uint32_t>> shared_edges(const mesh_data &m)
+{
+    std::map<std::pair<uint32_t, uint32_t>, int> uses;
+    for (size_t k = 0; k < m.indices.size(); k += 3)
+        for (int e = 0; e < 3; e++)
+        {
+            uint32_t a = m.indices[k + e], b = m.indices[k + (e + 1) % 3];
+            uses[{std::min(a, b), std::max(a, b)}]++;
+        }
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    for (const auto &u : uses)
+        if (u.second == 2)
+            edges.push_back(u.first);
+    return edges;
+}
+
+/* A (n + 1)^2 vertex grid on a tilted plane, inner vertices jittered so the
+   coordinates are not round, every quad cut along one of its diagonals */
+mesh_data tilted_grid(int n, rng &rand)
+{
+    mesh_data m;
+    for (int j = 0; j <= n; j++)
+        for (int i = 0; i <= n; i++)
+        {
+            bool inner = i > 0 && i < n && j > 0 && j < n;
+            float x = i + (inner ? rand.next_float(-0.3f, 0.3f) : 0);
+            float y = j + (inner ? rand.next_float(-0.3f, 0.3f) : 0);
+            m.vertices.push_back(point3(0.37f * x + 1.1f, 0.41f * y - 2.3f, 0.13f * x - 0.29f * y + 5.7f));
+        }
+    for (int j = 0; j < n; j++)
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t a = j * (n + 1) + i, b = a + 1, c = a + n + 1, d = c + 1;
+            if ((i + j) % 2)
+                m.indices.insert(m.indices.end(), {a, b, d, a, d, c});
+            else
+                m.indices.insert(m.indices.end(), {a, b, c, b, d, c});
+        }
+    return m;
+}
+
+/* Octahedron subdivided `levels` times and pushed out onto a sphere */
+mesh_data octahedron_sphere(int levels, point3 center, float radius)
+{
+    std::vector<vec3> dirs = {vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0),
+                              vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1)};
+    std::vector<uint32_t> tris = {0, 2, 4, 2, 1, 4, 1, 3, 4, 3, 0, 4,
+                                  2, 0, 5, 1, 2, 5, 3, 1, 5, 0, 3, 5};
+    for (int l = 0; l < levels; l++)
+    {
+        std::map<std::pair<uint32_t, uint32_t>, uint32_t> midpoints;
+        auto midpoint = [&](uint32_t a, uint32_t b)
+        {
+            auto key = std::make_pair(std::min(a, b), std::max(a, b));
+            auto found = midpoints.find(key);
+            if (found != midpoints.end())
+                return found->second;
+            dirs.push_back(unit_vector(dirs[a] + dirs[b]));
+            return midpoints[key] = (uint32_t)dirs.size() - 1;
+        };
+        std::vector<uint32_t> finer;
+        for (size_t k = 0; k < tris.size(); k += 3)
+        {
+            uint32_t a = tris[k], b = tris[k + 1], c = tris[k + 2];
+            uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            finer.insert(finer.end(), {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca});
+        }
+        tris.swap(finer);
+    }
+    mesh_data m;
+    for (const vec3 &d : dirs)
+        m.vertices.push_back(center + radius * d);
+    m.indices = tris;
+    return m;
+}
+
+/* A random int in [lo, hi) */
+int pick(rng &rand, int lo, int hi)
+{
+    return lo + (int)(rand.next_uint() % (uint32_t)(hi - lo));
+}
+
+/* Misses among rays shot at targets */
+struct leak_count
+{
+    string name;
+    long rays = 0, misses = 0;
+    void shoot(const triangle_mesh &mesh, const point3 &origin, const point3 &target)
+    {
+        hit_record rec;
+        rays++;
+        misses += !mesh.hit(ray(origin, target - origin), 0.0f, infinity, rec);
+    }
+};
+
+int main(int argc, char **argv)
+{
+    int count = DEFAULT_COUNT;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--count") && i + 1 < argc)
+            count = std::atoi(argv[++i]);
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--count N]" << endl;
+            return 2;
+        }
+    }
+
+#if defined(__AVX512F__)
+    cout << "leaf test: AVX-512" << endl;
+#elif defined(__AVX2__)
+    cout << "leaf test: AVX2" << endl;
+#else
+    cout << "leaf test: scalar" << endl;
+#endif
+
+    rng rand(0x5eed, 0);
+    leak_count grid_edges{"grid edges"}, grid_vertices{"grid vertices"}, sphere_edges{"sphere edges"},
+        sphere_vertices{"sphere vertices"};
+
+    /* Both sides of the grid, from well off the plane so only the target
+       decides the hit; the vertices are the inner ones, which have a
+       triangle on every side */
+    mesh_data grid = tilted_grid(GRID_QUADS, rand);
+    triangle_mesh grid_mesh(grid.vertices, grid.indices, 0);
+    std::vector<std::pair<uint32_t, uint32_t>> edges = shared_edges(grid);
+    vec3 normal = unit_vector(cross(grid.vertices[1] - grid.vertices[0],
+                                    grid.vertices[GRID_QUADS + 1] - grid.vertices[0]));
+    auto grid_origin = [&](const point3 &target)
+    {
+        vec3 d = random_unit_vector(rand);
+        float side = dot(d, normal);
+        if (std::fabs(side) < 0.2f)
+            d += (side < 0 ? -0.5f : 0.5f) * normal;
+        return target + rand.next_float(0.5f, 20.0f) * d;
+    };
+    for (int i = 0; i < count; i++)
+    {
+        const auto &e = edges[pick(rand, 0, (int)edges.size())];
+        point3 a = grid.vertices[e.first], b = grid.vertices[e.second];
+        point3 target = a + rand.next_float() * (b - a);
+        grid_edges.shoot(grid_mesh, grid_origin(target), target);
+
+        int vi = pick(rand, 1, GRID_QUADS), vj = pick(rand, 1, GRID_QUADS);
+        target = grid.vertices[vj * (GRID_QUADS + 1) + vi];
+        grid_vertices.shoot(grid_mesh, grid_origin(target), target);
+    }
+
+    /* From inside the sphere, every direction must leave through the mesh */
+    point3 center(3.7f, -1.2f, 0.4f);
+    mesh_data sphere = octahedron_sphere(SPHERE_LEVELS, center, 1.3f);
+    triangle_mesh sphere_mesh(sphere.vertices, sphere.indices, 0);
+    edges = shared_edges(sphere);
+    for (int i = 0; i < count; i++)
+    {
+        const auto &e = edges[pick(rand, 0, (int)edges.size())];
+        point3 a = sphere.vertices[e.first], b = sphere.vertices[e.second];
+        point3 target = a + rand.next_float() * (b - a);
+        sphere_edges.shoot(sphere_mesh, center + 0.6f * random_in_unit_sphere(rand), target);
+
+        target = sphere.vertices[pick(rand, 0, (int)sphere.vertices.size())];
+        sphere_vertices.shoot(sphere_mesh, center + 0.6f * random_in_unit_sphere(rand), target);
+    }
+
+    const leak_count *all[] = {&grid_edges, &grid_vertices, &sphere_edges, &sphere_vertices};
+    cout << std::left << std::setw(18) << "target" << std::right << std::setw(12) << "rays" << std::setw(10)
+         << "misses" << endl;
+    bool ok = true;
+    for (const leak_count *c : all)
+    {
+        cout << std::left << std::setw(18) << c->name << std::right << std::setw(12) << c->rays << std::setw(10)
+             << c->misses << endl;
+        ok = ok && c->misses == 0;
+    }
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "scheduler.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Where a render's memory goes on a machine with several NUMA nodes:
+//   none:       as allocated, by whichever thread first touches it, with
+//               workers free to run anywhere
+//   local:      workers pinned node by node; every node gets its own copy of
+//               the scene, and each worker first-touches the framebuffer
+//               pages of the tiles it is dealt, so reads and writes stay on
+//               the worker's own node
+//   interleave: workers pinned the same way, but one copy of the scene and
+//               the framebuffer spread page by page over all nodes, so
+//               every node's traffic is split evenly between them
+enum class numa_placement
+{
+    none,
+    local,
+    interleave
+};
+
+inline const char *numa_placement_name(numa_placement placement)
+{
+    switch (placement)
+    {
+    case numa_placement::local:
+        return "local";
+    case numa_placement::interleave:
+        return "interleave";
+    default:
+        return "none";
+    }
+}
+
+inline bool parse_numa_placement(const std::string &name, numa_placement &placement)
+{
+    if (name == "none")
+        placement = numa_placement::none;
+    else if (name == "local")
+        placement = numa_placement::local;
+    else if (name == "interleave")
+        placement = numa_placement::interleave;
+    else
+        return false;
+    return true;
+}
+
+// The machine's NUMA nodes with the CPUs of each, read from sysfs. Without
+// it the machine counts as a single node holding every CPU.
+struct numa_topology
+{
+    std::vector<int> node_ids;              // kernel numbering, which may have gaps
+    std::vector<std::vector<int>> node_cpus; // per node, never empty
+
+    int nodes() const { return (int)node_ids.size(); }
+
+    // Node of worker w of `workers`: consecutive workers share a node and
+    // every node gets an equal share, the same split the work-stealing pool
+    // uses to deal tasks, so a node's workers start on adjacent tiles
+    int worker_node(int worker, int workers) const { return (int)((int64_t)worker * nodes() / workers); }
+
+    // CPU to pin each of `workers` threads to, wrapping round a node's CPUs
+    // if it has more workers than CPUs
+    std::vector<int> worker_cpus(int workers) const;
+};
+
+namespace numa_detail
+{
+    // Parses a sysfs CPU list such as "0-3,8-11"
+    inline std::vector<int> parse_cpu_list(const std::string &text)
+    {
+        std::vector<int> cpus;
+        std::stringstream in(text);
+        std::string range;
+        while (std::getline(in, range, ','))
+        {
+            int first, last;
+            char dash;
+            std::stringstream r(range);
+            if (!(r >> first))
+                continue;
+            if (!(r >> dash >> last))
+                last = first;
+            for (int c = first; c <= last; c++)
+                cpus.push_back(c);
+        }
+        return cpus;
+    }
+
+    inline long mempolicy_mask(const numa_topology &topology, unsigned long &mask)
+    {
+        mask = 0;
+        for (int id : topology.node_ids)
+            mask |= 1ul << id;
+        return 8 * sizeof(mask);
+    }
+}
+
+numa_topology detect_numa_topology()
+{
+    numa_topology topology;
+    for (int id = 0; id < 64; id++)
+    {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        std::string text;
+        if (!in || !std::getline(in, text))
+            continue;
+        std::vector<int> cpus = numa_detail::parse_cpu_list(text);
+        if (cpus.empty()) // memory-only node
+            continue;
+        topology.node_ids.push_back(id);
+        topology.node_cpus.push_back(cpus);
+    }
+    if (topology.node_ids.empty())
+    {
+        std::vector<int> every;
+        for (int c = 0; c < (int)std::max(1u, std::thread::hardware_concurrency()); c++)
+            every.push_back(c);
+        topology.node_ids.push_back(0);
+        topology.node_cpus.push_back(every);
+    }
+    return topology;
+}
+
+std::vector<int> numa_topology::worker_cpus(int workers) const
+{
+    std::vector<int> cpus(workers);
+    for (int w = 0; w < workers; w++)
+    {
+        int node = worker_node(w, workers);
+        int first = (int)(((int64_t)node * workers + nodes() - 1) / nodes()); // first worker of the node
+        const std::vector<int> &own = node_cpus[node];
+        cpus[w] = own[(w - first) % own.size()];
+    }
+    return cpus;
+}
+
+// Makes later page faults of the calling thread spread over every node
+inline bool interleave_thread_memory(const numa_topology &topology)
+{
+    unsigned long mask;
+    long max_node = numa_detail::mempolicy_mask(topology, mask);
+    return syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, &mask, max_node) == 0;
+}
+
+// `count` Ts in an anonymous mapping that nothing has touched yet, so each
+// page lands on the node of the first thread to write it, or on every node
+// in turn after interleave(). Reads as zeros until written, so only for
+// types that are valid as all zero bits, such as color.
+template <typename T>
+class numa_buffer
+{
+public:
+    explicit numa_buffer(size_t count);
+    ~numa_buffer();
+
+    numa_buffer(const numa_buffer &) = delete;
+    numa_buffer &operator=(const numa_buffer &) = delete;
+
+    // Spreads the pages over every node; only before they are touched
+    bool interleave(const numa_topology &topology);
+
+    T *data() const { return items; }
+    size_t size() const { return count; }
+
+private:
+    T *items = nullptr;
+    size_t count;
+    size_t bytes;
+};
+
+template <typename T>
+numa_buffer<T>::numa_buffer(size_t count) : count(count), bytes(std::max<size_t>(1, count * sizeof(T)))
+{
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+    items = static_cast<T *>(p);
+}
+
+template <typename T>
+numa_buffer<T>::~numa_buffer()
+{
+    munmap(items, bytes);
+}
+
+template <typename T>
+bool numa_buffer<T>::interleave(const numa_topology &topology)
+{
+    unsigned long mask;
+    long max_node = numa_detail::mempolicy_mask(topology, mask);
+    return syscall(SYS_mbind, items, bytes, MPOL_INTERLEAVE, &mask, max_node, 0) == 0;
+}
+
+// First-touches a framebuffer for `placement`: under local, each worker of
+// `scheduler` clears the pixels of the tiles it will be dealt first; under
+// interleave and none, the calling thread clears them all and the pages go
+// wherever their policy says.
+void place_framebuffer(numa_buffer<color> &framebuffer, int width, int height, numa_placement placement,
+                       const numa_topology &topology, tile_scheduler &scheduler)
+{
+    if (placement == numa_placement::interleave)
+        framebuffer.interleave(topology);
+    if (placement != numa_placement::local)
+    {
+        std::fill(framebuffer.data(), framebuffer.data() + framebuffer.size(), color());
+        return;
+    }
+    color *pixels = framebuffer.data();
+    scheduler.first_touch([&](const tile &t, int)
+                          {
+                              for (int j = t.y0; j < t.y1; ++j)
+                                  for (int i = t.x0; i < t.x1; ++i)
+                                      pixels[(height - j - 1) * width + i] = color();
+                          });
+}
+
+// The read-only scene as each node's workers see it. Under local every node
+// gets its own copy of the tree and the material table, made by a thread
+// pinned to the node so their pages land there; under interleave there is
+// one copy whose pages are spread over every node; under none the caller's
+// scene is used as it is. A tree with packed sphere leaves is copied
+// outright. Any other tree is rebuilt from `world`, and shares the objects
+// in it, e.g. a mesh's triangles, between the copies; with no `world` it is
+// not copied at all.
+class numa_scene
+{
+public:
+    numa_scene(const bvh &accel, const material_table &materials, const hittable_list &world,
+               numa_placement placement, const numa_topology &topology);
+
+    const bvh &accel(int node) const { return copies.empty() ? shared_accel : *copies[node % copies.size()].tree; }
+    const material_table &materials(int node) const
+    {
+        return copies.empty() ? shared_materials : copies[node % copies.size()].table;
+    }
+
+    int copy_count() const { return (int)copies.size(); }
+
+private:
+    struct copy
+    {
+        std::vector<bvh_node> nodes; // for copied packed trees
+        std::unique_ptr<bvh> tree;
+        material_table table;
+    };
+
+    void make_copy(copy &c, const hittable_list &world);
+
+    const bvh &shared_accel;
+    const material_table &shared_materials;
+    std::vector<copy> copies;
+};
+
+numa_scene::numa_scene(const bvh &accel, const material_table &materials, const hittable_list &world,
+                       numa_placement placement, const numa_topology &topology)
+    : shared_accel(accel), shared_materials(materials)
+{
+    if (placement == numa_placement::none || (!accel.packed_leaves() && world.objects.empty()))
+        return;
+
+    copies.resize(placement == numa_placement::local ? topology.nodes() : 1);
+    for (size_t n = 0; n < copies.size(); n++)
+    {
+        // Pages are placed by the thread that first touches them
+        std::thread maker([&, n]
+                          {
+                              if (placement == numa_placement::local)
+                                  pin_current_thread(topology.node_cpus[n][0]);
+                              else
+                                  interleave_thread_memory(topology);
+                              make_copy(copies[n], world);
+                          });
+        maker.join();
+    }
+}
+
+void numa_scene::make_copy(copy &c, const hittable_list &world)
+{
+    for (size_t m = 0; m < shared_materials.size(); m++)
+        c.table.add(shared_materials[(uint32_t)m]);
+
+    if (!shared_accel.packed_leaves())
+    {
+        c.tree.reset(new bvh(world));
+        return;
+    }
+    c.nodes.assign(shared_accel.nodes, shared_accel.nodes + shared_accel.node_count);
+    const packed_spheres &from = shared_accel.packed;
+    packed_spheres spheres;
+    for (int i = 0; i < from.size(); i++)
+        spheres.add(sphere(point3(from.center_x[i], from.center_y[i], from.center_z[i]), from.radius[i],
+                           from.material_id[i]));
+    c.tree.reset(new bvh(c.nodes.data(), (int)c.nodes.size(), std::move(spheres)));
+}
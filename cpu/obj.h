@@ -0,0 +1,152 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Wavefront OBJ geometry reader. Only vertex positions ("v") and faces ("f")
+// are read; texture coordinates, normals, groups and materials are skipped.
+// Faces with more than three corners are split into a fan, and corner
+// references may be negative (relative to the last vertex) or carry /vt/vn
+// parts, which are ignored.
+//
+// The file is read in fixed-size chunks and parsed in place, so memory is
+// the output arrays plus one chunk, and nothing is allocated per face.
+
+namespace obj_detail
+{
+    inline const char *skip_space(const char *p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        return p;
+    }
+
+    // Parses one NUL-terminated line. Returns false on a malformed line.
+    inline bool parse_line(const char *p, std::vector<point3> &vertices, std::vector<uint32_t> &indices)
+    {
+        p = skip_space(p);
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            float xyz[3];
+            for (float &c : xyz)
+            {
+                char *end;
+                c = std::strtof(p + 1, &end);
+                if (end == p + 1)
+                    return false;
+                p = end - 1;
+            }
+            vertices.emplace_back(xyz[0], xyz[1], xyz[2]);
+            return true;
+        }
+        if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+            long count = (long)vertices.size();
+            uint32_t first = 0, previous = 0;
+            int corners = 0;
+            while (*(p = skip_space(p)) != '\0')
+            {
+                char *end;
+                long index = std::strtol(p, &end, 10);
+                if (end == p)
+                    return false;
+                // 1-based, or negative to count back from the newest vertex
+                index = index > 0 ? index - 1 : count + index;
+                if (index < 0 || index >= count)
+                    return false;
+                p = end;
+                while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r')
+                    p++;
+
+                if (corners == 0)
+                    first = (uint32_t)index;
+                else if (corners >= 2)
+                {
+                    indices.push_back(first);
+                    indices.push_back(previous);
+                    indices.push_back((uint32_t)index);
+                }
+                previous = (uint32_t)index;
+                corners++;
+            }
+            return corners >= 3;
+        }
+        return true;
+    }
+}
+
+// Appends the file's vertices and triangles (three indices each, into
+// `vertices`) to the arrays. Returns false with a reason in `error` if the
+// file could not be read or has a malformed line.
+bool load_obj(const std::string &path, std::vector<point3> &vertices, std::vector<uint32_t> &indices,
+              std::string &error)
+{
+    std::FILE *in = std::fopen(path.c_str(), "rb");
+    if (!in)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    const size_t chunk = 1 << 20;
+    std::vector<char> buffer(chunk + 1);
+    size_t kept = 0; // bytes of an unfinished line carried over from the last chunk
+    long line_number = 0;
+    bool ok = true;
+
+    while (ok)
+    {
+        size_t got = std::fread(buffer.data() + kept, 1, chunk - kept, in);
+        bool last = got < chunk - kept;
+        size_t size = kept + got;
+        buffer[size] = '\0';
+
+        char *p = buffer.data();
+        char *limit = p + size;
+        while (p < limit)
+        {
+            char *newline = (char *)std::memchr(p, '\n', limit - p);
+            if (!newline)
+            {
+                if (!last)
+                    break;
+                newline = limit;
+            }
+            *newline = '\0';
+            line_number++;
+            if (!obj_detail::parse_line(p, vertices, indices))
+            {
+                error = path + ":" + std::to_string(line_number) + ": cannot parse '" + p + "'";
+                ok = false;
+                break;
+            }
+            p = newline + 1;
+        }
+        if (!ok || last)
+            break;
+
+        kept = limit - p;
+        if (kept == chunk)
+        {
+            error = path + ":" + std::to_string(line_number + 1) + ": line too long";
+            ok = false;
+            break;
+        }
+        std::memmove(buffer.data(), p, kept);
+    }
+
+    if (ok && std::ferror(in))
+    {
+        error = "cannot read " + path;
+        ok = false;
+    }
+    std::fclose(in);
+    return ok;
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Spheres stored as structure-of-arrays so one ray is tested against a whole
+// register of them per instruction: 16 with AVX-512, 8 with AVX2, and one at
+// a time in the scalar fallback.
+//
+// Works as a flat container on its own, and the bvh uses hit_range() to test
+// its leaves when every primitive is a sphere. The arrays are read through
+// plain pointers, so they can also be a view of arrays stored elsewhere, such
+// as a mapped scene file.
+class packed_spheres : public hittable
+{
+public:
+#if defined(__AVX512F__)
+    static constexpr int lanes = 16;
+#elif defined(__AVX2__)
+    static constexpr int lanes = 8;
+#else
+    static constexpr int lanes = 1;
+#endif
+
+    packed_spheres() { pad(); }
+    packed_spheres(const hittable_list &list);
+    // A view of `count` spheres in arrays owned by someone else. Each array
+    // must hold at least `lanes` NaN spheres (material 0) after the last one.
+    packed_spheres(const float *center_x, const float *center_y, const float *center_z,
+                   const float *radius, const uint32_t *material_id, int count)
+        : center_x(center_x), center_y(center_y), center_z(center_z),
+          radius(radius), material_id(material_id), count(count) {}
+
+    // The pointers may refer to this object's own storage
+    packed_spheres(const packed_spheres &) = delete;
+    packed_spheres &operator=(const packed_spheres &) = delete;
+    packed_spheres(packed_spheres &&) = default;
+    packed_spheres &operator=(packed_spheres &&) = default;
+
+    // Only for spheres built with add(), not for views
+    void add(const sphere &s);
+    // Replaces sphere `index`, e.g. after it moved
+    void set(int index, const sphere &s);
+    int size() const { return count; }
+
+    // Closest hit among spheres [first, first + n)
+    bool hit_range(
+        const ray &r, int first, int n, float t_min, float t_max, hit_record &rec) const;
+
+    virtual bool hit(
+        const ray &r, float t_min, float t_max, hit_record &rec) const override
+    {
+        return hit_range(r, 0, count, t_min, t_max, rec);
+    }
+
+    virtual bool bounding_box(aabb &output_box) const override;
+
+    // Fills rec for a hit at distance t on sphere `index`
+    bool fill_record(const ray &r, int index, float t, hit_record &rec) const;
+
+public:
+    // Each array holds count spheres followed by `lanes` NaN spheres, so a
+    // full-width load starting at any sphere stays in bounds and the padding
+    // never passes the discriminant test.
+    const float *center_x, *center_y, *center_z, *radius;
+    const uint32_t *material_id;
+
+private:
+    void pad();
+
+    int count = 0;
+    std::vector<float> owned_x, owned_y, owned_z, owned_radius;
+    std::vector<uint32_t> owned_material_id;
+};
+
+packed_spheres::packed_spheres(const hittable_list &list)
+{
+    pad();
+    for (const auto &object : list.objects)
+    {
+        auto s = dynamic_cast<const sphere *>(object.get());
+        if (s)
+            add(*s);
+        else
+            std::cerr << "packed_spheres only holds spheres, skipping object.\n";
+    }
+}
+
+void packed_spheres::pad()
+{
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    owned_x.resize(count + lanes, nan);
+    owned_y.resize(count + lanes, nan);
+    owned_z.resize(count + lanes, nan);
+    owned_radius.resize(count + lanes, nan);
+    owned_material_id.resize(count + lanes, 0);
+
+    center_x = owned_x.data();
+    center_y = owned_y.data();
+    center_z = owned_z.data();
+    radius = owned_radius.data();
+    material_id = owned_material_id.data();
+}
+
+void packed_spheres::add(const sphere &s)
+{
+    // Overwrite the first padding slot and grow the padding by one
+    owned_x[count] = s.center.x();
+    owned_y[count] = s.center.y();
+    owned_z[count] = s.center.z();
+    owned_radius[count] = s.radius;
+    owned_material_id[count] = s.mat_id;
+    count++;
+    pad();
+}
+
+void packed_spheres::set(int index, const sphere &s)
+{
+    owned_x[index] = s.center.x();
+    owned_y[index] = s.center.y();
+    owned_z[index] = s.center.z();
+    owned_radius[index] = s.radius;
+    owned_material_id[index] = s.mat_id;
+}
+
+bool packed_spheres::fill_record(const ray &r, int index, float t, hit_record &rec) const
+{
+    point3 center(center_x[index], center_y[index], center_z[index]);
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[index];
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_id = material_id[index];
+    return true;
+}
+
+#if defined(__AVX512F__)
+
+bool packed_spheres::hit_range(
+    const ray &r, int first, int n, float t_min, float t_max, hit_record &rec) const
+{
+    const __m512 ox = _mm512_set1_ps(r.orig.x());
+    const __m512 oy = _mm512_set1_ps(r.orig.y());
+    const __m512 oz = _mm512_set1_ps(r.orig.z());
+    const __m512 dx = _mm512_set1_ps(r.dir.x());
+    const __m512 dy = _mm512_set1_ps(r.dir.y());
+    const __m512 dz = _mm512_set1_ps(r.dir.z());
+    const __m512 a = _mm512_set1_ps(r.dir.length_squared());
+    const __m512 t_lo = _mm512_set1_ps(t_min);
+    const __m512i lane_ids = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    // Per-lane closest hit so far; reduced across lanes once at the end
+    __m512 best_t = _mm512_set1_ps(t_max);
+    __m512i best_index = _mm512_set1_epi32(-1);
+
+    const int end = first + n;
+    for (int i = first; i < end; i += lanes)
+    {
+        __mmask16 active = _mm512_cmplt_epi32_mask(lane_ids, _mm512_set1_epi32(end - i));
+
+        __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&center_x[i]));
+        __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&center_y[i]));
+        __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&center_z[i]));
+        __m512 rad = _mm512_loadu_ps(&radius[i]);
+
+        __m512 half_b = _mm512_fmadd_ps(ocx, dx, _mm512_fmadd_ps(ocy, dy, _mm512_mul_ps(ocz, dz)));
+        __m512 c = _mm512_fmsub_ps(ocx, ocx, _mm512_fmsub_ps(rad, rad, _mm512_fmadd_ps(ocy, ocy, _mm512_mul_ps(ocz, ocz))));
+        __m512 discriminant = _mm512_fmsub_ps(half_b, half_b, _mm512_mul_ps(a, c));
+
+        active = _mm512_mask_cmp_ps_mask(active, discriminant, _mm512_setzero_ps(), _CMP_GE_OQ);
+        if (!active)
+            continue;
+
+        __m512 sqrtd = _mm512_mask_sqrt_ps(discriminant, active, discriminant);
+        __m512 near_root = _mm512_div_ps(_mm512_sub_ps(_mm512_sub_ps(_mm512_setzero_ps(), half_b), sqrtd), a);
+        __m512 far_root = _mm512_div_ps(_mm512_sub_ps(sqrtd, half_b), a);
+
+        // Take the nearer root if it is in range, otherwise the farther one
+        __mmask16 near_ok = _mm512_mask_cmp_ps_mask(active, near_root, t_lo, _CMP_GE_OQ) &
+                            _mm512_cmp_ps_mask(near_root, best_t, _CMP_LE_OQ);
+        __mmask16 far_ok = _mm512_mask_cmp_ps_mask(active, far_root, t_lo, _CMP_GE_OQ) &
+                           _mm512_cmp_ps_mask(far_root, best_t, _CMP_LE_OQ);
+        __m512 root = _mm512_mask_blend_ps(near_ok, far_root, near_root);
+        __mmask16 hit = near_ok | far_ok;
+
+        best_t = _mm512_mask_blend_ps(hit, best_t, root);
+        best_index = _mm512_mask_blend_epi32(hit, best_index, _mm512_add_epi32(lane_ids, _mm512_set1_epi32(i)));
+    }
+
+    __mmask16 found = _mm512_cmpneq_epi32_mask(best_index, _mm512_set1_epi32(-1));
+    if (!found)
+        return false;
+
+    // Horizontal min of the lanes that found something. The masked forms
+    // give every step a real source; GCC's unmasked ones start from an
+    // uninitialized vector, which -Wall reports once this is inlined.
+    __m512 t = _mm512_mask_blend_ps(found, _mm512_set1_ps(infinity), best_t);
+    __m512 m = _mm512_mask_min_ps(t, 0xFFFF, t, _mm512_mask_shuffle_f32x4(t, 0xFFFF, t, t, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_shuffle_f32x4(m, 0xFFFF, m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_permute_ps(m, 0xFFFF, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_permute_ps(m, 0xFFFF, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    float closest = _mm512_cvtss_f32(m);
+    __mmask16 winner = found & _mm512_cmp_ps_mask(t, m, _CMP_EQ_OQ);
+    alignas(64) int32_t indices[16];
+    _mm512_store_si512(indices, best_index);
+    return fill_record(r, indices[__builtin_ctz(winner)], closest, rec);
+}
+
+#elif defined(__AVX2__)
+
+bool packed_spheres::hit_range(
+    const ray &r, int first, int n, float t_min, float t_max, hit_record &rec) const
+{
+    const __m256 ox = _mm256_set1_ps(r.orig.x());
+    const __m256 oy = _mm256_set1_ps(r.orig.y());
+    const __m256 oz = _mm256_set1_ps(r.orig.z());
+    const __m256 dx = _mm256_set1_ps(r.dir.x());
+    const __m256 dy = _mm256_set1_ps(r.dir.y());
+    const __m256 dz = _mm256_set1_ps(r.dir.z());
+    const __m256 a = _mm256_set1_ps(r.dir.length_squared());
+    const __m256 t_lo = _mm256_set1_ps(t_min);
+    const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // Per-lane closest hit so far; reduced across lanes once at the end
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256i best_index = _mm256_set1_epi32(-1);
+
+    const int end = first + n;
+    for (int i = first; i < end; i += lanes)
+    {
+        __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(end - i), lane_ids));
+
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&center_x[i]));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&center_y[i]));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&center_z[i]));
+        __m256 rad = _mm256_loadu_ps(&radius[i]);
+
+        // Same contraction as the AVX-512 path when FMA is there; packet.h
+        // mirrors whichever form is compiled
+#if defined(__FMA__)
+        __m256 half_b = _mm256_fmadd_ps(ocx, dx, _mm256_fmadd_ps(ocy, dy, _mm256_mul_ps(ocz, dz)));
+        __m256 c = _mm256_fmsub_ps(ocx, ocx, _mm256_fmsub_ps(rad, rad, _mm256_fmadd_ps(ocy, ocy, _mm256_mul_ps(ocz, ocz))));
+        __m256 discriminant = _mm256_fmsub_ps(half_b, half_b, _mm256_mul_ps(a, c));
+#else
+        __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 oc2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+        __m256 c = _mm256_sub_ps(oc2, _mm256_mul_ps(rad, rad));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(half_b, half_b), _mm256_mul_ps(a, c));
+#endif
+
+        active = _mm256_and_ps(active, _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GE_OQ));
+        if (_mm256_testz_ps(active, active))
+            continue;
+
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 near_root = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), half_b), sqrtd), a);
+        __m256 far_root = _mm256_div_ps(_mm256_sub_ps(sqrtd, half_b), a);
+
+        // Take the nearer root if it is in range, otherwise the farther one
+        __m256 near_ok = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(near_root, t_lo, _CMP_GE_OQ),
+                                                             _mm256_cmp_ps(near_root, best_t, _CMP_LE_OQ)));
+        __m256 far_ok = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(far_root, t_lo, _CMP_GE_OQ),
+                                                            _mm256_cmp_ps(far_root, best_t, _CMP_LE_OQ)));
+        __m256 root = _mm256_blendv_ps(far_root, near_root, near_ok);
+        __m256 hit = _mm256_or_ps(near_ok, far_ok);
+
+        best_t = _mm256_blendv_ps(best_t, root, hit);
+        best_index = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_index),
+            _mm256_castsi256_ps(_mm256_add_epi32(lane_ids, _mm256_set1_epi32(i))),
+            hit));
+    }
+
+    __m256 found = _mm256_castsi256_ps(_mm256_cmpgt_epi32(best_index, _mm256_set1_epi32(-1)));
+    if (_mm256_testz_ps(found, found))
+        return false;
+
+    // Horizontal min of the lanes that found something
+    __m256 t = _mm256_blendv_ps(_mm256_set1_ps(infinity), best_t, found);
+    __m256 m = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    int winner = _mm256_movemask_ps(_mm256_and_ps(found, _mm256_cmp_ps(t, m, _CMP_EQ_OQ)));
+    alignas(32) int32_t indices[8];
+    _mm256_store_si256((__m256i *)indices, best_index);
+    return fill_record(r, indices[__builtin_ctz(winner)], _mm256_cvtss_f32(m), rec);
+}
+
+#else
+
+bool packed_spheres::hit_range(
+    const ray &r, int first, int n, float t_min, float t_max, hit_record &rec) const
+{
+    auto a = r.dir.length_squared();
+    int best = -1;
+
+    for (int i = first; i < first + n; i++)
+    {
+        vec3 oc = r.orig - point3(center_x[i], center_y[i], center_z[i]);
+        auto half_b = dot(oc, r.dir);
+        auto c = oc.length_squared() - radius[i] * radius[i];
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            continue;
+        auto sqrtd = sqrt(discriminant);
+
+        auto root = (-half_b - sqrtd) / a;
+        if (root < t_min || t_max < root)
+        {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || t_max < root)
+                continue;
+        }
+        t_max = root;
+        best = i;
+    }
+
+    if (best < 0)
+        return false;
+    return fill_record(r, best, t_max, rec);
+}
+
+#endif
+
+bool packed_spheres::bounding_box(aabb &output_box) const
+{
+    if (count == 0)
+        return false;
+
+    output_box = aabb();
+    for (int i = 0; i < count; i++)
+    {
+        vec3 rad(radius[i], radius[i], radius[i]);
+        point3 center(center_x[i], center_y[i], center_z[i]);
+        output_box = surrounding_box(output_box, aabb(center - rad, center + rad));
+    }
+    return true;
+}
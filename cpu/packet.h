@@ -0,0 +1,265 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "packed_spheres.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+// N rays traced together through the BVH (N = 4, 8 or 16). Data is stored
+// per component so the per-lane loops below compile to SIMD instructions.
+// Unused lanes copy lane 0 and get t_max = -infinity, so they never hit.
+//
+// Besides the individual rays the packet keeps interval bounds on its
+// origins and reciprocal directions. When every ray has the same direction
+// sign on each axis (always the case for the samples of one camera pixel),
+// those bounds form a conservative frustum that can reject a box for the
+// whole packet with a single slab test.
+template <int N>
+struct ray_packet
+{
+    static_assert(N == 4 || N == 8 || N == 16, "ray_packet width must be 4, 8 or 16");
+    static constexpr int width = N;
+
+    alignas(64) float ox[N], oy[N], oz[N];
+    alignas(64) float dx[N], dy[N], dz[N];
+    alignas(64) float inv_dx[N], inv_dy[N], inv_dz[N];
+    alignas(64) float t_max[N];
+    int count = 0;
+
+    bool has_frustum = false;
+    float o_lo[3], o_hi[3];     // origin bounds
+    float inv_lo[3], inv_hi[3]; // reciprocal direction bounds
+
+    void add(const ray &r)
+    {
+        ox[count] = r.orig.x(), oy[count] = r.orig.y(), oz[count] = r.orig.z();
+        dx[count] = r.dir.x(), dy[count] = r.dir.y(), dz[count] = r.dir.z();
+        t_max[count] = infinity;
+        count++;
+    }
+
+    ray get_ray(int lane) const
+    {
+        return ray(point3(ox[lane], oy[lane], oz[lane]), vec3(dx[lane], dy[lane], dz[lane]));
+    }
+
+    // Call once all rays are added
+    void finalize();
+};
+
+template <int N>
+void ray_packet<N>::finalize()
+{
+    for (int k = count; k < N; k++)
+    {
+        ox[k] = ox[0], oy[k] = oy[0], oz[k] = oz[0];
+        dx[k] = dx[0], dy[k] = dy[0], dz[k] = dz[0];
+        t_max[k] = -infinity;
+    }
+    for (int k = 0; k < N; k++)
+    {
+        inv_dx[k] = 1 / dx[k];
+        inv_dy[k] = 1 / dy[k];
+        inv_dz[k] = 1 / dz[k];
+    }
+
+    const float *o[3] = {ox, oy, oz};
+    const float *inv[3] = {inv_dx, inv_dy, inv_dz};
+    has_frustum = true;
+    for (int a = 0; a < 3; a++)
+    {
+        o_lo[a] = o_hi[a] = o[a][0];
+        inv_lo[a] = inv_hi[a] = inv[a][0];
+        for (int k = 1; k < count; k++)
+        {
+            o_lo[a] = std::min(o_lo[a], o[a][k]);
+            o_hi[a] = std::max(o_hi[a], o[a][k]);
+            inv_lo[a] = std::min(inv_lo[a], inv[a][k]);
+            inv_hi[a] = std::max(inv_hi[a], inv[a][k]);
+        }
+        // Interval bounds only hold if no direction crosses zero on this axis
+        if (!(inv_lo[a] > 0 || inv_hi[a] < 0))
+            has_frustum = false;
+    }
+}
+
+// Interval-arithmetic slab test: false only if no ray in the packet can
+// reach the box before t_far.
+template <int N>
+inline bool frustum_hits_box(const ray_packet<N> &p, const aabb &box, float t_min, float t_far)
+{
+    float t_enter = t_min, t_exit = t_far;
+    for (int a = 0; a < 3; a++)
+    {
+        // (plane - origin) as an interval, times the reciprocal direction interval
+        float near_lo = box.minimum[a] - p.o_hi[a], near_hi = box.minimum[a] - p.o_lo[a];
+        float far_lo = box.maximum[a] - p.o_hi[a], far_hi = box.maximum[a] - p.o_lo[a];
+        if (p.inv_lo[a] < 0)
+        {
+            // Negative directions enter through the max plane
+            std::swap(near_lo, far_lo);
+            std::swap(near_hi, far_hi);
+        }
+
+        float entry = std::min(std::min(near_lo * p.inv_lo[a], near_lo * p.inv_hi[a]),
+                               std::min(near_hi * p.inv_lo[a], near_hi * p.inv_hi[a]));
+        float exit = std::max(std::max(far_lo * p.inv_lo[a], far_lo * p.inv_hi[a]),
+                              std::max(far_hi * p.inv_lo[a], far_hi * p.inv_hi[a]));
+        t_enter = std::max(t_enter, entry);
+        t_exit = std::min(t_exit, exit * aabb::far_scale);
+    }
+    return t_enter <= t_exit;
+}
+
+// True if any live ray in the packet hits the box. Frustum rejection first,
+// then per-lane slab tests until the first hit.
+template <int N>
+inline bool packet_hits_box(const ray_packet<N> &p, const aabb &box, float t_min, float t_far)
+{
+    if (p.has_frustum && !frustum_hits_box(p, box, t_min, t_far))
+        return false;
+
+    for (int k = 0; k < p.count; k++)
+    {
+        float t0 = t_min, t1 = p.t_max[k];
+        const float o[3] = {p.ox[k], p.oy[k], p.oz[k]};
+        const float inv[3] = {p.inv_dx[k], p.inv_dy[k], p.inv_dz[k]};
+        for (int a = 0; a < 3; a++)
+        {
+            float near = (box.minimum[a] - o[a]) * inv[a];
+            float far = (box.maximum[a] - o[a]) * inv[a];
+            if (inv[a] < 0)
+                std::swap(near, far);
+            far *= aabb::far_scale;
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+        if (t0 <= t1)
+            return true;
+    }
+    return false;
+}
+
+// One sphere against every lane, written branch-free so the loop vectorizes.
+// Rounds exactly like packed_spheres::hit_range: the same fused
+// multiply-adds in the same order when the target has FMA, plain products
+// and sums otherwise. Any other order changes the last bit of some roots,
+// and the packet kernels would no longer render the same image as kernels 0-3.
+template <int N>
+inline void packet_hit_sphere(ray_packet<N> &p, float cx, float cy, float cz, float radius,
+                              int index, float t_min, int hit_index[N])
+{
+    for (int k = 0; k < N; k++)
+    {
+        float ocx = p.ox[k] - cx, ocy = p.oy[k] - cy, ocz = p.oz[k] - cz;
+        float a = vec3(p.dx[k], p.dy[k], p.dz[k]).length_squared();
+#if defined(__FMA__)
+        float half_b = std::fma(ocx, p.dx[k], std::fma(ocy, p.dy[k], ocz * p.dz[k]));
+        float c = std::fma(ocx, ocx, -std::fma(radius, radius, -std::fma(ocy, ocy, ocz * ocz)));
+        float discriminant = std::fma(half_b, half_b, -(a * c));
+#else
+        float half_b = ocx * p.dx[k] + ocy * p.dy[k] + ocz * p.dz[k];
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+        float discriminant = half_b * half_b - a * c;
+#endif
+
+        float sqrtd = sqrt(discriminant >= 0 ? discriminant : 0.0f);
+        float near_root = ((0.0f - half_b) - sqrtd) / a;
+        float far_root = (sqrtd - half_b) / a;
+        bool near_ok = discriminant >= 0 && near_root >= t_min && near_root <= p.t_max[k];
+        bool far_ok = discriminant >= 0 && far_root >= t_min && far_root <= p.t_max[k];
+
+        p.t_max[k] = near_ok ? near_root : (far_ok ? far_root : p.t_max[k]);
+        hit_index[k] = (near_ok || far_ok) ? index : hit_index[k];
+    }
+}
+
+// Closest hit for every ray of the packet. Returns a per-lane hit flag and
+// fills recs[k] for each lane that hit. Nodes are ordered by the direction
+// sign of the first ray, which the whole packet shares when it is coherent.
+template <int N>
+void trace_packet(const bvh &accel, ray_packet<N> &p, float t_min, bool hit[N], hit_record recs[N])
+{
+    int hit_index[N];
+    for (int k = 0; k < N; k++)
+    {
+        hit[k] = false;
+        hit_index[k] = -1;
+    }
+    if (accel.node_count == 0 || p.count == 0)
+        return;
+
+    bool dir_is_neg[3] = {p.inv_dx[0] < 0, p.inv_dy[0] < 0, p.inv_dz[0] < 0};
+    const bool packed = accel.packed_leaves();
+
+    int stack[bvh_max_depth];
+    int stack_size = 0;
+    int current = 0;
+
+    while (true)
+    {
+        const bvh_node &node = accel.nodes[current];
+        float t_far = *std::max_element(p.t_max, p.t_max + p.count);
+
+        // Counted per packet for boxes and per lane for primitives
+        STAT_ADD(node_tests, 1);
+        if (packet_hits_box(p, node.bounds(), t_min, t_far))
+        {
+            if (node.prim_count > 0)
+            {
+                STAT_ADD(primitive_tests, node.prim_count * p.count);
+                for (int i = node.offset; i < node.offset + node.prim_count; i++)
+                {
+                    if (packed)
+                    {
+                        packet_hit_sphere(p, accel.packed.center_x[i], accel.packed.center_y[i],
+                                          accel.packed.center_z[i], accel.packed.radius[i], i, t_min, hit_index);
+                        continue;
+                    }
+                    for (int k = 0; k < p.count; k++)
+                    {
+                        if (accel.primitives[i]->hit(p.get_ray(k), t_min, p.t_max[k], recs[k]))
+                        {
+                            hit[k] = true;
+                            p.t_max[k] = recs[k].t;
+                        }
+                    }
+                }
+                if (stack_size == 0)
+                    break;
+                current = stack[--stack_size];
+            }
+            else if (dir_is_neg[node.axis])
+            {
+                stack[stack_size++] = current + 1;
+                current = node.offset;
+            }
+            else
+            {
+                stack[stack_size++] = node.offset;
+                current = current + 1;
+            }
+        }
+        else
+        {
+            if (stack_size == 0)
+                break;
+            current = stack[--stack_size];
+        }
+    }
+
+    if (packed)
+    {
+        for (int k = 0; k < p.count; k++)
+        {
+            if (hit_index[k] >= 0)
+                hit[k] = accel.packed.fill_record(p.get_ray(k), hit_index[k], p.t_max[k], recs[k]);
+        }
+    }
+}
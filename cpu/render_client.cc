@@ -0,0 +1,270 @@
+/*
+    Render daemon client
+
+    Sends a job to a daemon started with `main --serve ADDRESS` and waits
+    for it to finish, or cancels a job, or prints the daemon's queue and
+    latency figures. Camera options override the scene's own camera field
+    by field; a job without them renders the scene as the daemon would.
+
+    A relative --scene path is taken from the current directory, as the
+    daemon may run in another one. --output is a file name, which the
+    daemon writes into the directory it was started with --serve-output.
+
+    Build: g++ -O3 -march=native -pthread -o render_client render_client.cc
+    Usage: ./render_client unix:PATH --output NAME [--scene FILE] [--width N] [--height N] [--spp N]
+                           [--max-depth N] [--sampler independent|sobol|rank1] [--kernel N]
+                           [--format p3|p6|pfm|exr] [--priority N] [--lookfrom X,Y,Z] [--lookat X,Y,Z]
+                           [--vup X,Y,Z] [--vfov DEGREES] [--aperture F] [--focus-dist F]
+           ./render_client unix:PATH --cancel ID
+           ./render_client unix:PATH --status
+*/
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "render_service.h"
+
+#define DEFAULT_WIDTH 120
+#define ASPECT_RATIO (16.0f / 9.0f)
+
+/* "X,Y,Z" into three floats */
+bool parse_triple(const char *text, float out[3])
+{
+    return std::sscanf(text, "%f,%f,%f", &out[0], &out[1], &out[2]) == 3;
+}
+
+/* `path` as seen from the current directory */
+string absolute_path(const string &path)
+{
+    if (path.empty() || path[0] == '/')
+        return path;
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return path;
+    return string(cwd) + "/" + path;
+}
+
+/* Reads one reply, with its payload */
+bool receive(int fd, service_message &message, string &payload)
+{
+    if (!farm_detail::recv_all(fd, &message, sizeof(message)))
+        return false;
+    payload.resize(message.payload_size);
+    return message.payload_size == 0 || farm_detail::recv_all(fd, &payload[0], message.payload_size);
+}
+
+int usage(const char *program)
+{
+    cerr << "Usage: " << program << " unix:PATH --output NAME [--scene FILE] [--width N] [--height N] [--spp N]"
+         << " [--max-depth N] [--sampler independent|sobol|rank1] [--kernel N] [--format p3|p6|pfm|exr]"
+         << " [--priority N] [--lookfrom X,Y,Z] [--lookat X,Y,Z] [--vup X,Y,Z] [--vfov DEGREES]"
+         << " [--aperture F] [--focus-dist F]" << endl;
+    cerr << "       " << program << " unix:PATH --cancel ID" << endl;
+    cerr << "       " << program << " unix:PATH --status" << endl;
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        return usage(argv[0]);
+    string address = argv[1];
+
+    service_job job;
+    std::memset(&job, 0, sizeof(job));
+    job.version = service_version;
+    job.width = DEFAULT_WIDTH;
+    job.samples_per_pixel = 20;
+    job.max_depth = 50;
+    job.kernel = -1;
+    job.format = (uint32_t)image_format::p6;
+    int height = 0;
+    string scene, output;
+    long long cancel_id = -1;
+    bool status = false;
+
+    for (int a = 2; a < argc; a++)
+    {
+        string arg = argv[a];
+        bool more = a + 1 < argc;
+        image_format format;
+        sample_pattern pattern;
+        if (arg == "--output" && more)
+            output = argv[++a];
+        else if (arg == "--scene" && more)
+            scene = argv[++a];
+        else if (arg == "--width" && more)
+            job.width = std::max(1, atoi(argv[++a]));
+        else if (arg == "--height" && more)
+            height = std::max(1, atoi(argv[++a]));
+        else if (arg == "--spp" && more)
+            job.samples_per_pixel = std::max(1, atoi(argv[++a]));
+        else if (arg == "--max-depth" && more)
+            job.max_depth = std::max(1, atoi(argv[++a]));
+        else if (arg == "--sampler" && more && parse_sample_pattern(argv[a + 1], pattern))
+        {
+            job.pattern = (uint32_t)pattern;
+            a++;
+        }
+        else if (arg == "--kernel" && more)
+            job.kernel = atoi(argv[++a]);
+        else if (arg == "--format" && more && parse_image_format(argv[a + 1], format))
+        {
+            job.format = (uint32_t)format;
+            a++;
+        }
+        else if (arg == "--priority" && more)
+            job.priority = atoi(argv[++a]);
+        else if (arg == "--lookfrom" && more && parse_triple(argv[a + 1], job.camera.lookfrom))
+        {
+            job.camera_fields |= camera_lookfrom;
+            a++;
+        }
+        else if (arg == "--lookat" && more && parse_triple(argv[a + 1], job.camera.lookat))
+        {
+            job.camera_fields |= camera_lookat;
+            a++;
+        }
+        else if (arg == "--vup" && more && parse_triple(argv[a + 1], job.camera.vup))
+        {
+            job.camera_fields |= camera_vup;
+            a++;
+        }
+        else if (arg == "--vfov" && more)
+        {
+            job.camera.vfov = atof(argv[++a]);
+            job.camera_fields |= camera_vfov;
+        }
+        else if (arg == "--aperture" && more)
+        {
+            job.camera.aperture = atof(argv[++a]);
+            job.camera_fields |= camera_aperture;
+        }
+        else if (arg == "--focus-dist" && more)
+        {
+            job.camera.focus_dist = atof(argv[++a]);
+            job.camera_fields |= camera_focus_dist;
+        }
+        else if (arg == "--cancel" && more)
+            cancel_id = atoll(argv[++a]);
+        else if (arg == "--status")
+            status = true;
+        else
+            return usage(argv[0]);
+    }
+    if (cancel_id < 0 && !status && (output.empty() || output == "-"))
+    {
+        cerr << "A job needs an --output file; the daemon cannot write to this terminal" << endl;
+        return 2;
+    }
+    if (cancel_id < 0 && !status && output.find('/') != string::npos)
+    {
+        cerr << "--output is a file name in the daemon's output directory, without a directory" << endl;
+        return 2;
+    }
+    /* Without a height the frame is 16:9 as in main.cc, rounded to whole rows */
+    job.height = height > 0 ? height : std::max(1, (int)(job.width / ASPECT_RATIO));
+    job.aspect_ratio = height > 0 ? 0 : ASPECT_RATIO;
+    scene = absolute_path(scene);
+    if (scene.size() >= sizeof(job.scene) || output.size() >= sizeof(job.output))
+    {
+        cerr << "Path too long" << endl;
+        return 2;
+    }
+    std::memcpy(job.scene, scene.c_str(), scene.size() + 1);
+    std::memcpy(job.output, output.c_str(), output.size() + 1);
+
+    string error;
+    int fd = farm_connect(address, 0, error);
+    if (fd < 0)
+    {
+        cerr << error << endl;
+        return 1;
+    }
+
+    service_message reply;
+    string payload;
+    if (status)
+    {
+        service_report r;
+        if (!service_detail::send_message(fd, service_status, 0) || !receive(fd, reply, payload) ||
+            reply.type != service_stats || payload.size() != sizeof(r))
+        {
+            cerr << "No status from " << address << endl;
+            return 1;
+        }
+        std::memcpy(&r, payload.data(), sizeof(r));
+        cout << "queued:\t\t" << r.queued << endl;
+        cout << "running:\t" << (r.running ? "job " + std::to_string(r.running) : string("none")) << endl;
+        cout << "completed:\t" << r.completed << ", " << r.cancelled << " cancelled, " << r.failed << " failed"
+             << endl;
+        cout << "scenes:\t\t" << r.scenes << " resident" << endl;
+        cout << "queue latency:\tmean " << r.queue_mean * 1000 << " ms, p50 " << r.queue_p50 * 1000 << " ms, p95 "
+             << r.queue_p95 * 1000 << " ms, max " << r.queue_max * 1000 << " ms" << endl;
+        cout << "render time:\tmean " << r.render_mean * 1000 << " ms" << endl;
+        return 0;
+    }
+
+    if (cancel_id >= 0)
+    {
+        if (!service_detail::send_message(fd, service_cancel, (uint64_t)cancel_id) || !receive(fd, reply, payload))
+        {
+            cerr << "Lost " << address << endl;
+            return 1;
+        }
+        if (reply.type != service_cancelled)
+        {
+            cerr << "Could not cancel job " << cancel_id << ": " << payload << endl;
+            return 1;
+        }
+        cerr << "Cancelled job " << cancel_id << endl;
+        return 0;
+    }
+
+    /* Hanging up cancels the job, so this waits for it to the end */
+    if (!service_detail::send_message(fd, service_submit, 0, &job, sizeof(job)) || !receive(fd, reply, payload))
+    {
+        cerr << "Lost " << address << endl;
+        return 1;
+    }
+    if (reply.type != service_accepted)
+    {
+        cerr << "Job refused: " << payload << endl;
+        return 1;
+    }
+    uint64_t id = reply.job;
+    cerr << "Job " << id << " queued" << endl;
+
+    if (!receive(fd, reply, payload))
+    {
+        cerr << "Lost " << address << " while job " << id << " was pending" << endl;
+        return 1;
+    }
+    if (reply.type == service_cancelled)
+    {
+        cerr << "Job " << id << " was cancelled" << endl;
+        return 1;
+    }
+    if (reply.type != service_done || payload.size() != sizeof(service_timing))
+    {
+        cerr << "Job " << id << " failed: " << payload << endl;
+        return 1;
+    }
+    service_timing timing;
+    std::memcpy(&timing, payload.data(), sizeof(timing));
+    cerr << "Job " << id << " done: queued " << timing.queue_seconds * 1000 << " ms, loaded "
+         << timing.load_seconds * 1000 << " ms, rendered " << timing.render_seconds * 1000 << " ms, written "
+         << timing.write_seconds * 1000 << " ms -> " << output << endl;
+    return 0;
+}
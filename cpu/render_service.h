@@ -0,0 +1,670 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "image.h"
+#include "image_stream.h"
+#include "integrator.h"
+#include "kernels.h"
+#include "material.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "scheduler.h"
+#include "tile_farm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A long-running render daemon. It keeps its scenes, their BVHs and one
+// thread pool resident, and renders the jobs clients send it over a socket
+// one at a time: a camera, a resolution, a sample count and an output file.
+// A job renders against the daemon's own scene or against a scene file from
+// scene_convert, which is verified, mapped and built on first use and then
+// kept for later jobs. Outputs are file names in the daemon's output
+// directory; a job cannot name a file anywhere else.
+//
+// Queued jobs start highest priority first, and in the order they came at
+// equal priority; a running job is never preempted. A job can be cancelled
+// by its id from any connection, and is cancelled when the client that
+// submitted it hangs up. A cancelled job that is already running stops at
+// its next tile and leaves no output file.
+//
+// Clients are not authenticated, so the daemon only listens on a Unix
+// socket ("unix:PATH", as for the tile farm) that only its own user can
+// connect to. Messages are raw structs in native byte order, so clients
+// must come from the same build.
+
+const uint32_t service_version = 2;
+
+enum service_message_type : uint32_t
+{
+    service_submit = 1,    // client -> daemon, payload service_job
+    service_cancel = 2,    // client -> daemon, for job `job`
+    service_status = 3,    // client -> daemon
+    service_accepted = 4,  // daemon -> submitter, the job's id in `job`
+    service_done = 5,      // daemon -> submitter, payload service_timing
+    service_failed = 6,    // daemon -> client, payload the reason
+    service_cancelled = 7, // daemon -> submitter, and to the client that cancelled it
+    service_stats = 8,     // daemon -> client, payload service_report
+};
+
+struct service_message
+{
+    uint32_t type;
+    uint32_t payload_size;
+    uint64_t job;
+};
+
+// Camera fields a job sets; the others are its scene's
+enum service_camera_field : uint32_t
+{
+    camera_lookfrom = 1,
+    camera_lookat = 2,
+    camera_vup = 4,
+    camera_vfov = 8,
+    camera_aperture = 16,
+    camera_focus_dist = 32,
+};
+
+struct service_job
+{
+    uint32_t version;
+    int32_t priority; // higher starts first
+    uint32_t width, height;
+    float aspect_ratio; // of the camera, or 0 for width / height
+    uint32_t samples_per_pixel;
+    uint32_t max_depth;
+    uint32_t pattern;  // sample_pattern
+    int32_t kernel;    // index into sample_kernels, or -1 for the daemon's
+    uint32_t format;   // image_format
+    uint32_t camera_fields;
+    scene_camera_record camera;
+    char scene[1024];  // scene file, or empty for the daemon's own scene
+    char output[1024]; // file name of the image, in the daemon's output directory
+};
+
+// Where a finished job's time went
+struct service_timing
+{
+    double queue_seconds;  // from being accepted to starting
+    double load_seconds;   // mapping a scene file on its first use
+    double render_seconds;
+    double write_seconds;  // after the last tile
+};
+
+// The daemon's queue and totals since it started. Queue latency is from a
+// job being accepted to it starting, over every job that started.
+struct service_report
+{
+    uint32_t queued;
+    uint32_t scenes;  // resident, counting the daemon's own
+    uint64_t running; // id of the running job, or 0
+    uint64_t completed, cancelled, failed;
+    double queue_mean, queue_p50, queue_p95, queue_max;
+    double render_mean;
+};
+
+namespace service_detail
+{
+    // A scene kept resident: the daemon's own, borrowed, or a mapped scene file
+    struct resident_scene
+    {
+        std::unique_ptr<scene_file> file;
+        material_table owned_materials;
+        std::unique_ptr<bvh> owned_accel;
+
+        const bvh *accel;
+        const material_table *materials;
+        scene_camera_record view;
+    };
+
+    struct job
+    {
+        uint64_t id;
+        service_job spec;
+        int client; // fd of the submitter, or -1 once it has hung up
+        std::chrono::steady_clock::time_point accepted;
+        std::atomic<bool> cancelled{false};
+    };
+
+    // A job the render thread is done with, for the serving thread to report
+    struct outcome
+    {
+        std::shared_ptr<job> of;
+        uint32_t type; // service_done, service_failed or service_cancelled
+        service_timing timing;
+        std::string error;
+    };
+
+    struct client
+    {
+        int fd;
+        std::vector<char> input;
+    };
+
+    inline bool send_message(int fd, uint32_t type, uint64_t id, const void *payload = nullptr, uint32_t size = 0)
+    {
+        service_message message = {type, size, id};
+        return farm_detail::send_all(fd, &message, sizeof(message)) &&
+               (size == 0 || farm_detail::send_all(fd, payload, size));
+    }
+
+    inline bool send_error(int fd, uint64_t id, const std::string &error)
+    {
+        return send_message(fd, service_failed, id, error.c_str(), (uint32_t)error.size());
+    }
+
+    inline double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+            return 0;
+        size_t k = std::min(values.size() - 1, (size_t)(p * values.size()));
+        std::nth_element(values.begin(), values.begin() + k, values.end());
+        return values[k];
+    }
+
+    // Why `spec` cannot be rendered, or empty if it can
+    inline std::string check_job(const service_job &spec)
+    {
+        if (spec.version != service_version)
+            return "the daemon is from a different build";
+        if (spec.width < 1 || spec.height < 1 || spec.width > 16384 || spec.height > 16384)
+            return "resolution must be from 1x1 to 16384x16384";
+        if (spec.samples_per_pixel < 1 || spec.max_depth < 1)
+            return "samples per pixel and max depth must be at least 1";
+        if (spec.kernel >= num_sample_kernels || spec.kernel < -1)
+            return "no such kernel";
+        if (spec.format > (uint32_t)image_format::exr || spec.pattern > (uint32_t)sample_pattern::rank1)
+            return "unknown image format or sampler";
+        if (!std::memchr(spec.scene, 0, sizeof(spec.scene)) || !std::memchr(spec.output, 0, sizeof(spec.output)))
+            return "path too long";
+        if (!spec.output[0] || std::strchr(spec.output, '/') || !std::strcmp(spec.output, ".") ||
+            !std::strcmp(spec.output, ".."))
+            return "the output must be a file name, without a directory";
+        return "";
+    }
+}
+
+class render_service
+{
+public:
+    // Serves `accel` and `materials` as its own scene, seen through `view`,
+    // rendering with sample_kernels[kernel] unless a job names another.
+    // Renders on `scheduler`'s pool, in tiles of `tile_size`.
+    // Jobs write their images into `output_dir`.
+    render_service(const bvh &accel, const material_table &materials, const scene_camera_record &view, int kernel,
+                   tile_scheduler &scheduler, int tile_size, const std::string &output_dir);
+
+    // Accepts clients on `listen_fd` and renders their jobs until `stop`
+    // is set. A job still running then is cancelled.
+    void serve(int listen_fd, const std::atomic<bool> &stop);
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    void render_loop();
+    service_detail::outcome render(const std::shared_ptr<service_detail::job> &j);
+    service_detail::resident_scene *find_scene(const std::string &path, double &load_seconds, std::string &error);
+
+    void handle(service_detail::client &from, const service_message &message, const char *payload);
+    void cancel(uint64_t id, int canceller);
+    void hang_up(int fd);
+    void report(int fd);
+    void deliver(const service_detail::outcome &o);
+
+    int default_kernel;
+    tile_scheduler &scheduler;
+    int tile_size;
+    std::string output_dir;
+
+    // Only the render thread touches these
+    std::map<std::string, std::unique_ptr<service_detail::resident_scene>> scenes;
+    std::vector<color> pixels;
+
+    // Shared between the two threads under `lock`
+    std::mutex lock;
+    std::condition_variable wake_renderer;
+    std::vector<std::shared_ptr<service_detail::job>> queue;
+    std::shared_ptr<service_detail::job> running;
+    std::vector<service_detail::outcome> outcomes;
+    std::vector<double> queue_latencies, render_times;
+    uint64_t completed = 0, cancelled = 0, failed = 0;
+    size_t resident = 0;
+    bool stopping = false;
+
+    int wake_pipe[2] = {-1, -1}; // the render thread writes a byte per outcome
+    uint64_t next_id = 1;
+};
+
+render_service::render_service(const bvh &accel, const material_table &materials, const scene_camera_record &view,
+                               int kernel, tile_scheduler &scheduler, int tile_size, const std::string &output_dir)
+    : default_kernel(kernel), scheduler(scheduler), tile_size(tile_size), output_dir(output_dir)
+{
+    std::unique_ptr<service_detail::resident_scene> own(new service_detail::resident_scene());
+    own->accel = &accel;
+    own->materials = &materials;
+    own->view = view;
+    scenes[""] = std::move(own);
+    resident = 1;
+}
+
+service_detail::resident_scene *render_service::find_scene(const std::string &path, double &load_seconds,
+                                                           std::string &error)
+{
+    using namespace service_detail;
+    load_seconds = 0;
+    auto found = scenes.find(path);
+    if (found != scenes.end())
+        return found->second.get();
+
+    auto start = clock::now();
+    std::unique_ptr<resident_scene> scene(new resident_scene());
+    scene->file.reset(new scene_file());
+    // Clients name any file they like, so its contents are checked too
+    if (!scene->file->open(path, error))
+        return nullptr;
+    if (!scene->file->verify(error))
+    {
+        error = path + ": " + error;
+        return nullptr;
+    }
+    scene->owned_materials = scene->file->materials();
+    scene->owned_accel = scene->file->make_bvh();
+    scene->accel = scene->owned_accel.get();
+    scene->materials = &scene->owned_materials;
+    scene->view = scene->file->has_camera() ? scene->file->header().camera : scene_camera_settings();
+    load_seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    resident_scene *kept = scene.get();
+    scenes[path] = std::move(scene);
+    std::lock_guard<std::mutex> guard(lock);
+    resident = scenes.size();
+    return kept;
+}
+
+service_detail::outcome render_service::render(const std::shared_ptr<service_detail::job> &j)
+{
+    using namespace service_detail;
+    const service_job &spec = j->spec;
+    outcome result = {j, service_failed, {}, ""};
+
+    resident_scene *scene = find_scene(spec.scene, result.timing.load_seconds, result.error);
+    if (!scene)
+        return result;
+
+    scene_camera_record view = scene->view;
+    if (spec.camera_fields & camera_lookfrom)
+        std::memcpy(view.lookfrom, spec.camera.lookfrom, sizeof(view.lookfrom));
+    if (spec.camera_fields & camera_lookat)
+        std::memcpy(view.lookat, spec.camera.lookat, sizeof(view.lookat));
+    if (spec.camera_fields & camera_vup)
+        std::memcpy(view.vup, spec.camera.vup, sizeof(view.vup));
+    if (spec.camera_fields & camera_vfov)
+        view.vfov = spec.camera.vfov;
+    if (spec.camera_fields & camera_aperture)
+        view.aperture = spec.camera.aperture;
+    if (spec.camera_fields & camera_focus_dist)
+        view.focus_dist = spec.camera.focus_dist;
+
+    int width = (int)spec.width, height = (int)spec.height;
+    camera cam = make_camera(view, spec.aspect_ratio > 0 ? spec.aspect_ratio : (float)width / (float)height);
+    pixels.assign((size_t)width * height, color());
+    render_context ctx{cam, *scene->accel, *scene->materials, pixels.data(), width, height,
+                       (int)spec.samples_per_pixel, (int)spec.max_depth, (sample_pattern)spec.pattern};
+    image_format format = (image_format)spec.format;
+    ray_function func = sample_kernels[spec.kernel < 0 ? default_kernel : spec.kernel].func;
+    scheduler.set_image(width, height, tile_size);
+
+    const std::string output = output_dir + "/" + spec.output;
+    image_stream stream;
+    std::string error;
+    bool streaming = image_stream::can_stream(output, format) &&
+                     stream.open(output, format, pixels.data(), width, height, ctx.samples_per_pixel,
+                                 scheduler.tiles.size(), error);
+
+    // Tiles dealt out after a cancel are skipped, so the pool drains at once
+    auto start = clock::now();
+    scheduler.run([&](const tile &t, int)
+                  {
+                      if (j->cancelled.load(std::memory_order_relaxed))
+                          return;
+                      for (int y = t.y0; y < t.y1; ++y)
+                          for (int x = t.x0; x < t.x1; ++x)
+                              func(ctx, x, y);
+                      flush_path_counters();
+                      if (streaming)
+                          stream.push(t);
+                  });
+    auto rendered = clock::now();
+    result.timing.render_seconds = std::chrono::duration<double>(rendered - start).count();
+
+    if (j->cancelled)
+    {
+        if (streaming)
+        {
+            stream.close();
+            unlink(output.c_str());
+        }
+        result.type = service_cancelled;
+        return result;
+    }
+
+    bool written = streaming ? stream.close()
+                             : write_image(output, format, pixels.data(), width, height, ctx.samples_per_pixel);
+    result.timing.write_seconds = std::chrono::duration<double>(clock::now() - rendered).count();
+    if (!written)
+    {
+        result.error = "could not write " + output;
+        return result;
+    }
+    result.type = service_done;
+    return result;
+}
+
+void render_service::render_loop()
+{
+    using namespace service_detail;
+    while (true)
+    {
+        std::shared_ptr<job> next;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake_renderer.wait(guard, [&]
+                               { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            // Highest priority, then first accepted; queues are short
+            auto best = queue.begin();
+            for (auto it = queue.begin(); it != queue.end(); ++it)
+                if ((*it)->spec.priority > (*best)->spec.priority)
+                    best = it;
+            next = *best;
+            queue.erase(best);
+            running = next;
+        }
+
+        double queued = std::chrono::duration<double>(clock::now() - next->accepted).count();
+        outcome result = render(next);
+        result.timing.queue_seconds = queued;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running.reset();
+            queue_latencies.push_back(queued);
+            if (result.type == service_done)
+            {
+                completed++;
+                render_times.push_back(result.timing.render_seconds);
+            }
+            else if (result.type == service_cancelled)
+                cancelled++;
+            else
+                failed++;
+            outcomes.push_back(result);
+        }
+        char byte = 0;
+        if (write(wake_pipe[1], &byte, 1) < 0)
+        {
+            // The serving thread also polls on a timeout, so it still finds the outcome
+        }
+    }
+}
+
+void render_service::deliver(const service_detail::outcome &o)
+{
+    using namespace service_detail;
+    const service_job &spec = o.of->spec;
+    std::cerr << "job " << o.of->id << " (priority " << spec.priority << "): " << spec.width << "x" << spec.height
+              << ", " << spec.samples_per_pixel << " spp, ";
+    if (o.type == service_done)
+        std::cerr << "queued " << o.timing.queue_seconds * 1000 << " ms, loaded " << o.timing.load_seconds * 1000
+                  << " ms, rendered " << o.timing.render_seconds * 1000 << " ms, written "
+                  << o.timing.write_seconds * 1000 << " ms -> " << spec.output << std::endl;
+    else if (o.type == service_cancelled)
+        std::cerr << "cancelled after " << o.timing.render_seconds * 1000 << " ms" << std::endl;
+    else
+        std::cerr << o.error << std::endl;
+
+    if (o.of->client < 0)
+        return;
+    if (o.type == service_done)
+        send_message(o.of->client, service_done, o.of->id, &o.timing, sizeof(o.timing));
+    else if (o.type == service_cancelled)
+        send_message(o.of->client, service_cancelled, o.of->id);
+    else
+        send_error(o.of->client, o.of->id, o.error);
+}
+
+void render_service::cancel(uint64_t id, int canceller)
+{
+    using namespace service_detail;
+    std::shared_ptr<job> queued;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (running && running->id == id)
+        {
+            // The render thread reports it once the pool has drained
+            running->cancelled = true;
+            send_message(canceller, service_cancelled, id);
+            return;
+        }
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            if ((*it)->id == id)
+            {
+                queued = *it;
+                queue.erase(it);
+                cancelled++;
+                break;
+            }
+        }
+    }
+    if (!queued)
+    {
+        send_error(canceller, id, "no such job in the queue or running");
+        return;
+    }
+    std::cerr << "job " << id << " cancelled while queued" << std::endl;
+    if (queued->client >= 0 && queued->client != canceller)
+        send_message(queued->client, service_cancelled, id);
+    send_message(canceller, service_cancelled, id);
+}
+
+void render_service::hang_up(int fd)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = queue.begin(); it != queue.end();)
+    {
+        if ((*it)->client == fd)
+        {
+            std::cerr << "job " << (*it)->id << " cancelled, its client hung up" << std::endl;
+            it = queue.erase(it);
+            cancelled++;
+        }
+        else
+            ++it;
+    }
+    if (running && running->client == fd)
+    {
+        running->client = -1;
+        running->cancelled = true;
+    }
+    // Outcomes not yet delivered must not go to a later connection on the same fd
+    for (auto &o : outcomes)
+        if (o.of->client == fd)
+            o.of->client = -1;
+}
+
+void render_service::report(int fd)
+{
+    using namespace service_detail;
+    service_report r = {};
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        r.queued = (uint32_t)queue.size();
+        r.scenes = (uint32_t)resident;
+        r.running = running ? running->id : 0;
+        r.completed = completed;
+        r.cancelled = cancelled;
+        r.failed = failed;
+        for (double q : queue_latencies)
+        {
+            r.queue_mean += q / queue_latencies.size();
+            r.queue_max = std::max(r.queue_max, q);
+        }
+        r.queue_p50 = percentile(queue_latencies, 0.5);
+        r.queue_p95 = percentile(queue_latencies, 0.95);
+        for (double t : render_times)
+            r.render_mean += t / render_times.size();
+    }
+    send_message(fd, service_stats, 0, &r, sizeof(r));
+}
+
+void render_service::handle(service_detail::client &from, const service_message &message, const char *payload)
+{
+    using namespace service_detail;
+    if (message.type == service_submit)
+    {
+        if (message.payload_size != sizeof(service_job))
+        {
+            send_error(from.fd, 0, "malformed job");
+            return;
+        }
+        std::shared_ptr<job> j = std::make_shared<job>();
+        std::memcpy(&j->spec, payload, sizeof(service_job));
+        std::string error = check_job(j->spec);
+        if (!error.empty())
+        {
+            send_error(from.fd, 0, error);
+            return;
+        }
+        j->id = next_id++;
+        j->client = from.fd;
+        j->accepted = clock::now();
+        send_message(from.fd, service_accepted, j->id);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(j);
+        }
+        wake_renderer.notify_one();
+    }
+    else if (message.type == service_cancel)
+        cancel(message.job, from.fd);
+    else if (message.type == service_status)
+        report(from.fd);
+    else
+        send_error(from.fd, message.job, "unknown request");
+}
+
+void render_service::serve(int listen_fd, const std::atomic<bool> &stop)
+{
+    using namespace service_detail;
+    if (pipe(wake_pipe) != 0)
+        return;
+    std::thread renderer([this]
+                         { render_loop(); });
+    std::vector<client> clients;
+
+    while (!stop)
+    {
+        std::vector<outcome> finished;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            finished.swap(outcomes);
+        }
+        for (const outcome &o : finished)
+            deliver(o);
+
+        std::vector<pollfd> fds(2 + clients.size());
+        fds[0] = {listen_fd, POLLIN, 0};
+        fds[1] = {wake_pipe[0], POLLIN, 0};
+        for (size_t c = 0; c < clients.size(); c++)
+            fds[2 + c] = {clients[c].fd, POLLIN, 0};
+        if (poll(fds.data(), fds.size(), 250) <= 0)
+            continue;
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            if (read(wake_pipe[0], drain, sizeof(drain)) < 0)
+                continue;
+        }
+
+        // Walked backwards so dropping a client does not shift the ones still to visit
+        for (size_t c = clients.size(); c-- > 0;)
+        {
+            if (!(fds[2 + c].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            client &from = clients[c];
+            char buffer[1 << 12];
+            ssize_t got = recv(from.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (got <= 0)
+            {
+                hang_up(from.fd);
+                close(from.fd);
+                clients.erase(clients.begin() + c);
+                continue;
+            }
+            from.input.insert(from.input.end(), buffer, buffer + got);
+
+            bool bad = false;
+            while (!bad && from.input.size() >= sizeof(service_message))
+            {
+                service_message message;
+                std::memcpy(&message, from.input.data(), sizeof(message));
+                size_t total = sizeof(message) + message.payload_size;
+                bad = message.payload_size > sizeof(service_job); // no request is larger
+                if (bad || from.input.size() < total)
+                    break;
+                handle(from, message, from.input.data() + sizeof(message));
+                from.input.erase(from.input.begin(), from.input.begin() + total);
+            }
+            if (bad)
+            {
+                hang_up(from.fd);
+                close(from.fd);
+                clients.erase(clients.begin() + c);
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0)
+                clients.push_back(client{fd, {}});
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        if (running)
+            running->cancelled = true;
+    }
+    wake_renderer.notify_one();
+    renderer.join();
+    for (client &c : clients)
+        close(c.fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
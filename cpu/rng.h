@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sampler.h"
+
+// Counter-based random number generator (Philox4x32-10).
+//
+// Every stream is keyed by (pixel, sample) and every draw encrypts a counter
+// made of (draw index, bounce) under that key. A value therefore depends only
+// on where it is used in the image, never on which thread draws it or in what
+// order, so renders are bit-identical for any thread count or schedule and no
+// state is shared between threads.
+//
+// With a low-discrepancy sample_pattern the draws come from that pattern
+// instead: the sample index picks the point and (pixel, bounce, draw) pick
+// the scramble, so the same properties hold. See sampler.h.
+class rng
+{
+public:
+    rng() : rng(0, 0) {}
+    rng(uint32_t pixel, uint32_t sample, uint32_t bounce = 0,
+        sample_pattern pattern = sample_pattern::independent)
+        : key{pixel, sample}, draw(0), bounce(bounce), available(0), pattern(pattern) {}
+
+    // Each bounce gets its own counter range, so the draws made at bounce n
+    // do not shift when an earlier bounce uses more or fewer numbers.
+    void set_bounce(uint32_t b)
+    {
+        bounce = b;
+        draw = 0;
+        available = 0;
+    }
+
+    uint32_t next_uint()
+    {
+        if (available == 0)
+            refill();
+        return block[--available];
+    }
+
+    // Returns a random real in [0,1).
+    float next_float()
+    {
+        return (next_uint() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Returns a random real in [min,max).
+    float next_float(float min, float max)
+    {
+        return min + (max - min) * next_float();
+    }
+
+private:
+    // Next block of draws for the current bounce
+    void refill()
+    {
+        switch (pattern)
+        {
+        case sample_pattern::sobol:
+            sobol_pair(key[1], hash_combine(hash_combine(hash_uint(key[0]), bounce), draw), block);
+            available = 2;
+            break;
+        case sample_pattern::rank1:
+        {
+            uint32_t seed = hash_combine(hash_uint(bounce), draw);
+            uint32_t offset[2] = {key[0] * 2654435769u + hash_combine(seed, 0),
+                                  key[0] * 2654435769u + hash_combine(seed, 1)};
+            rank1_pair(owen_scramble(key[1], hash_combine(hash_combine(hash_uint(key[0]), bounce), draw)), offset, block);
+            available = 2;
+            break;
+        }
+        default:
+            philox(draw, bounce);
+            available = 4;
+        }
+        draw++;
+    }
+
+    static inline uint32_t mulhilo(uint32_t a, uint32_t b, uint32_t &hi)
+    {
+        uint64_t product = (uint64_t)a * b;
+        hi = (uint32_t)(product >> 32);
+        return (uint32_t)product;
+    }
+
+    void philox(uint32_t c0, uint32_t c1)
+    {
+        uint32_t c[4] = {c0, c1, 0, 0};
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; round++)
+        {
+            uint32_t hi0, hi1;
+            uint32_t lo0 = mulhilo(0xD2511F53u, c[0], hi0);
+            uint32_t lo1 = mulhilo(0xCD9E8D57u, c[2], hi1);
+            c[0] = hi1 ^ c[1] ^ k0;
+            c[1] = lo1;
+            c[2] = hi0 ^ c[3] ^ k1;
+            c[3] = lo0;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        for (int i = 0; i < 4; i++)
+            block[i] = c[i];
+    }
+
+    uint32_t key[2];
+    uint32_t draw;
+    uint32_t bounce;
+    uint32_t available;
+    uint32_t block[4];
+    sample_pattern pattern;
+};
@@ -5,6 +5,8 @@
 #include <memory>
 #include <cstdlib>
 
+#include "rng.h"
+
 // Usings
 
 using std::make_shared;
@@ -16,6 +18,14 @@ using std::sqrt;
 const float infinity = std::numeric_limits<float>::infinity();
 const float pi = 3.1415926535897932385;
 
+// Bound on the relative rounding error of n chained float operations
+// (gamma_n in PBRT)
+constexpr float rounding_gamma(int n)
+{
+    return n * (std::numeric_limits<float>::epsilon() * 0.5f) /
+           (1 - n * (std::numeric_limits<float>::epsilon() * 0.5f));
+}
+
 // Utility Functions
 
 inline float degrees_to_radians(float degrees)
@@ -23,10 +33,25 @@ inline float degrees_to_radians(float degrees)
     return degrees * pi / 180.0;
 }
 
+// This thread's stream for building scenes; render code draws from the
+// per-sample rng instead.
+inline rng &scene_rng()
+{
+    thread_local rng stream(0xFFFFFFFFu, 0xFFFFFFFFu);
+    return stream;
+}
+
+// Restarts this thread's scene stream. The scene functions call it first,
+// so a scene built twice in one process comes out the same both times.
+inline void reset_scene_rng()
+{
+    scene_rng() = rng(0xFFFFFFFFu, 0xFFFFFFFFu);
+}
+
 inline float random_float()
 {
-    // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1) from this thread's scene stream.
+    return scene_rng().next_float();
 }
 
 inline float random_float(float min, float max)
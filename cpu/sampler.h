@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Sample patterns an rng can draw from. Each one is deterministic in
+// (pixel, sample, bounce, draw), like the Philox stream.
+//
+//   independent - Philox4x32-10 uniform random numbers
+//   sobol       - Owen-scrambled Sobol (0,2)-sequence, padded: draws are
+//                 taken in pairs and every pair of a bounce gets its own
+//                 scramble and shuffled sample order, so any number of
+//                 dimensions stays decorrelated
+//   rank1       - R2 Kronecker (rank-1 lattice) sequence, rotated per pixel
+//                 by the golden-ratio sequence so neighbouring pixels get
+//                 well-spread offsets, padded the same way as sobol
+//
+// Padding shuffles the sample index with owen_scramble, which maps every
+// aligned block of 2^k indices onto another one: the first 2^k samples of
+// a pixel still form a whole block of the sequence in each dimension pair,
+// but in a different order per pair, so pairs do not depend on each other.
+//
+// The low-discrepancy patterns stratify the first samples of every pixel,
+// so noise falls faster than the Monte Carlo 1/sqrt(n) as spp grows.
+enum class sample_pattern
+{
+    independent,
+    sobol,
+    rank1
+};
+
+inline const char *sample_pattern_name(sample_pattern pattern)
+{
+    switch (pattern)
+    {
+    case sample_pattern::sobol:
+        return "sobol";
+    case sample_pattern::rank1:
+        return "rank1";
+    default:
+        return "independent";
+    }
+}
+
+inline bool parse_sample_pattern(const std::string &name, sample_pattern &pattern)
+{
+    if (name == "independent" || name == "random")
+        pattern = sample_pattern::independent;
+    else if (name == "sobol")
+        pattern = sample_pattern::sobol;
+    else if (name == "rank1" || name == "r2")
+        pattern = sample_pattern::rank1;
+    else
+        return false;
+    return true;
+}
+
+// 32-bit integer hash (Wellons' lowbias32)
+inline uint32_t hash_uint(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return hash_uint(seed ^ (v + 0x9E3779B9u + (seed << 6) + (seed >> 2)));
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+    x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+    return x;
+}
+
+// Owen scrambling of a 32-bit fixed point value in [0,1), after Burley,
+// "Practical Hash-based Owen Scrambling" (JCGT 2020). The Laine-Karras
+// permutation only lets higher bits depend on lower ones, so running it on
+// the reversed value flips each bit based on the bits above it.
+inline uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6C50B47Cu;
+    x ^= x * 0xB82F1E52u;
+    x ^= x * 0xC7AFE638u;
+    x ^= x * 0x8D22F6E6u;
+    return reverse_bits(x);
+}
+
+// First two dimensions of the Sobol sequence as 32-bit fixed point
+inline uint32_t sobol_dim0(uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+inline uint32_t sobol_dim1(uint32_t index)
+{
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// Point `index` of the scrambled 2D Sobol sequence for one dimension pair,
+// with the index shuffled first
+inline void sobol_pair(uint32_t index, uint32_t seed, uint32_t out[2])
+{
+    index = owen_scramble(index, hash_combine(seed, 0));
+    out[0] = owen_scramble(sobol_dim0(index), hash_combine(seed, 1));
+    out[1] = owen_scramble(sobol_dim1(index), hash_combine(seed, 2));
+}
+
+// Point `index` of the R2 sequence, whose generator comes from the plastic
+// number, shifted by `offset` (all mod 1 in 32-bit fixed point)
+inline void rank1_pair(uint32_t index, const uint32_t offset[2], uint32_t out[2])
+{
+    out[0] = offset[0] + index * 3242174889u; // 0.7548776662 * 2^32
+    out[1] = offset[1] + index * 2447445413u; // 0.5698402910 * 2^32
+}
@@ -0,0 +1,275 @@
+/*
+    Sampler convergence benchmark
+
+    Measures how fast the error falls with the sample count for each
+    sample_pattern, in two parts:
+
+    - a 2D integrand with a known value (the quarter disk x^2 + y^2 < 1,
+      area pi/4), estimated independently in many pixels, which shows the
+      convergence rate of the pattern itself;
+    - the benchmark scene, rendered at powers of two samples per pixel and
+      compared against a high sample count reference, which shows what the
+      pattern buys once the draws go through camera, lens and bounces.
+
+    Errors are RMS over pixels; the scene's is taken after the output's
+    gamma 2 curve, like the adaptive renderer's. The slope column is the
+    least squares fit of log(error) against log(spp): -0.5 is plain Monte
+    Carlo, and lower is better.
+
+    Build: g++ -O3 -march=native -pthread -o sampler_bench sampler_bench.cc
+    Usage: ./sampler_bench [--max-spp N] [--reference-spp N] [--threads N] [--json FILE]
+*/
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "bvh.h"
+#include "camera.h"
+#include "kernels.h"
+#include "material.h"
+#include "scenes.h"
+#include "scheduler.h"
+
+/* Same render settings as main.cc */
+#define MAX_DEPTH 50
+#define ASPECT_RATIO (16.0f / 9.0f)
+#define IMG_WIDTH 120
+#define IMG_HEIGHT static_cast<int>(IMG_WIDTH / ASPECT_RATIO)
+#define TILE_SIZE 16
+
+/* Independent estimates of the analytic integrand */
+#define INTEGRAND_TRIALS 4096
+
+const sample_pattern patterns[] = {sample_pattern::independent, sample_pattern::sobol, sample_pattern::rank1};
+const int num_patterns = sizeof(patterns) / sizeof(patterns[0]);
+
+struct convergence
+{
+    string test;
+    sample_pattern pattern;
+    std::vector<int> spp;
+    std::vector<double> error;
+
+    /* Least squares slope of log(error) against log(spp) */
+    double slope() const
+    {
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        int n = 0;
+        for (size_t i = 0; i < spp.size(); i++)
+        {
+            if (error[i] <= 0)
+                continue;
+            double x = std::log((double)spp[i]), y = std::log(error[i]);
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+            n++;
+        }
+        double d = n * sxx - sx * sx;
+        return n > 1 && d > 0 ? (n * sxy - sx * sy) / d : 0.0;
+    }
+};
+
+/* RMS error of the quarter disk area estimated with n samples per trial */
+double integrand_error(sample_pattern pattern, int n)
+{
+    const double exact = 0.78539816339744831;
+    double squared = 0;
+    for (uint32_t trial = 0; trial < INTEGRAND_TRIALS; trial++)
+    {
+        int inside = 0;
+        for (int s = 0; s < n; s++)
+        {
+            rng rand(trial, s, 0, pattern);
+            float x = rand.next_float(), y = rand.next_float();
+            inside += x * x + y * y < 1;
+        }
+        double e = (double)inside / n - exact;
+        squared += e * e;
+    }
+    return std::sqrt(squared / INTEGRAND_TRIALS);
+}
+
+/* Renders the whole image at ctx.samples_per_pixel and returns each pixel's mean */
+std::vector<color> render_mean(const render_context &ctx, tile_scheduler &scheduler)
+{
+    scheduler.run([&](const tile &t, int)
+                  {
+                      for (int j = t.y0; j < t.y1; ++j)
+                          for (int i = t.x0; i < t.x1; ++i)
+                              ray_trace_sample<1, 1>(ctx, i, j); },
+                  true);
+
+    std::vector<color> mean(ctx.width * ctx.height);
+    for (size_t p = 0; p < mean.size(); p++)
+        mean[p] = ctx.pixel_colors[p] / (float)(ctx.samples_per_pixel - ctx.first_sample);
+    return mean;
+}
+
+double gamma_rmse(const std::vector<color> &image, const std::vector<color> &reference)
+{
+    double squared = 0;
+    for (size_t p = 0; p < image.size(); p++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            double e = std::sqrt(std::max(image[p][c], 0.0f)) - std::sqrt(std::max(reference[p][c], 0.0f));
+            squared += e * e;
+        }
+    }
+    return std::sqrt(squared / (3 * image.size()));
+}
+
+void print_table(const std::vector<convergence> &results, const string &test)
+{
+    cout << "\n"
+         << test << " (RMS error)" << endl;
+    cout << std::left << std::setw(8) << "spp" << std::right;
+    for (const auto &r : results)
+    {
+        if (r.test == test)
+            cout << std::setw(14) << sample_pattern_name(r.pattern);
+    }
+    cout << endl;
+
+    const convergence *first = nullptr;
+    for (const auto &r : results)
+    {
+        if (r.test == test && !first)
+            first = &r;
+    }
+    for (size_t i = 0; first && i < first->spp.size(); i++)
+    {
+        cout << std::left << std::setw(8) << first->spp[i] << std::right << std::scientific << std::setprecision(3);
+        for (const auto &r : results)
+        {
+            if (r.test == test)
+                cout << std::setw(14) << r.error[i];
+        }
+        cout << std::defaultfloat << endl;
+    }
+    cout << std::left << std::setw(8) << "slope" << std::right << std::fixed << std::setprecision(3);
+    for (const auto &r : results)
+    {
+        if (r.test == test)
+            cout << std::setw(14) << r.slope();
+    }
+    cout << std::defaultfloat << std::setprecision(6) << endl;
+}
+
+void write_json(std::ostream &out, const std::vector<convergence> &results, int reference_spp)
+{
+    out << std::setprecision(9);
+    out << "{\n";
+    out << "  \"image\": {\"width\": " << IMG_WIDTH << ", \"height\": " << IMG_HEIGHT
+        << ", \"max_depth\": " << MAX_DEPTH << ", \"reference_spp\": " << reference_spp << "},\n";
+    out << "  \"integrand_trials\": " << INTEGRAND_TRIALS << ",\n";
+    out << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const convergence &r = results[i];
+        out << "    {\"test\": \"" << r.test << "\", \"pattern\": \"" << sample_pattern_name(r.pattern)
+            << "\", \"slope\": " << r.slope() << ", \"spp\": [";
+        for (size_t k = 0; k < r.spp.size(); k++)
+            out << (k ? ", " : "") << r.spp[k];
+        out << "], \"rmse\": [";
+        for (size_t k = 0; k < r.error.size(); k++)
+            out << (k ? ", " : "") << r.error[k];
+        out << "]}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+    int max_spp = 128;
+    int reference_spp = 2048;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    string json_path;
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        if (arg == "--max-spp" && a + 1 < argc)
+            max_spp = std::max(1, atoi(argv[++a]));
+        else if (arg == "--reference-spp" && a + 1 < argc)
+            reference_spp = std::max(1, atoi(argv[++a]));
+        else if (arg == "--threads" && a + 1 < argc)
+            num_threads = atoi(argv[++a]);
+        else if (arg == "--json" && a + 1 < argc)
+            json_path = argv[++a];
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--max-spp N] [--reference-spp N] [--threads N] [--json FILE]" << endl;
+            return 1;
+        }
+    }
+
+    std::vector<convergence> results;
+
+    // Analytic integrand
+    for (int p = 0; p < num_patterns; p++)
+    {
+        convergence c{"quarter disk", patterns[p], {}, {}};
+        for (int n = 1; n <= max_spp; n *= 2)
+        {
+            c.spp.push_back(n);
+            c.error.push_back(integrand_error(patterns[p], n));
+        }
+        results.push_back(c);
+    }
+    print_table(results, "quarter disk");
+
+    // Scene, against a reference from the Sobol pattern at many more samples.
+    // Its samples come after every one the runs below draw, so no Sobol run
+    // is the start of its own reference.
+    material_table materials;
+    auto world = set_scene(materials);
+    bvh world_bvh(world);
+    camera cam = scene_camera(ASPECT_RATIO);
+    std::vector<color> pixel_colors(IMG_WIDTH * IMG_HEIGHT);
+    tile_scheduler scheduler(IMG_WIDTH, IMG_HEIGHT, TILE_SIZE, num_threads);
+
+    int reference_first = std::max(max_spp, reference_spp);
+    render_context reference_ctx{cam, world_bvh, materials, pixel_colors.data(), IMG_WIDTH, IMG_HEIGHT,
+                                 reference_first + reference_spp, MAX_DEPTH, sample_pattern::sobol,
+                                 reference_first};
+    cerr << "Rendering the " << reference_spp << " spp reference on " << scheduler.num_threads() << " threads..." << endl;
+    std::vector<color> reference = render_mean(reference_ctx, scheduler);
+
+    for (int p = 0; p < num_patterns; p++)
+    {
+        convergence c{"scene", patterns[p], {}, {}};
+        for (int n = 1; n <= max_spp; n *= 2)
+        {
+            render_context ctx{cam, world_bvh, materials, pixel_colors.data(), IMG_WIDTH, IMG_HEIGHT,
+                               n, MAX_DEPTH, patterns[p]};
+            c.spp.push_back(n);
+            c.error.push_back(gamma_rmse(render_mean(ctx, scheduler), reference));
+        }
+        results.push_back(c);
+    }
+    print_table(results, "scene");
+
+    if (!json_path.empty())
+    {
+        std::ofstream out(json_path);
+        write_json(out, results, reference_spp);
+        if (!out)
+        {
+            cerr << "Could not write " << json_path << endl;
+            return 1;
+        }
+    }
+}
@@ -0,0 +1,210 @@
+/*
+    Scene converter
+
+    Turns a text scene description, or one of the built-in scenes, into a
+    binary scene file (see scene_file.h) that main.cc maps with --scene.
+    The BVH is built here and stored in the file unless --no-bvh is given.
+
+    Text format, one item per line, '#' starts a comment:
+
+        camera LOOKFROM_X Y Z  LOOKAT_X Y Z  VUP_X Y Z  VFOV APERTURE FOCUS_DIST
+        material NAME lambertian R G B
+        material NAME metal R G B FUZZ
+        material NAME dielectric INDEX
+        sphere X Y Z RADIUS MATERIAL_NAME
+
+    Materials must be defined before the spheres that use them. Without a
+    camera line the renderer uses its default camera.
+
+    Build: g++ -O3 -march=native -o scene_convert scene_convert.cc
+    Usage: ./scene_convert [--no-bvh] [--leaf-size N] INPUT.txt|builtin:set|builtin:random OUTPUT
+*/
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "sphere.h"
+
+/* Reads a text scene into world and materials. Returns false and prints the offending line on error. */
+bool parse_scene(std::istream &in, const string &name, hittable_list &world, material_table &materials,
+                 scene_camera_record &cam, bool &has_camera)
+{
+    std::map<string, uint32_t> material_ids;
+    scene_arena arena;
+    string line;
+    int line_number = 0;
+    has_camera = false;
+
+    while (std::getline(in, line))
+    {
+        line_number++;
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+            line.erase(comment);
+
+        std::istringstream fields(line);
+        string keyword;
+        if (!(fields >> keyword))
+            continue;
+
+        bool ok = false;
+        if (keyword == "camera")
+        {
+            scene_camera_record c;
+            ok = true;
+            for (float &v : c.lookfrom)
+                ok = ok && (fields >> v);
+            for (float &v : c.lookat)
+                ok = ok && (fields >> v);
+            for (float &v : c.vup)
+                ok = ok && (fields >> v);
+            ok = ok && (fields >> c.vfov >> c.aperture >> c.focus_dist);
+            if (ok)
+            {
+                cam = c;
+                has_camera = true;
+            }
+        }
+        else if (keyword == "material")
+        {
+            string id, kind;
+            float r, g, b, x;
+            fields >> id >> kind;
+            if (kind == "lambertian" && (fields >> r >> g >> b))
+            {
+                material_ids[id] = materials.add(lambertian(color(r, g, b)));
+                ok = true;
+            }
+            else if (kind == "metal" && (fields >> r >> g >> b >> x))
+            {
+                material_ids[id] = materials.add(metal(color(r, g, b), x));
+                ok = true;
+            }
+            else if (kind == "dielectric" && (fields >> x))
+            {
+                material_ids[id] = materials.add(dielectric(x));
+                ok = true;
+            }
+        }
+        else if (keyword == "sphere")
+        {
+            float x, y, z, radius;
+            string id;
+            if (fields >> x >> y >> z >> radius >> id)
+            {
+                auto found = material_ids.find(id);
+                if (found == material_ids.end())
+                {
+                    cerr << name << ":" << line_number << ": unknown material '" << id << "'" << endl;
+                    return false;
+                }
+                world.add(arena.make<sphere>(point3(x, y, z), radius, found->second));
+                ok = true;
+            }
+        }
+
+        string extra;
+        if (!ok || (fields >> extra))
+        {
+            cerr << name << ":" << line_number << ": cannot parse '" << line << "'" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool build_bvh = true;
+    int leaf_size = 4;
+    string input, output;
+    for (int a = 1; a < argc; a++)
+    {
+        string arg = argv[a];
+        if (arg == "--no-bvh")
+            build_bvh = false;
+        else if (arg == "--leaf-size" && a + 1 < argc)
+            leaf_size = std::max(1, atoi(argv[++a]));
+        else if (input.empty())
+            input = arg;
+        else if (output.empty())
+            output = arg;
+        else
+            input.clear();
+    }
+    if (input.empty() || output.empty())
+    {
+        cerr << "Usage: " << argv[0] << " [--no-bvh] [--leaf-size N] INPUT.txt|builtin:set|builtin:random OUTPUT" << endl;
+        return 1;
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    hittable_list world;
+    material_table materials;
+    scene_camera_record cam;
+    bool has_camera = false;
+    if (input == "builtin:set")
+        world = set_scene(materials);
+    else if (input == "builtin:random")
+        world = random_scene(materials);
+    else
+    {
+        std::ifstream in(input);
+        if (!in)
+        {
+            cerr << "Cannot open " << input << endl;
+            return 1;
+        }
+        if (!parse_scene(in, input, world, materials, cam, has_camera))
+            return 1;
+    }
+    auto parsed = std::chrono::high_resolution_clock::now();
+
+    if (world.objects.empty())
+    {
+        cerr << input << " has no spheres" << endl;
+        return 1;
+    }
+
+    string error;
+    bool ok;
+    if (build_bvh)
+    {
+        // Leaves must use the packed sphere arrays, which is what the file stores
+        bvh accel(world, leaf_size, true);
+        ok = write_scene_file(output, materials, accel.packed, accel.nodes, accel.node_count,
+                              has_camera ? &cam : nullptr, error);
+        cerr << "BVH nodes:\t" << accel.node_count << endl;
+    }
+    else
+    {
+        packed_spheres spheres(world);
+        ok = write_scene_file(output, materials, spheres, nullptr, 0, has_camera ? &cam : nullptr, error);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (!ok)
+    {
+        cerr << error << endl;
+        return 1;
+    }
+
+    cerr << "Spheres:\t" << world.objects.size() << endl;
+    cerr << "Materials:\t" << materials.size() << endl;
+    cerr << "Read:\t\t" << std::chrono::duration<double>(parsed - start).count() * 1000 << " ms" << endl;
+    cerr << "Build+write:\t" << std::chrono::duration<double>(end - parsed).count() * 1000 << " ms" << endl;
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "packed_spheres.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary scene file, mapped and used in place.
+//
+// The file is a header followed by sections that are exactly the arrays the
+// renderer works on: the material table, the five packed_spheres arrays and,
+// optionally, the flattened bvh nodes. Loading maps the file read-only and
+// points a material_table, packed_spheres and bvh at the sections, so
+// nothing is parsed or copied and pages are read in as rays touch them.
+//
+// Sections start on 64-byte boundaries. Values are in the writer's native
+// byte order, and the header records sizeof(material) and sizeof(bvh_node)
+// so a file from an incompatible build is refused rather than misread.
+// Opening checks the header and that every section lies inside the file,
+// which leaves pages unread until rays touch them. The contents are trusted
+// unless verify() is called, which reads them all; do that for files from
+// anyone but the user running the renderer.
+
+const char scene_file_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+const uint32_t scene_file_version = 1;
+
+// Every sphere array is followed by this many NaN spheres, enough for the
+// widest packed_spheres load
+const int scene_sphere_padding = 16;
+static_assert(packed_spheres::lanes <= scene_sphere_padding, "scene files pad for at most 16 lanes");
+static_assert(std::is_trivially_copyable<material>::value, "materials are stored as raw bytes");
+
+enum scene_file_flags : uint32_t
+{
+    scene_has_bvh = 1,
+    scene_has_camera = 2,
+};
+
+struct scene_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t material_size; // sizeof(material) of the writer
+    uint32_t node_size;     // sizeof(bvh_node) of the writer
+    uint64_t file_size;
+    uint64_t material_count;
+    uint64_t sphere_count;
+    uint64_t node_count;
+    uint64_t materials_offset;
+    uint64_t sphere_offsets[5]; // center_x, center_y, center_z, radius, material_id
+    uint64_t nodes_offset;
+    scene_camera_record camera;
+};
+
+// Hash of a scene's tree and materials, to tell whether two processes or
+// two runs are rendering the same scene
+inline uint64_t scene_fingerprint(const bvh &accel, const material_table &materials)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&](const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        for (size_t i = 0; i < size; i++)
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    };
+    // Field by field, since padding and the unused part of a material's
+    // union are not necessarily the same in every process
+    for (int n = 0; n < accel.node_count; n++)
+    {
+        const bvh_node &node = accel.nodes[n];
+        add(node.lower, sizeof(node.lower));
+        add(node.upper, sizeof(node.upper));
+        add(&node.offset, sizeof(node.offset));
+        add(&node.prim_count, sizeof(node.prim_count));
+        add(&node.axis, sizeof(node.axis));
+    }
+    for (size_t m = 0; m < materials.size(); m++)
+    {
+        const material &mat = materials[(uint32_t)m];
+        add(&mat.kind, sizeof(mat.kind));
+        if (mat.kind == material_kind::lambertian)
+            add(mat.as<lambertian>().albedo.e, 3 * sizeof(float));
+        else if (mat.kind == material_kind::metal)
+        {
+            add(mat.as<metal>().albedo.e, 3 * sizeof(float));
+            add(&mat.as<metal>().fuzz, sizeof(float));
+        }
+        else
+            add(&mat.as<dielectric>().ir, sizeof(float));
+    }
+    return hash;
+}
+
+// Writes a scene file. `spheres` must be in the order the nodes' leaves
+// refer to, i.e. bvh::packed for a tree built with packed leaves; with no
+// nodes the loader builds a tree itself. Returns false with a reason in
+// `error` if the file could not be written.
+bool write_scene_file(const std::string &path, const material_table &materials, const packed_spheres &spheres,
+                      const bvh_node *nodes, int node_count, const scene_camera_record *camera,
+                      std::string &error)
+{
+    auto align = [](uint64_t offset)
+    { return (offset + 63) & ~(uint64_t)63; };
+
+    const uint64_t padded = (uint64_t)spheres.size() + scene_sphere_padding;
+    scene_file_header header = {};
+    std::memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+    header.version = scene_file_version;
+    header.flags = (node_count > 0 ? (uint32_t)scene_has_bvh : 0u) | (camera ? (uint32_t)scene_has_camera : 0u);
+    header.material_size = sizeof(material);
+    header.node_size = sizeof(bvh_node);
+    header.material_count = materials.size();
+    header.sphere_count = spheres.size();
+    header.node_count = node_count;
+    if (camera)
+        header.camera = *camera;
+
+    uint64_t offset = align(sizeof(header));
+    header.materials_offset = offset;
+    offset = align(offset + materials.size() * sizeof(material));
+    for (int a = 0; a < 5; a++)
+    {
+        header.sphere_offsets[a] = offset;
+        offset = align(offset + padded * sizeof(float));
+    }
+    header.nodes_offset = offset;
+    header.file_size = offset + (uint64_t)node_count * sizeof(bvh_node);
+
+    // The sphere arrays with their padding, in section order
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    std::vector<float> padding(scene_sphere_padding, nan);
+    std::vector<uint32_t> id_padding(scene_sphere_padding, 0);
+    const float *arrays[4] = {spheres.center_x, spheres.center_y, spheres.center_z, spheres.radius};
+
+    std::FILE *out = std::fopen(path.c_str(), "wb");
+    if (!out)
+    {
+        error = "cannot create " + path;
+        return false;
+    }
+
+    uint64_t written = 0;
+    bool ok = true;
+    auto put = [&](const void *data, uint64_t size)
+    {
+        ok = ok && (size == 0 || std::fwrite(data, 1, size, out) == size);
+        written += size;
+    };
+    auto pad_to = [&](uint64_t target)
+    {
+        static const char zeros[64] = {};
+        put(zeros, target - written);
+    };
+
+    put(&header, sizeof(header));
+    pad_to(header.materials_offset);
+    for (size_t m = 0; m < materials.size(); m++)
+        put(&materials[(uint32_t)m], sizeof(material));
+    for (int a = 0; a < 4; a++)
+    {
+        pad_to(header.sphere_offsets[a]);
+        put(arrays[a], spheres.size() * sizeof(float));
+        put(padding.data(), padding.size() * sizeof(float));
+    }
+    pad_to(header.sphere_offsets[4]);
+    put(spheres.material_id, spheres.size() * sizeof(uint32_t));
+    put(id_padding.data(), id_padding.size() * sizeof(uint32_t));
+    pad_to(header.nodes_offset);
+    put(nodes, (uint64_t)node_count * sizeof(bvh_node));
+
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok)
+        error = "cannot write " + path;
+    return ok;
+}
+
+// A scene file mapped into memory. The tables it hands out point into the
+// mapping, so they must not outlive the scene_file.
+class scene_file
+{
+public:
+    scene_file() {}
+    ~scene_file() { close(); }
+
+    scene_file(const scene_file &) = delete;
+    scene_file &operator=(const scene_file &) = delete;
+
+    // Maps `path` and checks its header. Returns false with a reason in
+    // `error` if it is not a scene file this build can use.
+    bool open(const std::string &path, std::string &error);
+    void close();
+
+    // Checks the sections of an open file: every material is a kind this
+    // build has, every sphere's material exists, and the stored tree only
+    // points at nodes and spheres in the file, reaches each node once and
+    // is no deeper than the traversal stack. Returns false with a reason
+    // in `error` otherwise.
+    bool verify(std::string &error) const;
+
+    const scene_file_header &header() const { return *head; }
+    bool has_bvh() const { return head && (head->flags & scene_has_bvh); }
+    bool has_camera() const { return head && (head->flags & scene_has_camera); }
+
+    material_table materials() const
+    {
+        return material_table(section<material>(head->materials_offset), head->material_count);
+    }
+
+    packed_spheres spheres() const
+    {
+        return packed_spheres(section<float>(head->sphere_offsets[0]), section<float>(head->sphere_offsets[1]),
+                              section<float>(head->sphere_offsets[2]), section<float>(head->sphere_offsets[3]),
+                              section<uint32_t>(head->sphere_offsets[4]), (int)head->sphere_count);
+    }
+
+    // The stored tree used in place, or one built from the spheres when the
+    // file has none
+    std::unique_ptr<bvh> make_bvh() const;
+
+private:
+    template <typename T>
+    const T *section(uint64_t offset) const { return reinterpret_cast<const T *>(base + offset); }
+
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+    const scene_file_header *head = nullptr;
+};
+
+bool scene_file::open(const std::string &path, std::string &error)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "cannot open " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(scene_file_header))
+    {
+        ::close(fd);
+        error = path + " is too short to be a scene file";
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        error = "cannot map " + path;
+        return false;
+    }
+    base = (const uint8_t *)map;
+    length = st.st_size;
+    head = (const scene_file_header *)base;
+
+    // Every section has to lie inside the file
+    auto fits = [&](uint64_t offset, uint64_t count, uint64_t size)
+    {
+        return offset % 64 == 0 && offset <= length && count <= (length - offset) / size;
+    };
+    const uint64_t padded = head->sphere_count + scene_sphere_padding;
+
+    if (std::memcmp(head->magic, scene_file_magic, sizeof(head->magic)) != 0)
+        error = path + " is not a scene file";
+    else if (head->version != scene_file_version)
+        error = path + " is scene file version " + std::to_string(head->version) +
+                ", this build reads version " + std::to_string(scene_file_version);
+    else if (head->material_size != sizeof(material) || head->node_size != sizeof(bvh_node))
+        error = path + " was written by a build with a different memory layout";
+    else if (head->file_size != length)
+        error = path + " is truncated";
+    else if (head->sphere_count > (uint64_t)std::numeric_limits<int32_t>::max() - scene_sphere_padding ||
+             head->node_count > (uint64_t)std::numeric_limits<int32_t>::max() ||
+             ((head->flags & scene_has_bvh) != 0) != (head->node_count > 0))
+        error = path + " has an invalid header";
+    else if (!fits(head->materials_offset, head->material_count, sizeof(material)) ||
+             !fits(head->sphere_offsets[0], padded, sizeof(float)) ||
+             !fits(head->sphere_offsets[1], padded, sizeof(float)) ||
+             !fits(head->sphere_offsets[2], padded, sizeof(float)) ||
+             !fits(head->sphere_offsets[3], padded, sizeof(float)) ||
+             !fits(head->sphere_offsets[4], padded, sizeof(uint32_t)) ||
+             !fits(head->nodes_offset, head->node_count, sizeof(bvh_node)))
+        error = path + " has a section outside the file";
+    else
+        return true;
+
+    close();
+    return false;
+}
+
+bool scene_file::verify(std::string &error) const
+{
+    const material *mats = section<material>(head->materials_offset);
+    for (uint64_t m = 0; m < head->material_count; m++)
+    {
+        if ((uint32_t)mats[m].kind >= (uint32_t)material_kind::count)
+        {
+            error = "material " + std::to_string(m) + " is of no known kind";
+            return false;
+        }
+    }
+    const uint32_t *ids = section<uint32_t>(head->sphere_offsets[4]);
+    for (uint64_t i = 0; i < head->sphere_count; i++)
+    {
+        if (ids[i] >= head->material_count)
+        {
+            error = "sphere " + std::to_string(i) + " has no material";
+            return false;
+        }
+    }
+    if (!has_bvh())
+        return true;
+
+    // Walked as traverse_bvh() does. Second children come after the first,
+    // so the walk ends, and counting visits bounds it for shared subtrees.
+    const bvh_node *nodes = section<bvh_node>(head->nodes_offset);
+    const int64_t count = (int64_t)head->node_count;
+    std::vector<std::pair<int64_t, int>> stack = {{0, 0}};
+    int64_t visited = 0;
+    while (!stack.empty())
+    {
+        int64_t index = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        const bvh_node &node = nodes[index];
+        bool ok = ++visited <= count && depth < bvh_max_depth;
+        if (ok && node.prim_count > 0)
+            ok = node.offset >= 0 && (uint64_t)node.offset + node.prim_count <= head->sphere_count;
+        else if (ok)
+        {
+            ok = node.axis < 3 && index + 1 < count && node.offset > index + 1 && node.offset < count;
+            stack.push_back({node.offset, depth + 1});
+            stack.push_back({index + 1, depth + 1});
+        }
+        if (!ok)
+        {
+            error = "the tree is malformed at node " + std::to_string(index);
+            return false;
+        }
+    }
+    return true;
+}
+
+void scene_file::close()
+{
+    if (base)
+        munmap((void *)base, length);
+    base = nullptr;
+    head = nullptr;
+    length = 0;
+}
+
+std::unique_ptr<bvh> scene_file::make_bvh() const
+{
+    if (has_bvh())
+        return std::unique_ptr<bvh>(new bvh(section<bvh_node>(head->nodes_offset), (int)head->node_count, spheres()));
+
+    packed_spheres s = spheres();
+    hittable_list list;
+    scene_arena arena;
+    for (int i = 0; i < s.size(); i++)
+        list.add(arena.make<sphere>(point3(s.center_x[i], s.center_y[i], s.center_z[i]), s.radius[i], s.material_id[i]));
+    return std::unique_ptr<bvh>(new bvh(list));
+}
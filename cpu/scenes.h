@@ -0,0 +1,224 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "arena.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+
+// The scene functions make their objects in a scene_arena, which the
+// returned list's pointers keep alive, so each kind of object is stored
+// contiguously in the order it was made.
+
+// Predefined scene used for benchmarking
+hittable_list set_scene(material_table &materials)
+{
+    reset_scene_rng();
+    hittable_list world;
+    scene_arena arena;
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++)
+    {
+        for (int b = -11; b < 11; b++)
+        {
+            auto choose_mat = random_float();
+            point3 center(a + 0.9, 0.2, b + 0.9);
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9)
+            {
+                uint32_t sphere_material;
+
+                if (choose_mat < 0.8)
+                {
+                    // diffuse
+                    auto albedo = color::random(0.7, 0.7) * color::random(0.7, 0.7);
+                    sphere_material = materials.add(lambertian(albedo));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95)
+                {
+                    // metal
+                    auto albedo = color::random(0.5, 0.5);
+                    auto fuzz = random_float(0, 0);
+                    sphere_material = materials.add(metal(albedo, fuzz));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+                else
+                {
+                    // glass
+                    sphere_material = materials.add(dielectric(1.5));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.add(dielectric(1.5));
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = materials.add(lambertian(color(0.4, 0.2, 0.1)));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = materials.add(metal(color(0.7, 0.6, 0.5), 0.0));
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+hittable_list random_scene(material_table &materials)
+{
+    reset_scene_rng();
+    hittable_list world;
+    scene_arena arena;
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++)
+    {
+        for (int b = -11; b < 11; b++)
+        {
+            auto choose_mat = random_float();
+            point3 center(a + 0.9 * random_float(), 0.2, b + 0.9 * random_float());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9)
+            {
+                uint32_t sphere_material;
+
+                if (choose_mat < 0.8)
+                {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = materials.add(lambertian(albedo));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95)
+                {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_float(0, 0.5);
+                    sphere_material = materials.add(metal(albedo, fuzz));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+                else
+                {
+                    // glass
+                    sphere_material = materials.add(dielectric(1.5));
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = materials.add(dielectric(1.5f));
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0f, material1));
+
+    auto material2 = materials.add(lambertian(color(0.4f, 0.2f, 0.1f)));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0f, material2));
+
+    auto material3 = materials.add(metal(color(0.7f, 0.6f, 0.5f), 0.0f));
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0f, material3));
+
+    return world;
+}
+
+// A mesh resting on a large ground sphere
+hittable_list mesh_scene(shared_ptr<triangle_mesh> mesh, material_table &materials)
+{
+    hittable_list world;
+    scene_arena arena;
+    aabb bounds;
+    mesh->bounding_box(bounds);
+    vec3 size = bounds.max() - bounds.min();
+    float ground_radius = 1000 * std::max(size.x(), std::max(size.y(), size.z()));
+    point3 center = bounds.centroid();
+
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(arena.make<sphere>(point3(center.x(), bounds.min().y() - ground_radius, center.z()),
+                                 ground_radius, ground_material));
+    world.add(mesh);
+    return world;
+}
+
+// `count` copies of one geometry on a square grid, each turned, scaled and
+// coloured differently, standing on a ground sphere at y = 0. Every copy is
+// an instance, so the geometry is stored once. `bounds` receives the box
+// around the copies.
+hittable_list instanced_scene(shared_ptr<const hittable> geometry, int count, material_table &materials, aabb &bounds)
+{
+    reset_scene_rng();
+    hittable_list world;
+    scene_arena arena;
+    aabb box;
+    geometry->bounding_box(box);
+    vec3 size = box.max() - box.min();
+    float spacing = 1.5f * std::max(size.x(), size.z());
+    int side = (int)std::ceil(std::sqrt((float)count));
+    point3 base(box.centroid().x(), box.min().y(), box.centroid().z());
+
+    uint32_t palette[] = {
+        materials.add(lambertian(color(0.2f, 0.5f, 0.2f))),
+        materials.add(lambertian(color(0.6f, 0.4f, 0.2f))),
+        materials.add(lambertian(color(0.7f, 0.7f, 0.7f))),
+        materials.add(metal(color(0.8f, 0.7f, 0.5f), 0.1f)),
+    };
+    const int palette_size = sizeof(palette) / sizeof(palette[0]);
+
+    bounds = aabb();
+    for (int k = 0; k < count; k++)
+    {
+        point3 position(((k % side) - 0.5f * (side - 1)) * spacing, 0, ((k / side) - 0.5f * (side - 1)) * spacing);
+        affine placement = affine::translate(position) * affine::rotate(vec3(0, 1, 0), random_float(0, 360)) *
+                           affine::scale(random_float(0.6f, 1.2f)) * affine::translate(-base);
+        auto copy = arena.make<instance>(geometry, placement, palette[k % palette_size]);
+        bounds = surrounding_box(bounds, copy->bounds);
+        world.add(copy);
+    }
+
+    float ground_radius = 1000 * side * spacing;
+    auto ground_material = materials.add(lambertian(color(0.5, 0.5, 0.5)));
+    world.add(arena.make<sphere>(point3(0, -ground_radius, 0), ground_radius, ground_material));
+    return world;
+}
+
+// Camera in front of and slightly above a box, framing all of it
+scene_camera_record framing_camera_settings(const aabb &bounds)
+{
+    const float vfov = 30;
+    point3 lookat = bounds.centroid();
+    float radius = 0.5f * (bounds.max() - bounds.min()).length();
+    float distance = 1.1f * radius / sin(degrees_to_radians(vfov / 2));
+    point3 lookfrom = lookat + distance * unit_vector(vec3(0, 0.35f, 1));
+
+    return camera_settings(lookfrom, lookat, vec3(0, 1, 0), vfov, 0, distance);
+}
+
+camera framing_camera(const aabb &bounds, float aspect_ratio)
+{
+    return make_camera(framing_camera_settings(bounds), aspect_ratio);
+}
+
+// Camera looking at set_scene() from slightly above
+scene_camera_record scene_camera_settings()
+{
+    point3 lookfrom(0, 5, 15);
+    point3 lookat(0, 0, 0);
+    vec3 vup(0, 1, 0);
+    float dist_to_focus = 15.8f;
+    float aperture = 0.1f;
+
+    return camera_settings(lookfrom, lookat, vup, 20, aperture, dist_to_focus);
+}
+
+camera scene_camera(float aspect_ratio)
+{
+    return make_camera(scene_camera_settings(), aspect_ratio);
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// Keeps the calling thread on one CPU. Returns false if the system refused.
+inline bool pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Persistent pool of worker threads, each with its own task deque. A worker
+// pops from the back of its own deque and, once that is empty, steals from
+// the front of the others, so cheap tasks never leave a thread idle while
+// another still has a backlog. Given a CPU per worker, each worker pins
+// itself to its CPU when it starts.
+class work_stealing_pool
+{
+public:
+    explicit work_stealing_pool(int num_threads, const std::vector<int> &cpus = {});
+    ~work_stealing_pool();
+
+    int size() const { return (int)workers.size(); }
+
+    // Runs fn(task, worker) for every task in [0, n) and blocks until all are
+    // done. Tasks are dealt out in contiguous blocks, so neighbouring tasks
+    // start on the same worker. Without `steal` every worker runs exactly
+    // the block it was dealt, the same block for the same n every time.
+    void run(int n, const std::function<void(int, int)> &fn, bool steal = true);
+
+private:
+    struct alignas(64) task_queue
+    {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    void worker_loop(int id, int cpu);
+    bool next_task(int id, int &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<task_queue>> queues;
+
+    std::mutex state_lock;
+    std::condition_variable wake, done;
+    const std::function<void(int, int)> *job = nullptr;
+    uint64_t generation = 0;
+    bool stealing = true; // for the current job
+    int finished = 0;     // workers that have drained every queue this generation
+    bool stopping = false;
+};
+
+work_stealing_pool::work_stealing_pool(int num_threads, const std::vector<int> &cpus)
+{
+    num_threads = std::max(1, num_threads);
+    for (int i = 0; i < num_threads; i++)
+        queues.push_back(std::unique_ptr<task_queue>(new task_queue));
+    for (int i = 0; i < num_threads; i++)
+        workers.emplace_back(&work_stealing_pool::worker_loop, this, i, i < (int)cpus.size() ? cpus[i] : -1);
+}
+
+work_stealing_pool::~work_stealing_pool()
+{
+    {
+        std::lock_guard<std::mutex> guard(state_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+void work_stealing_pool::run(int n, const std::function<void(int, int)> &fn, bool steal)
+{
+    if (n <= 0)
+        return;
+
+    int num_workers = size();
+    for (int w = 0; w < num_workers; w++)
+    {
+        int begin = (int)((int64_t)n * w / num_workers);
+        int end = (int)((int64_t)n * (w + 1) / num_workers);
+        std::lock_guard<std::mutex> guard(queues[w]->lock);
+        // Stored reversed so the owner, popping from the back, walks its
+        // block in order while thieves take from the far end
+        for (int t = end - 1; t >= begin; t--)
+            queues[w]->tasks.push_back(t);
+    }
+
+    // A worker only stops once every queue is empty and its own last task is
+    // done, so once all of them have stopped the whole job is finished and
+    // none of them can still be holding a pointer to fn.
+    std::unique_lock<std::mutex> guard(state_lock);
+    job = &fn;
+    stealing = steal;
+    finished = 0;
+    generation++;
+    wake.notify_all();
+    done.wait(guard, [&]
+              { return finished == num_workers; });
+    job = nullptr;
+}
+
+bool work_stealing_pool::next_task(int id, int &task)
+{
+    {
+        task_queue &own = *queues[id];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    // Workers are pinned node by node, if at all, so the nearest queues
+    // are tried first
+    int num_workers = stealing ? size() : 1;
+    for (int k = 1; k < num_workers; k++)
+    {
+        task_queue &victim = *queues[(id + k) % num_workers];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void work_stealing_pool::worker_loop(int id, int cpu)
+{
+    if (cpu >= 0)
+        pin_current_thread(cpu);
+
+    uint64_t seen = 0;
+    while (true)
+    {
+        const std::function<void(int, int)> *fn;
+        {
+            std::unique_lock<std::mutex> guard(state_lock);
+            wake.wait(guard, [&]
+                      { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            fn = job;
+        }
+
+        int task;
+        while (next_task(id, task))
+            (*fn)(task, id);
+
+        std::lock_guard<std::mutex> guard(state_lock);
+        if (++finished == size())
+            done.notify_all();
+    }
+}
+
+// A rectangle of pixels [x0, x1) x [y0, y1) and how long it took to render
+struct tile
+{
+    int x0, y0, x1, y1;
+    float seconds;
+};
+
+inline uint32_t morton_code(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v)
+    {
+        v &= 0xFFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Splits the image into tiles in Morton (Z-curve) order and renders them on
+// a work-stealing pool. Consecutive tiles are close together on screen, so
+// each worker's contiguous block covers a compact region of the image.
+class tile_scheduler
+{
+public:
+    tile_scheduler(int width, int height, int tile_size, int num_threads, const std::vector<int> &cpus = {})
+        : pool(num_threads, cpus)
+    {
+        set_image(width, height, tile_size);
+    }
+
+    void set_image(int width, int height, int tile_size);
+
+    // Calls render_tile(tile, worker) for every tile and records its time.
+    // With use_threads unset the tiles run in order on the calling thread.
+    void run(const std::function<void(const tile &, int)> &render_tile, bool use_threads = true);
+
+    // Calls touch(tile, worker) for every tile on the worker that run()
+    // deals it to first, e.g. to place its pixels in that worker's memory
+    void first_touch(const std::function<void(const tile &, int)> &touch);
+
+    int num_threads() const { return pool.size(); }
+
+public:
+    std::vector<tile> tiles;
+
+private:
+    work_stealing_pool pool;
+};
+
+void tile_scheduler::set_image(int width, int height, int tile_size)
+{
+    tile_size = std::max(1, tile_size);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    std::vector<std::pair<uint32_t, tile>> ordered;
+    for (int ty = 0; ty < tiles_y; ty++)
+    {
+        for (int tx = 0; tx < tiles_x; tx++)
+        {
+            tile t;
+            t.x0 = tx * tile_size;
+            t.y0 = ty * tile_size;
+            t.x1 = std::min(t.x0 + tile_size, width);
+            t.y1 = std::min(t.y0 + tile_size, height);
+            t.seconds = 0;
+            ordered.push_back({morton_code(tx, ty), t});
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              [](const std::pair<uint32_t, tile> &a, const std::pair<uint32_t, tile> &b)
+              { return a.first < b.first; });
+
+    tiles.clear();
+    for (const auto &entry : ordered)
+        tiles.push_back(entry.second);
+}
+
+void tile_scheduler::run(const std::function<void(const tile &, int)> &render_tile, bool use_threads)
+{
+    auto timed = [&](int index, int worker)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        render_tile(tiles[index], worker);
+        auto end = std::chrono::high_resolution_clock::now();
+        tiles[index].seconds = std::chrono::duration<float>(end - start).count();
+    };
+
+    if (use_threads)
+        pool.run((int)tiles.size(), timed);
+    else
+        for (int i = 0; i < (int)tiles.size(); i++)
+            timed(i, 0);
+}
+
+void tile_scheduler::first_touch(const std::function<void(const tile &, int)> &touch)
+{
+    pool.run((int)tiles.size(), [&](int index, int worker)
+             { touch(tiles[index], worker); },
+             false);
+}
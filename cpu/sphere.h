@@ -9,16 +9,18 @@ class sphere : public hittable
 public:
     sphere() {}
 
-    sphere(point3 cen, float r, shared_ptr<material> m)
-        : center(cen), radius(r), mat_ptr(m){};
+    sphere(point3 cen, float r, uint32_t m)
+        : center(cen), radius(r), mat_id(m){};
 
     virtual bool hit(
         const ray &r, float t_min, float t_max, hit_record &rec) const override;
 
+    virtual bool bounding_box(aabb &output_box) const override;
+
 public:
     point3 center;
     float radius;
-    shared_ptr<material> mat_ptr;
+    uint32_t mat_id;
 };
 
 bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
@@ -46,7 +48,15 @@ bool sphere::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_id = mat_id;
+
+    return true;
+}
 
+bool sphere::bounding_box(aabb &output_box) const
+{
+    output_box = aabb(
+        center - vec3(radius, radius, radius),
+        center + vec3(radius, radius, radius));
     return true;
 }
\ No newline at end of file
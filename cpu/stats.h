@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+
+// Ray statistics, compiled in with -DRAY_STATS. Every thread counts into its
+// own cache-line aligned copy with plain increments; flush_ray_stats() folds
+// it into the shared totals, which the renderer does once per tile. Without
+// the switch the STAT_ macros expand to nothing and nothing is counted.
+
+// Bins of the path length histogram; the last bin also holds longer paths
+const int stats_max_segments = 64;
+
+// Why a path stopped
+enum class path_end
+{
+    sky,         // missed everything
+    absorbed,    // the material did not scatter
+    roulette,    // terminated by Russian roulette
+    depth_limit, // reached max_depth bounces
+    count
+};
+
+struct alignas(64) ray_stats
+{
+    uint64_t paths = 0;
+    uint64_t segments = 0;
+    uint64_t node_tests = 0;      // BVH boxes tested
+    uint64_t primitive_tests = 0; // ray-primitive tests
+    uint64_t scatter_calls = 0;
+    uint64_t ends[(int)path_end::count] = {};
+    uint64_t length_histogram[stats_max_segments] = {}; // paths by segment count
+
+    // A path ended for `reason` after tracing `segments` segments
+    void end_path(path_end reason, int segments)
+    {
+        paths++;
+        ends[(int)reason]++;
+        length_histogram[segments < stats_max_segments ? segments : stats_max_segments - 1]++;
+    }
+
+    void add(const ray_stats &other);
+    void print(std::ostream &out) const;
+};
+
+void ray_stats::add(const ray_stats &other)
+{
+    paths += other.paths;
+    segments += other.segments;
+    node_tests += other.node_tests;
+    primitive_tests += other.primitive_tests;
+    scatter_calls += other.scatter_calls;
+    for (int i = 0; i < (int)path_end::count; i++)
+        ends[i] += other.ends[i];
+    for (int i = 0; i < stats_max_segments; i++)
+        length_histogram[i] += other.length_histogram[i];
+}
+
+void ray_stats::print(std::ostream &out) const
+{
+    auto percent = [&](uint64_t n)
+    { return paths ? 100.0 * n / paths : 0.0; };
+    double per_segment = segments ? 1.0 / segments : 0.0;
+
+    out << "  ray stats: " << paths << " paths, " << segments << " segments, "
+        << scatter_calls << " scatter calls" << std::endl;
+    out << "    tests per segment: " << node_tests * per_segment << " boxes, "
+        << primitive_tests * per_segment << " primitives" << std::endl;
+
+    const char *names[] = {"sky", "absorbed", "roulette", "depth limit"};
+    out << "    path ends:";
+    for (int i = 0; i < (int)path_end::count; i++)
+        out << " " << names[i] << " " << std::fixed << std::setprecision(1) << percent(ends[i]) << "%";
+    out << std::defaultfloat << std::setprecision(6) << std::endl;
+
+    out << "    segments per path:";
+    for (int i = 0; i < stats_max_segments; i++)
+    {
+        if (length_histogram[i])
+            out << " " << i << (i == stats_max_segments - 1 ? "+" : "") << ":" << length_histogram[i];
+    }
+    out << std::endl;
+}
+
+#ifdef RAY_STATS
+
+thread_local ray_stats thread_stats;
+ray_stats total_stats;
+std::mutex total_stats_lock;
+
+#define STAT_ADD(field, n) (thread_stats.field += (n))
+#define STAT_END_PATH(reason, segments) thread_stats.end_path(reason, segments)
+
+inline void flush_ray_stats()
+{
+    std::lock_guard<std::mutex> guard(total_stats_lock);
+    total_stats.add(thread_stats);
+    thread_stats = ray_stats();
+}
+
+inline void reset_ray_stats()
+{
+    std::lock_guard<std::mutex> guard(total_stats_lock);
+    total_stats = ray_stats();
+}
+
+inline void print_ray_stats(std::ostream &out)
+{
+    std::lock_guard<std::mutex> guard(total_stats_lock);
+    total_stats.print(out);
+}
+
+#else
+
+#define STAT_ADD(field, n) ((void)0)
+// Not evaluated, but the path length still counts as used
+#define STAT_END_PATH(reason, segments) ((void)sizeof(segments))
+
+inline void flush_ray_stats() {}
+inline void reset_ray_stats() {}
+inline void print_ray_stats(std::ostream &) {}
+
+#endif
@@ -0,0 +1,527 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "integrator.h"
+#include "kernels.h"
+#include "material.h"
+#include "scene_file.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Tile farming over sockets. A coordinator listens on an address and hands
+// tiles to worker processes; each worker renders a tile with the kernel the
+// coordinator names and sends back the tile's pixel sums, which the
+// coordinator copies into its image. Every sample's random numbers depend
+// only on its pixel and sample index, so the merged image is identical to a
+// single-process render with the same kernel.
+//
+// Workers can join at any time. A worker that disconnects has its tile
+// handed out again, and once no unassigned tiles are left, idle workers get
+// a copy of a tile still in progress, so a slow worker holds up the frame
+// by at most one tile. The first result for a tile is kept.
+//
+// Addresses are "unix:PATH" for a Unix socket or "HOST:PORT" for TCP.
+// Messages are raw structs in native byte order, like scene files, so every
+// process must come from the same build.
+
+const uint32_t farm_version = 1;
+
+enum farm_message_type : uint32_t
+{
+    farm_hello = 1,   // worker -> coordinator, payload farm_settings
+    farm_job = 2,     // coordinator -> worker
+    farm_result = 3,  // worker -> coordinator, payload three floats per pixel, row by row
+    farm_stop = 4,    // coordinator -> worker, frame finished
+    farm_refused = 5, // coordinator -> worker, settings do not match
+};
+
+struct farm_message
+{
+    uint32_t type;
+    int32_t tile; // index into the coordinator's tile list
+    int32_t x0, y0, x1, y1;
+    uint32_t kernel; // index into sample_kernels
+    uint32_t payload_size;
+};
+
+// What a worker renders with; it must match the coordinator exactly
+struct farm_settings
+{
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t samples_per_pixel;
+    uint32_t max_depth;
+    uint32_t pattern;
+    uint64_t fingerprint;
+};
+
+// A tile result is three floats per pixel, without the padding of color
+const size_t farm_pixel_size = 3 * sizeof(float);
+
+// Totals of one farmed frame
+struct farm_report
+{
+    int workers = 0;  // connections that were accepted and agreed on settings
+    int lost = 0;     // workers that disconnected while holding a tile
+    int reissued = 0; // tiles handed to a second worker while still in progress
+    int refused = 0;  // workers turned away for a settings mismatch
+};
+
+inline farm_settings make_farm_settings(const render_context &ctx, uint64_t fingerprint)
+{
+    farm_settings s = {};
+    s.version = farm_version;
+    s.width = ctx.width;
+    s.height = ctx.height;
+    s.samples_per_pixel = ctx.samples_per_pixel;
+    s.max_depth = ctx.max_depth;
+    s.pattern = (uint32_t)ctx.pattern;
+    s.fingerprint = fingerprint;
+    return s;
+}
+
+namespace farm_detail
+{
+    // Fills a sockaddr for `address`. Returns false with a reason in `error`.
+    inline bool resolve(const std::string &address, bool passive, sockaddr_storage &out, socklen_t &length,
+                        int &family, std::string &error)
+    {
+        std::memset(&out, 0, sizeof(out));
+        if (address.compare(0, 5, "unix:") == 0)
+        {
+            std::string path = address.substr(5);
+            sockaddr_un *un = (sockaddr_un *)&out;
+            if (path.empty() || path.size() >= sizeof(un->sun_path))
+            {
+                error = "bad socket path in " + address;
+                return false;
+            }
+            un->sun_family = AF_UNIX;
+            std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+            length = sizeof(sockaddr_un);
+            family = AF_UNIX;
+            return true;
+        }
+
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos)
+        {
+            error = "address " + address + " is neither unix:PATH nor HOST:PORT";
+            return false;
+        }
+        std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+        addrinfo hints = {}, *found = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = passive ? AI_PASSIVE : 0;
+        int status = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+        if (status != 0 || !found)
+        {
+            error = "cannot resolve " + address + ": " + gai_strerror(status);
+            return false;
+        }
+        std::memcpy(&out, found->ai_addr, found->ai_addrlen);
+        length = found->ai_addrlen;
+        family = found->ai_family;
+        freeaddrinfo(found);
+        return true;
+    }
+
+    inline bool send_all(int fd, const void *data, size_t size)
+    {
+        const char *p = (const char *)data;
+        while (size > 0)
+        {
+            ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            p += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    inline bool recv_all(int fd, void *data, size_t size)
+    {
+        char *p = (char *)data;
+        while (size > 0)
+        {
+            ssize_t got = recv(fd, p, size, 0);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            p += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    inline bool send_message(int fd, farm_message message, const void *payload = nullptr)
+    {
+        return send_all(fd, &message, sizeof(message)) &&
+               (message.payload_size == 0 || send_all(fd, payload, message.payload_size));
+    }
+
+    // Coordinator's view of one connection
+    struct worker
+    {
+        int fd;
+        bool greeted = false;
+        int tile = -1; // tile being rendered, or -1 when idle
+        std::vector<char> input;
+    };
+}
+
+// Opens a listening socket on `address`, replacing a stale Unix socket file.
+// A Unix socket is bound under a 0077 umask, so only this user can ever
+// connect to it; a chmod after bind would leave a window in which anyone
+// could. Returns the descriptor, or -1 with a reason in `error`.
+int farm_listen(const std::string &address, std::string &error)
+{
+    sockaddr_storage addr;
+    socklen_t length;
+    int family;
+    if (!farm_detail::resolve(address, true, addr, length, family, error))
+        return -1;
+
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        error = "cannot create a socket for " + address;
+        return -1;
+    }
+    if (family == AF_UNIX)
+        unlink(((sockaddr_un *)&addr)->sun_path);
+    else
+    {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    mode_t old_mask = family == AF_UNIX ? umask(0077) : 0;
+    bool bound = bind(fd, (sockaddr *)&addr, length) == 0;
+    if (family == AF_UNIX)
+        umask(old_mask);
+    if (!bound || listen(fd, 64) != 0)
+    {
+        error = "cannot listen on " + address + ": " + std::strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Closes a socket from farm_listen and removes its Unix socket file
+void farm_unlisten(int fd, const std::string &address)
+{
+    close(fd);
+    if (address.compare(0, 5, "unix:") == 0)
+        unlink(address.c_str() + 5);
+}
+
+// Connects to a coordinator, retrying for up to `wait_seconds` so workers
+// can be started before it. Returns the descriptor, or -1 with a reason in
+// `error`.
+int farm_connect(const std::string &address, double wait_seconds, std::string &error)
+{
+    sockaddr_storage addr;
+    socklen_t length;
+    int family;
+    if (!farm_detail::resolve(address, false, addr, length, family, error))
+        return -1;
+
+    auto start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        int fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0)
+        {
+            error = "cannot create a socket for " + address;
+            return -1;
+        }
+        if (connect(fd, (sockaddr *)&addr, length) == 0)
+            return fd;
+        close(fd);
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= wait_seconds)
+        {
+            error = "cannot connect to " + address + ": " + std::strerror(errno);
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+// Farms out `tiles` to the workers that connect to `listen_fd` and merges
+// their results into ctx.pixel_colors, rendering with sample_kernels[kernel].
+// Each tile's seconds are set to the time from its first hand-out to its
+// result. Returns when every tile is in; the workers are then told to stop.
+void farm_coordinate(int listen_fd, const render_context &ctx, uint64_t fingerprint, int kernel,
+                     std::vector<tile> &tiles, farm_report &report)
+{
+    using namespace farm_detail;
+    using clock = std::chrono::steady_clock;
+
+    const farm_settings expected = make_farm_settings(ctx, fingerprint);
+    const int n = (int)tiles.size();
+    std::deque<int> pending;
+    for (int t = 0; t < n; t++)
+        pending.push_back(t);
+    std::vector<char> done(n, 0);
+    std::vector<int> copies(n, 0); // workers currently rendering each tile
+    std::vector<clock::time_point> issued(n);
+    int remaining = n;
+    // No message is larger than the largest tile's pixels or the greeting
+    size_t max_payload = sizeof(farm_settings);
+    for (const tile &t : tiles)
+        max_payload = std::max(max_payload, (size_t)(t.x1 - t.x0) * (t.y1 - t.y0) * farm_pixel_size);
+    std::vector<worker> workers;
+    report = farm_report();
+
+    auto drop = [&](size_t w)
+    {
+        int t = workers[w].tile;
+        if (t >= 0)
+        {
+            copies[t]--;
+            if (!done[t])
+            {
+                report.lost++;
+                if (copies[t] == 0)
+                    pending.push_front(t);
+            }
+        }
+        close(workers[w].fd);
+        workers.erase(workers.begin() + w);
+    };
+
+    // Next tile for an idle worker: an unassigned one, or else a second copy
+    // of the longest-running tile that has only one
+    auto next_tile = [&]()
+    {
+        while (!pending.empty())
+        {
+            int t = pending.front();
+            pending.pop_front();
+            if (!done[t])
+                return t;
+        }
+        int oldest = -1;
+        for (int t = 0; t < n; t++)
+            if (!done[t] && copies[t] == 1 && (oldest < 0 || issued[t] < issued[oldest]))
+                oldest = t;
+        if (oldest >= 0)
+            report.reissued++;
+        return oldest;
+    };
+
+    while (remaining > 0)
+    {
+        for (size_t w = 0; w < workers.size(); w++)
+        {
+            if (!workers[w].greeted || workers[w].tile >= 0)
+                continue;
+            int t = next_tile();
+            if (t < 0)
+                break;
+            const tile &job = tiles[t];
+            farm_message message = {farm_job, t, job.x0, job.y0, job.x1, job.y1, (uint32_t)kernel, 0};
+            if (copies[t] == 0)
+                issued[t] = clock::now();
+            copies[t]++;
+            workers[w].tile = t;
+            if (!send_message(workers[w].fd, message))
+                drop(w--);
+        }
+
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0] = {listen_fd, POLLIN, 0};
+        for (size_t w = 0; w < workers.size(); w++)
+            fds[1 + w] = {workers[w].fd, POLLIN, 0};
+        if (poll(fds.data(), fds.size(), 1000) <= 0)
+            continue;
+
+        // Walked backwards so dropping a worker does not shift the ones still to visit
+        for (size_t w = workers.size(); w-- > 0;)
+        {
+            if (!(fds[1 + w].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            worker &from = workers[w];
+            char buffer[1 << 16];
+            ssize_t got = recv(from.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (got <= 0)
+            {
+                drop(w);
+                continue;
+            }
+            from.input.insert(from.input.end(), buffer, buffer + got);
+
+            bool bad = false;
+            while (!bad && from.input.size() >= sizeof(farm_message))
+            {
+                farm_message message;
+                std::memcpy(&message, from.input.data(), sizeof(message));
+                size_t total = sizeof(message) + message.payload_size;
+                bad = message.payload_size > max_payload;
+                if (bad || from.input.size() < total)
+                    break;
+                const char *payload = from.input.data() + sizeof(message);
+
+                if (message.type == farm_hello && !from.greeted)
+                {
+                    if (message.payload_size == sizeof(farm_settings) &&
+                        std::memcmp(payload, &expected, sizeof(expected)) == 0)
+                    {
+                        from.greeted = true;
+                        report.workers++;
+                    }
+                    else
+                    {
+                        farm_message refusal = {farm_refused, -1, 0, 0, 0, 0, 0, 0};
+                        send_message(from.fd, refusal);
+                        report.refused++;
+                        bad = true;
+                    }
+                }
+                else if (message.type == farm_result && from.greeted && from.tile >= 0 &&
+                         message.tile == from.tile)
+                {
+                    const tile &t = tiles[message.tile];
+                    if (message.payload_size != (size_t)(t.x1 - t.x0) * (t.y1 - t.y0) * farm_pixel_size)
+                    {
+                        bad = true;
+                        break;
+                    }
+                    copies[from.tile]--;
+                    from.tile = -1;
+                    if (!done[message.tile])
+                    {
+                        const char *pixels = payload;
+                        for (int j = t.y0; j < t.y1; j++)
+                        {
+                            for (int i = t.x0; i < t.x1; i++)
+                            {
+                                std::memcpy(ctx.pixel(i, j).e, pixels, farm_pixel_size);
+                                pixels += farm_pixel_size;
+                            }
+                        }
+                        tiles[message.tile].seconds =
+                            std::chrono::duration<float>(clock::now() - issued[message.tile]).count();
+                        done[message.tile] = 1;
+                        remaining--;
+                    }
+                }
+                else
+                    bad = true;
+                from.input.erase(from.input.begin(), from.input.begin() + total);
+            }
+            if (bad)
+                drop(w);
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0)
+                workers.push_back(farm_detail::worker{fd, false, -1, {}});
+        }
+    }
+
+    farm_message stop = {farm_stop, -1, 0, 0, 0, 0, 0, 0};
+    for (auto &w : workers)
+    {
+        send_message(w.fd, stop);
+        close(w.fd);
+    }
+}
+
+// Renders the tiles the coordinator on `fd` hands out until it says stop,
+// splitting each tile's rows over `pool`. Returns false with a reason in
+// `error` if the connection failed or the coordinator refused this worker.
+bool farm_work(int fd, const render_context &ctx, uint64_t fingerprint, work_stealing_pool &pool,
+               int &tiles_done, std::string &error)
+{
+    using namespace farm_detail;
+
+    tiles_done = 0;
+    farm_settings settings = make_farm_settings(ctx, fingerprint);
+    farm_message hello = {farm_hello, -1, 0, 0, 0, 0, 0, sizeof(settings)};
+    if (!send_message(fd, hello, &settings))
+    {
+        error = "lost the coordinator";
+        return false;
+    }
+
+    std::vector<float> pixels;
+    while (true)
+    {
+        farm_message message;
+        if (!recv_all(fd, &message, sizeof(message)))
+        {
+            error = "lost the coordinator";
+            return false;
+        }
+        if (message.type == farm_stop)
+            return true;
+        if (message.type == farm_refused)
+        {
+            error = "the coordinator renders a different scene or different settings";
+            return false;
+        }
+        if (message.type != farm_job || message.kernel >= (uint32_t)num_sample_kernels ||
+            message.x0 < 0 || message.y0 < 0 || message.x1 > ctx.width || message.y1 > ctx.height ||
+            message.x0 >= message.x1 || message.y0 >= message.y1)
+        {
+            error = "bad message from the coordinator";
+            return false;
+        }
+
+        ray_function func = sample_kernels[message.kernel].func;
+        pool.run(message.y1 - message.y0, [&](int row, int)
+                 {
+                     for (int i = message.x0; i < message.x1; i++)
+                         func(ctx, i, message.y0 + row);
+                     flush_path_counters();
+                 });
+
+        // The coordinator only writes to a busy worker to stop it, which
+        // happens when another copy of this tile came in first
+        char next;
+        if (recv(fd, &next, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+            continue;
+
+        pixels.clear();
+        for (int j = message.y0; j < message.y1; j++)
+            for (int i = message.x0; i < message.x1; i++)
+                pixels.insert(pixels.end(), ctx.pixel(i, j).e, ctx.pixel(i, j).e + 3);
+        farm_message result = {farm_result, message.tile, message.x0, message.y0, message.x1, message.y1,
+                               message.kernel, (uint32_t)(pixels.size() * sizeof(float))};
+        if (!send_message(fd, result, pixels.data()))
+        {
+            error = "lost the coordinator";
+            return false;
+        }
+        tiles_done++;
+    }
+}
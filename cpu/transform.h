@@ -0,0 +1,140 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+#include <cmath>
+
+// Affine transform: a 3x3 linear part and a translation, stored as the top
+// three rows of a 4x4 matrix acting on column vectors.
+class affine
+{
+public:
+    // Identity
+    affine() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static affine translate(const vec3 &offset)
+    {
+        affine t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    static affine scale(float s)
+    {
+        affine t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = s;
+        return t;
+    }
+
+    // Rotation by `degrees` around `axis`, right-handed
+    static affine rotate(const vec3 &axis, float degrees);
+
+    point3 apply_point(const point3 &p) const
+    {
+        return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                      m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                      m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    vec3 apply_vector(const vec3 &v) const
+    {
+        return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                    m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                    m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    // Multiplies by the transpose of the linear part. Called on the inverse
+    // transform, this maps normals.
+    vec3 apply_transpose(const vec3 &n) const
+    {
+        return vec3(m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+                    m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+                    m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+    }
+
+    // Box around the transformed corners of `box`
+    aabb apply_box(const aabb &box) const;
+
+    affine inverse() const;
+
+public:
+    float m[3][4];
+};
+
+// Applies b first, then a
+inline affine operator*(const affine &a, const affine &b)
+{
+    affine c;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+            if (j == 3)
+                c.m[i][j] += a.m[i][3];
+        }
+    }
+    return c;
+}
+
+affine affine::rotate(const vec3 &axis, float degrees)
+{
+    vec3 a = unit_vector(axis);
+    float theta = degrees_to_radians(degrees);
+    float c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+
+    affine t;
+    t.m[0][0] = c + a.x() * a.x() * k;
+    t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+    t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+    t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+    t.m[1][1] = c + a.y() * a.y() * k;
+    t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+    t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+    t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+    t.m[2][2] = c + a.z() * a.z() * k;
+    return t;
+}
+
+aabb affine::apply_box(const aabb &box) const
+{
+    aabb out;
+    for (int corner = 0; corner < 8; corner++)
+    {
+        point3 p(corner & 1 ? box.max().x() : box.min().x(),
+                 corner & 2 ? box.max().y() : box.min().y(),
+                 corner & 4 ? box.max().z() : box.min().z());
+        out = surrounding_box(out, apply_point(p));
+    }
+    return out;
+}
+
+affine affine::inverse() const
+{
+    // Inverse of the linear part by cofactors, then undo the translation
+    float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    float inv_det = 1 / det;
+
+    affine inv;
+    inv.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    inv.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    inv.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    vec3 t = inv.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+    inv.m[0][3] = -t.x();
+    inv.m[1][3] = -t.y();
+    inv.m[2][3] = -t.z();
+    return inv;
+}
@@ -0,0 +1,481 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "packed_spheres.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Indexed triangle mesh with its own BVH, as one hittable.
+//
+// Vertex positions are shared between triangles and stored as three arrays,
+// one per coordinate. Each triangle is just its three corner indices, also
+// one array per corner, reordered so every BVH leaf covers a contiguous
+// range. That makes a triangle 12 bytes plus its share of the vertices, and
+// a leaf test gathers a whole register of triangles' corners at once: 16
+// with AVX-512, 8 with AVX2, one at a time in the scalar fallback.
+//
+// The ray-triangle test is the watertight one of Woop, Benthin and Wald
+// (JCGT 2013): corners are moved into a space where the ray runs along +z
+// from the origin, and the 2D edge functions decide the hit. Edges shared by
+// two triangles evaluate to exact negations of each other, so rays cannot
+// slip between them; that needs both products of an edge function rounded
+// on their own, so contraction into FMA is off for the leaf tests. Edge
+// functions that round to zero are redone in double precision.
+class triangle_mesh : public hittable
+{
+public:
+    static constexpr int lanes = packed_spheres::lanes;
+
+    triangle_mesh() {}
+    // indices holds three vertex indices per triangle. Every triangle uses
+    // material mat_id.
+    triangle_mesh(const std::vector<point3> &vertices, const std::vector<uint32_t> &indices,
+                  uint32_t mat_id, int max_prims_in_leaf = 4);
+
+    virtual bool hit(
+        const ray &r, float t_min, float t_max, hit_record &rec) const override;
+
+    virtual bool bounding_box(aabb &output_box) const override;
+
+    int triangle_count() const { return count; }
+    int vertex_count() const { return (int)vx.size(); }
+    // Bytes held by the vertex, index and node arrays
+    size_t memory_bytes() const;
+
+public:
+    std::vector<float> vx, vy, vz;
+    // Corners of triangle k are vertices i0[k], i1[k], i2[k], in leaf order.
+    // Followed by `lanes` triangles of vertex 0, which are degenerate and
+    // never hit, so a full-width load from any triangle stays in bounds.
+    std::vector<uint32_t> i0, i1, i2;
+    std::vector<bvh_node> nodes;
+    uint32_t mat_id = 0;
+
+private:
+    // A ray in the form the watertight test wants: the axis the ray is
+    // longest along becomes z, and the shear maps its direction to +z
+    struct sheared_ray
+    {
+        int kx, ky, kz;
+        float sx, sy, sz;
+    };
+    static sheared_ray shear(const ray &r);
+
+    // px * qy - py * qx in double, where the products are exact, for edge
+    // functions that rounded to zero in float
+    static float exact_edge(float px, float py, float qx, float qy)
+    {
+        return (float)((double)px * qy - (double)py * qx);
+    }
+
+    // Closest hit among triangles [first, first + n); on a hit lowers t_max
+    // to it and sets `index`
+    bool hit_range(const ray &r, const sheared_ray &s, int first, int n,
+                   float t_min, float &t_max, int &index) const;
+    void fill_record(const ray &r, int index, float t, hit_record &rec) const;
+
+    int count = 0;
+};
+
+triangle_mesh::triangle_mesh(const std::vector<point3> &vertices, const std::vector<uint32_t> &indices,
+                             uint32_t mat_id, int max_prims_in_leaf)
+    : mat_id(mat_id)
+{
+    vx.reserve(vertices.size());
+    vy.reserve(vertices.size());
+    vz.reserve(vertices.size());
+    for (const point3 &v : vertices)
+    {
+        vx.push_back(v.x());
+        vy.push_back(v.y());
+        vz.push_back(v.z());
+    }
+
+    int n = (int)(indices.size() / 3);
+    std::vector<bvh_build_prim> prims;
+    prims.reserve(n);
+    for (int k = 0; k < n; k++)
+    {
+        const point3 &a = vertices[indices[3 * k]];
+        const point3 &b = vertices[indices[3 * k + 1]];
+        const point3 &c = vertices[indices[3 * k + 2]];
+        aabb box = surrounding_box(surrounding_box(aabb(a, a), b), c);
+        prims.push_back({box, box.centroid(), k});
+    }
+
+    std::vector<int> order;
+    bvh_builder(max_prims_in_leaf, lanes).build(prims, nodes, order);
+
+    count = (int)order.size();
+    i0.reserve(count + lanes);
+    i1.reserve(count + lanes);
+    i2.reserve(count + lanes);
+    for (int k : order)
+    {
+        i0.push_back(indices[3 * k]);
+        i1.push_back(indices[3 * k + 1]);
+        i2.push_back(indices[3 * k + 2]);
+    }
+    i0.resize(count + lanes, 0);
+    i1.resize(count + lanes, 0);
+    i2.resize(count + lanes, 0);
+}
+
+size_t triangle_mesh::memory_bytes() const
+{
+    return (vx.size() + vy.size() + vz.size()) * sizeof(float) +
+           (i0.size() + i1.size() + i2.size()) * sizeof(uint32_t) + nodes.size() * sizeof(bvh_node);
+}
+
+triangle_mesh::sheared_ray triangle_mesh::shear(const ray &r)
+{
+    sheared_ray s;
+    vec3 d(std::fabs(r.dir.x()), std::fabs(r.dir.y()), std::fabs(r.dir.z()));
+    s.kz = d.x() > d.y() ? (d.x() > d.z() ? 0 : 2) : (d.y() > d.z() ? 1 : 2);
+    s.kx = (s.kz + 1) % 3;
+    s.ky = (s.kx + 1) % 3;
+    // Keep the winding, so the sign of the edge functions means the same
+    if (r.dir[s.kz] < 0)
+        std::swap(s.kx, s.ky);
+    s.sx = r.dir[s.kx] / r.dir[s.kz];
+    s.sy = r.dir[s.ky] / r.dir[s.kz];
+    s.sz = 1.0f / r.dir[s.kz];
+    return s;
+}
+
+bool triangle_mesh::hit(const ray &r, float t_min, float t_max, hit_record &rec) const
+{
+    if (nodes.empty())
+        return false;
+
+    sheared_ray s = shear(r);
+    int index = -1;
+    float closest = t_max;
+    bool hit_anything = traverse_bvh(nodes.data(), r, t_min, t_max, [&](int first, int n, float &t_far)
+                                     {
+                                         if (!hit_range(r, s, first, n, t_min, t_far, index))
+                                             return false;
+                                         closest = t_far;
+                                         return true; });
+    if (!hit_anything)
+        return false;
+    fill_record(r, index, closest, rec);
+    return true;
+}
+
+void triangle_mesh::fill_record(const ray &r, int index, float t, hit_record &rec) const
+{
+    point3 a(vx[i0[index]], vy[i0[index]], vz[i0[index]]);
+    point3 b(vx[i1[index]], vy[i1[index]], vz[i1[index]]);
+    point3 c(vx[i2[index]], vy[i2[index]], vz[i2[index]]);
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, unit_vector(cross(b - a, c - a)));
+    rec.mat_id = mat_id;
+}
+
+// Each edge function must be two rounded products and a rounded difference
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#if defined(__AVX512F__)
+
+bool triangle_mesh::hit_range(const ray &r, const sheared_ray &s, int first, int n,
+                              float t_min, float &t_max, int &index) const
+{
+    const float *coords[3] = {vx.data(), vy.data(), vz.data()};
+    const float *px = coords[s.kx], *py = coords[s.ky], *pz = coords[s.kz];
+    const __m512 ox = _mm512_set1_ps(r.orig[s.kx]);
+    const __m512 oy = _mm512_set1_ps(r.orig[s.ky]);
+    const __m512 oz = _mm512_set1_ps(r.orig[s.kz]);
+    const __m512 sx = _mm512_set1_ps(s.sx);
+    const __m512 sy = _mm512_set1_ps(s.sy);
+    const __m512 sz = _mm512_set1_ps(s.sz);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 t_lo = _mm512_set1_ps(t_min);
+    const __m512i sign_bit = _mm512_set1_epi32(0x80000000);
+    const __m512i lane_ids = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    // Per-lane closest hit so far; reduced across lanes once at the end
+    __m512 best_t = _mm512_set1_ps(t_max);
+    __m512i best_index = _mm512_set1_epi32(-1);
+
+    // Corner relative to the ray origin, sheared so the ray runs along +z
+    auto corner = [&](const uint32_t *indices, int i, __m512 &x, __m512 &y, __m512 &z)
+    {
+        __m512i idx = _mm512_loadu_si512(indices + i);
+        z = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, 0xFFFF, idx, pz, 4), oz);
+        x = _mm512_fnmadd_ps(sx, z, _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, 0xFFFF, idx, px, 4), ox));
+        y = _mm512_fnmadd_ps(sy, z, _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, 0xFFFF, idx, py, 4), oy));
+        z = _mm512_mul_ps(sz, z);
+    };
+
+    const int end = first + n;
+    for (int i = first; i < end; i += lanes)
+    {
+        __mmask16 active = _mm512_cmplt_epi32_mask(lane_ids, _mm512_set1_epi32(end - i));
+
+        __m512 ax, ay, az, bx, by, bz, cx, cy, cz;
+        corner(i0.data(), i, ax, ay, az);
+        corner(i1.data(), i, bx, by, bz);
+        corner(i2.data(), i, cx, cy, cz);
+
+        __m512 u = _mm512_sub_ps(_mm512_mul_ps(cx, by), _mm512_mul_ps(cy, bx));
+        __m512 v = _mm512_sub_ps(_mm512_mul_ps(ax, cy), _mm512_mul_ps(ay, cx));
+        __m512 w = _mm512_sub_ps(_mm512_mul_ps(bx, ay), _mm512_mul_ps(by, ax));
+
+        __mmask16 tie = active & (_mm512_cmp_ps_mask(u, zero, _CMP_EQ_OQ) | _mm512_cmp_ps_mask(v, zero, _CMP_EQ_OQ) |
+                                  _mm512_cmp_ps_mask(w, zero, _CMP_EQ_OQ));
+        if (tie)
+        {
+            alignas(64) float e[9][lanes];
+            const __m512 in[9] = {ax, ay, bx, by, cx, cy, u, v, w};
+            for (int j = 0; j < 9; j++)
+                _mm512_store_ps(e[j], in[j]);
+            for (int k = 0; k < lanes; k++)
+                if (tie >> k & 1)
+                {
+                    e[6][k] = exact_edge(e[4][k], e[5][k], e[2][k], e[3][k]);
+                    e[7][k] = exact_edge(e[0][k], e[1][k], e[4][k], e[5][k]);
+                    e[8][k] = exact_edge(e[2][k], e[3][k], e[0][k], e[1][k]);
+                }
+            u = _mm512_load_ps(e[6]);
+            v = _mm512_load_ps(e[7]);
+            w = _mm512_load_ps(e[8]);
+        }
+
+        // Inside when the edge functions do not have mixed signs
+        __mmask16 negative = _mm512_cmp_ps_mask(u, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ) |
+                             _mm512_cmp_ps_mask(w, zero, _CMP_LT_OQ);
+        __mmask16 positive = _mm512_cmp_ps_mask(u, zero, _CMP_GT_OQ) | _mm512_cmp_ps_mask(v, zero, _CMP_GT_OQ) |
+                             _mm512_cmp_ps_mask(w, zero, _CMP_GT_OQ);
+        __m512 det = _mm512_add_ps(u, _mm512_add_ps(v, w));
+        active &= ~(negative & positive) & _mm512_cmp_ps_mask(det, zero, _CMP_NEQ_OQ);
+        if (!active)
+            continue;
+
+        // Scaled distance, with the sign of det moved onto it
+        __m512 t_scaled = _mm512_fmadd_ps(u, az, _mm512_fmadd_ps(v, bz, _mm512_mul_ps(w, cz)));
+        __m512i det_sign = _mm512_and_si512(_mm512_castps_si512(det), sign_bit);
+        t_scaled = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(t_scaled), det_sign));
+        __m512 abs_det = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(det), det_sign));
+
+        __mmask16 hit = _mm512_mask_cmp_ps_mask(active, t_scaled, _mm512_mul_ps(t_lo, abs_det), _CMP_GE_OQ) &
+                        _mm512_cmp_ps_mask(t_scaled, _mm512_mul_ps(best_t, abs_det), _CMP_LE_OQ);
+        if (!hit)
+            continue;
+
+        best_t = _mm512_mask_div_ps(best_t, hit, t_scaled, abs_det);
+        best_index = _mm512_mask_blend_epi32(hit, best_index, _mm512_add_epi32(lane_ids, _mm512_set1_epi32(i)));
+    }
+
+    __mmask16 found = _mm512_cmpneq_epi32_mask(best_index, _mm512_set1_epi32(-1));
+    if (!found)
+        return false;
+
+    // Horizontal min of the lanes that found something. The masked forms
+    // give every step a real source; GCC's unmasked ones start from an
+    // uninitialized vector, which -Wall reports once this is inlined.
+    __m512 t = _mm512_mask_blend_ps(found, _mm512_set1_ps(infinity), best_t);
+    __m512 m = _mm512_mask_min_ps(t, 0xFFFF, t, _mm512_mask_shuffle_f32x4(t, 0xFFFF, t, t, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_shuffle_f32x4(m, 0xFFFF, m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_permute_ps(m, 0xFFFF, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm512_mask_min_ps(m, 0xFFFF, m, _mm512_mask_permute_ps(m, 0xFFFF, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    float closest = _mm512_cvtss_f32(m);
+    __mmask16 winner = found & _mm512_cmp_ps_mask(t, m, _CMP_EQ_OQ);
+    alignas(64) int32_t indices[16];
+    _mm512_store_si512(indices, best_index);
+    index = indices[__builtin_ctz(winner)];
+    t_max = closest;
+    return true;
+}
+
+#elif defined(__AVX2__)
+
+bool triangle_mesh::hit_range(const ray &r, const sheared_ray &s, int first, int n,
+                              float t_min, float &t_max, int &index) const
+{
+    const float *coords[3] = {vx.data(), vy.data(), vz.data()};
+    const float *px = coords[s.kx], *py = coords[s.ky], *pz = coords[s.kz];
+    const __m256 ox = _mm256_set1_ps(r.orig[s.kx]);
+    const __m256 oy = _mm256_set1_ps(r.orig[s.ky]);
+    const __m256 oz = _mm256_set1_ps(r.orig[s.kz]);
+    const __m256 sx = _mm256_set1_ps(s.sx);
+    const __m256 sy = _mm256_set1_ps(s.sy);
+    const __m256 sz = _mm256_set1_ps(s.sz);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 t_lo = _mm256_set1_ps(t_min);
+    const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+    const __m256i lane_ids = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+    // Per-lane closest hit so far; reduced across lanes once at the end
+    __m256 best_t = _mm256_set1_ps(t_max);
+    __m256i best_index = _mm256_set1_epi32(-1);
+
+    // Corner relative to the ray origin, sheared so the ray runs along +z
+    auto corner = [&](const uint32_t *indices, int i, __m256 &x, __m256 &y, __m256 &z)
+    {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)(indices + i));
+        z = _mm256_sub_ps(_mm256_i32gather_ps(pz, idx, 4), oz);
+        x = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(px, idx, 4), ox), _mm256_mul_ps(sx, z));
+        y = _mm256_sub_ps(_mm256_sub_ps(_mm256_i32gather_ps(py, idx, 4), oy), _mm256_mul_ps(sy, z));
+        z = _mm256_mul_ps(sz, z);
+    };
+
+    const int end = first + n;
+    for (int i = first; i < end; i += lanes)
+    {
+        __m256 active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(end - i), lane_ids));
+
+        __m256 ax, ay, az, bx, by, bz, cx, cy, cz;
+        corner(i0.data(), i, ax, ay, az);
+        corner(i1.data(), i, bx, by, bz);
+        corner(i2.data(), i, cx, cy, cz);
+
+        __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+        __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+        __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+        __m256 tie = _mm256_and_ps(active, _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)),
+                                                        _mm256_cmp_ps(w, zero, _CMP_EQ_OQ)));
+        if (!_mm256_testz_ps(tie, tie))
+        {
+            alignas(32) float e[9][lanes];
+            const __m256 in[9] = {ax, ay, bx, by, cx, cy, u, v, w};
+            for (int j = 0; j < 9; j++)
+                _mm256_store_ps(e[j], in[j]);
+            int ties = _mm256_movemask_ps(tie);
+            for (int k = 0; k < lanes; k++)
+                if (ties >> k & 1)
+                {
+                    e[6][k] = exact_edge(e[4][k], e[5][k], e[2][k], e[3][k]);
+                    e[7][k] = exact_edge(e[0][k], e[1][k], e[4][k], e[5][k]);
+                    e[8][k] = exact_edge(e[2][k], e[3][k], e[0][k], e[1][k]);
+                }
+            u = _mm256_load_ps(e[6]);
+            v = _mm256_load_ps(e[7]);
+            w = _mm256_load_ps(e[8]);
+        }
+
+        // Inside when the edge functions do not have mixed signs
+        __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                                       _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+        __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)),
+                                       _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+        __m256 det = _mm256_add_ps(u, _mm256_add_ps(v, w));
+        active = _mm256_andnot_ps(_mm256_and_ps(negative, positive), active);
+        active = _mm256_and_ps(active, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+        if (_mm256_testz_ps(active, active))
+            continue;
+
+        // Scaled distance, with the sign of det moved onto it
+        __m256 t_scaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, az), _mm256_mul_ps(v, bz)), _mm256_mul_ps(w, cz));
+        __m256 det_sign = _mm256_and_ps(det, sign_bit);
+        t_scaled = _mm256_xor_ps(t_scaled, det_sign);
+        __m256 abs_det = _mm256_xor_ps(det, det_sign);
+
+        __m256 hit = _mm256_and_ps(active, _mm256_and_ps(_mm256_cmp_ps(t_scaled, _mm256_mul_ps(t_lo, abs_det), _CMP_GE_OQ),
+                                                         _mm256_cmp_ps(t_scaled, _mm256_mul_ps(best_t, abs_det), _CMP_LE_OQ)));
+        if (_mm256_testz_ps(hit, hit))
+            continue;
+
+        best_t = _mm256_blendv_ps(best_t, _mm256_div_ps(t_scaled, abs_det), hit);
+        best_index = _mm256_castps_si256(_mm256_blendv_ps(
+            _mm256_castsi256_ps(best_index),
+            _mm256_castsi256_ps(_mm256_add_epi32(lane_ids, _mm256_set1_epi32(i))),
+            hit));
+    }
+
+    __m256 found = _mm256_castsi256_ps(_mm256_cmpgt_epi32(best_index, _mm256_set1_epi32(-1)));
+    if (_mm256_testz_ps(found, found))
+        return false;
+
+    // Horizontal min of the lanes that found something
+    __m256 t = _mm256_blendv_ps(_mm256_set1_ps(infinity), best_t, found);
+    __m256 m = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    int winner = _mm256_movemask_ps(_mm256_and_ps(found, _mm256_cmp_ps(t, m, _CMP_EQ_OQ)));
+    alignas(32) int32_t indices[8];
+    _mm256_store_si256((__m256i *)indices, best_index);
+    index = indices[__builtin_ctz(winner)];
+    t_max = _mm256_cvtss_f32(m);
+    return true;
+}
+
+#else
+
+bool triangle_mesh::hit_range(const ray &r, const sheared_ray &s, int first, int n,
+                              float t_min, float &t_max, int &index) const
+{
+    const float *coords[3] = {vx.data(), vy.data(), vz.data()};
+    const float *px = coords[s.kx], *py = coords[s.ky], *pz = coords[s.kz];
+    const float ox = r.orig[s.kx], oy = r.orig[s.ky], oz = r.orig[s.kz];
+    bool hit_anything = false;
+
+    for (int i = first; i < first + n; i++)
+    {
+        // Corners relative to the ray origin, sheared so the ray runs along +z
+        float az = pz[i0[i]] - oz, bz = pz[i1[i]] - oz, cz = pz[i2[i]] - oz;
+        float ax = px[i0[i]] - ox - s.sx * az, ay = py[i0[i]] - oy - s.sy * az;
+        float bx = px[i1[i]] - ox - s.sx * bz, by = py[i1[i]] - oy - s.sy * bz;
+        float cx = px[i2[i]] - ox - s.sx * cz, cy = py[i2[i]] - oy - s.sy * cz;
+
+        float u = cx * by - cy * bx;
+        float v = ax * cy - ay * cx;
+        float w = bx * ay - by * ax;
+        if (u == 0 || v == 0 || w == 0)
+        {
+            u = exact_edge(cx, cy, bx, by);
+            v = exact_edge(ax, ay, cx, cy);
+            w = exact_edge(bx, by, ax, ay);
+        }
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            continue;
+        float det = u + v + w;
+        if (det == 0)
+            continue;
+
+        float t_scaled = s.sz * (u * az + v * bz + w * cz);
+        float t = t_scaled / det;
+        if (t < t_min || t_max < t)
+            continue;
+        t_max = t;
+        index = i;
+        hit_anything = true;
+    }
+    return hit_anything;
+}
+
+#endif
+
+#if defined(__clang__)
+#pragma clang fp contract(on)
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+bool triangle_mesh::bounding_box(aabb &output_box) const
+{
+    if (nodes.empty())
+        return false;
+    output_box = nodes[0].bounds();
+    return true;
+}
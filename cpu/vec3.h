@@ -3,35 +3,93 @@
 #include <cmath>
 #include <iostream>
 
+#include "rng.h"
+
+// vec3 is three floats padded to one 16-byte vector. With SSE or NEON the
+// arithmetic runs on all four lanes in one instruction; define VEC3_SCALAR,
+// or build for a target with neither, to get plain per-component code. The
+// fourth lane is padding: operations may leave anything in it, and nothing
+// that produces a scalar (dot, length, comparisons) ever reads it.
+#if !defined(VEC3_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC3_SSE 1
+#elif !defined(VEC3_SCALAR) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC3_NEON 1
+#endif
+
 using std::sqrt;
 
-class vec3
+namespace vec3_detail
+{
+#if defined(VEC3_SSE)
+    typedef __m128 lanes;
+    inline lanes load(const float *p) { return _mm_load_ps(p); }
+    inline void store(float *p, lanes v) { _mm_store_ps(p, v); }
+    inline lanes splat(float t) { return _mm_set1_ps(t); }
+    inline lanes add(lanes a, lanes b) { return _mm_add_ps(a, b); }
+    inline lanes sub(lanes a, lanes b) { return _mm_sub_ps(a, b); }
+    inline lanes mul(lanes a, lanes b) { return _mm_mul_ps(a, b); }
+    inline lanes neg(lanes a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+#elif defined(VEC3_NEON)
+    typedef float32x4_t lanes;
+    inline lanes load(const float *p) { return vld1q_f32(p); }
+    inline void store(float *p, lanes v) { vst1q_f32(p, v); }
+    inline lanes splat(float t) { return vdupq_n_f32(t); }
+    inline lanes add(lanes a, lanes b) { return vaddq_f32(a, b); }
+    inline lanes sub(lanes a, lanes b) { return vsubq_f32(a, b); }
+    inline lanes mul(lanes a, lanes b) { return vmulq_f32(a, b); }
+    inline lanes neg(lanes a) { return vnegq_f32(a); }
+#endif
+}
+
+class alignas(16) vec3
 {
 public:
-    vec3() : e{0, 0, 0} {}
-    vec3(float e0, float e1, float e2) : e{e0, e1, e2} {}
+    vec3() : e{0, 0, 0, 0} {}
+    vec3(float e0, float e1, float e2) : e{e0, e1, e2, 0} {}
+
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+    explicit vec3(vec3_detail::lanes v) { vec3_detail::store(e, v); }
+    vec3_detail::lanes lanes() const { return vec3_detail::load(e); }
+#endif
 
     float x() const { return e[0]; }
     float y() const { return e[1]; }
     float z() const { return e[2]; }
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+    vec3 operator-() const
+    {
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+        return vec3(vec3_detail::neg(lanes()));
+#else
+        return vec3(-e[0], -e[1], -e[2]);
+#endif
+    }
     float operator[](int i) const { return e[i]; }
     float &operator[](int i) { return e[i]; }
 
     vec3 &operator+=(const vec3 &v)
     {
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+        vec3_detail::store(e, vec3_detail::add(lanes(), v.lanes()));
+#else
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
+#endif
         return *this;
     }
 
     vec3 &operator*=(const float t)
     {
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+        vec3_detail::store(e, vec3_detail::mul(lanes(), vec3_detail::splat(t)));
+#else
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
+#endif
         return *this;
     }
 
@@ -59,49 +117,55 @@ public:
     {
         return vec3(random_float(min, max), random_float(min, max), random_float(min, max));
     }
+
+    inline static vec3 random(rng &rand, float min, float max)
+    {
+        return vec3(rand.next_float(min, max), rand.next_float(min, max), rand.next_float(min, max));
+    }
     bool near_zero() const
     {
         // Return true if the vector is close to zero in all dimensions.
-        const auto s = 1e-8;
-        return (fabs(e[0]) < s) && (fabs(e[1]) < s) && (fabs(e[2]) < s);
+        const float s = 1e-8f;
+        return (std::fabs(e[0]) < s) & (std::fabs(e[1]) < s) & (std::fabs(e[2]) < s);
     }
 
 public:
-    float e[3];
+    float e[4]; // e[3] is padding
 };
 
 // Type aliases for vec3
 using point3 = vec3; // 3D point
 using color = vec3;  // RGB color
 
-// vec3 Utility Functions
+inline std::ostream &operator<<(std::ostream &out, const vec3 &v)
+{
+    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+}
 
-inline vec3 unit_vector(vec3 v)
+#if defined(VEC3_SSE) || defined(VEC3_NEON)
+
+inline vec3 operator+(const vec3 &u, const vec3 &v)
 {
-    return vec3(v[0] / v.length(), v[1] / v.length(), v[2] / v.length());
+    return vec3(vec3_detail::add(u.lanes(), v.lanes()));
 }
 
-vec3 random_in_unit_sphere()
+inline vec3 operator-(const vec3 &u, const vec3 &v)
 {
-    while (true)
-    {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1)
-            continue;
-        return p;
-    }
+    return vec3(vec3_detail::sub(u.lanes(), v.lanes()));
 }
 
-vec3 random_unit_vector()
+inline vec3 operator*(const vec3 &u, const vec3 &v)
 {
-    return unit_vector(random_in_unit_sphere());
+    return vec3(vec3_detail::mul(u.lanes(), v.lanes()));
 }
 
-inline std::ostream &operator<<(std::ostream &out, const vec3 &v)
+inline vec3 operator*(float t, const vec3 &v)
 {
-    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+    return vec3(vec3_detail::mul(vec3_detail::splat(t), v.lanes()));
 }
 
+#else
+
 inline vec3 operator+(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
@@ -122,6 +186,8 @@ inline vec3 operator*(float t, const vec3 &v)
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
+#endif
+
 inline vec3 operator*(const vec3 &v, float t)
 {
     return t * v;
@@ -132,16 +198,98 @@ inline vec3 operator/(vec3 v, float t)
     return (1 / t) * v;
 }
 
+// Summed as (x + y) + z in every build, so the SIMD and scalar versions agree
 inline float dot(const vec3 &u, const vec3 &v)
 {
+#if defined(VEC3_SSE)
+    __m128 m = _mm_mul_ps(u.lanes(), v.lanes());
+    __m128 y = _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+    __m128 z = _mm_movehl_ps(m, m);
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(m, y), z));
+#elif defined(VEC3_NEON)
+    float32x4_t m = vmulq_f32(u.lanes(), v.lanes());
+    return (vgetq_lane_f32(m, 0) + vgetq_lane_f32(m, 1)) + vgetq_lane_f32(m, 2);
+#else
     return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+#endif
 }
 
 inline vec3 cross(const vec3 &u, const vec3 &v)
 {
+#if defined(VEC3_SSE)
+    // u.yzx * v.zxy - u.zxy * v.yzx
+    __m128 a = u.lanes(), b = v.lanes();
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, b_yzx), _mm_mul_ps(a_yzx, b));
+    return vec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+#else
     return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+#endif
+}
+
+// 1 / sqrt(x): the hardware estimate refined by Newton-Raphson to within a
+// few ulp, without a divide or a square root
+inline float reciprocal_sqrt(float x)
+{
+#if defined(VEC3_SSE)
+    __m128 v = _mm_set_ss(x);
+    __m128 r = _mm_rsqrt_ss(v); // 12 bits
+    __m128 half_v_rr = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), v), _mm_mul_ss(r, r));
+    return _mm_cvtss_f32(_mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(1.5f), half_v_rr)));
+#elif defined(VEC3_NEON)
+    float32x2_t v = vdup_n_f32(x);
+    float32x2_t r = vrsqrte_f32(v); // 8 bits, so two steps
+    r = vmul_f32(r, vrsqrts_f32(vmul_f32(v, r), r));
+    r = vmul_f32(r, vrsqrts_f32(vmul_f32(v, r), r));
+    return vget_lane_f32(r, 0);
+#else
+    return 1 / std::sqrt(x);
+#endif
+}
+
+inline vec3 unit_vector(vec3 v)
+{
+    return v * reciprocal_sqrt(dot(v, v));
+}
+
+// The sampling functions below map a fixed number of draws directly onto
+// their domain instead of rejection sampling, so every draw lands in the
+// same dimension of the sample pattern. They have no data-dependent branches
+// and use float math only.
+
+// Uniform on the unit sphere surface, from two draws
+vec3 random_unit_vector(rng &rand)
+{
+    float z = 1 - 2 * rand.next_float();
+    float r = std::sqrt(std::fmax(0.0f, 1 - z * z));
+    float phi = 6.28318530718f * rand.next_float();
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Uniform in the unit ball, from three draws
+vec3 random_in_unit_sphere(rng &rand)
+{
+    vec3 direction = random_unit_vector(rand);
+    return std::cbrt(rand.next_float()) * direction;
+}
+
+// Uniform in the unit disk, from two draws, with Shirley and Chiu's
+// concentric mapping so the square's stratification carries over. Both
+// wedges are computed as selects; a = b = 0 gives r = 0 and so the centre.
+vec3 random_in_unit_disk(rng &rand)
+{
+    float a = 2 * rand.next_float() - 1;
+    float b = 2 * rand.next_float() - 1;
+
+    const float quarter_pi = 0.785398163397f;
+    bool wide = std::fabs(a) > std::fabs(b);
+    float r = wide ? a : b;
+    float ratio = (wide ? b : a) / (r != 0 ? r : 1.0f);
+    float phi = wide ? quarter_pi * ratio : 2 * quarter_pi - quarter_pi * ratio;
+    return vec3(r * std::cos(phi), r * std::sin(phi), 0);
 }
 
 vec3 reflect(const vec3 &v, const vec3 &n)
@@ -151,19 +299,8 @@ vec3 reflect(const vec3 &v, const vec3 &n)
 
 vec3 refract(const vec3 &uv, const vec3 &n, float etai_over_etat)
 {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+    float cos_theta = std::fmin(-dot(uv, n), 1.0f);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+    vec3 r_out_parallel = -std::sqrt(std::fabs(1.0f - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
-
-vec3 random_in_unit_disk()
-{
-    while (true)
-    {
-        auto p = vec3(random_float(-1, 1), random_float(-1, 1), 0);
-        if (p.length_squared() >= 1)
-            continue;
-        return p;
-    }
-}
@@ -0,0 +1,213 @@
+/*
+    vec3 precision check
+
+    Compares the vec3 math layer, SIMD or scalar depending on the build,
+    against the scalar formulas it replaced evaluated in double precision:
+    dot, cross, unit_vector, reflect and refract on random vectors, and the
+    three sampling functions on the same rng draws. Reports the largest
+    absolute and relative error and the largest error in float ulps for each,
+    and fails if one is past its tolerance.
+
+    Build: g++ -O3 -march=native -o vec3_check vec3_check.cc
+           g++ -O3 -DVEC3_SCALAR -o vec3_check_scalar vec3_check.cc
+    Usage: ./vec3_check [--count N]
+*/
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+#include "rtweekend.h"
+
+const int DEFAULT_COUNT = 1000000;
+
+/* Double precision vector for the reference results */
+struct dvec
+{
+    double x, y, z;
+};
+
+dvec widen(const vec3 &v) { return {v.x(), v.y(), v.z()}; }
+double ref_dot(dvec a, dvec b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+dvec ref_scale(double t, dvec a) { return {t * a.x, t * a.y, t * a.z}; }
+dvec ref_add(dvec a, dvec b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+dvec ref_sub(dvec a, dvec b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+
+dvec ref_cross(dvec u, dvec v)
+{
+    return {u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x};
+}
+
+dvec ref_unit_vector(dvec v) { return ref_scale(1 / std::sqrt(ref_dot(v, v)), v); }
+dvec ref_reflect(dvec v, dvec n) { return ref_sub(v, ref_scale(2 * ref_dot(v, n), n)); }
+
+dvec ref_refract(dvec uv, dvec n, double etai_over_etat)
+{
+    double cos_theta = std::fmin(-ref_dot(uv, n), 1.0);
+    dvec r_out_perp = ref_scale(etai_over_etat, ref_add(uv, ref_scale(cos_theta, n)));
+    dvec r_out_parallel = ref_scale(-std::sqrt(std::fabs(1.0 - ref_dot(r_out_perp, r_out_perp))), n);
+    return ref_add(r_out_perp, r_out_parallel);
+}
+
+/* The sampling functions as they were before, on the same draws */
+dvec ref_unit_sphere_surface(rng &rand)
+{
+    double z = 1 - 2 * (double)rand.next_float();
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * (double)rand.next_float();
+    return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+dvec ref_unit_ball(rng &rand)
+{
+    dvec direction = ref_unit_sphere_surface(rand);
+    return ref_scale(std::cbrt((double)rand.next_float()), direction);
+}
+
+dvec ref_unit_disk(rng &rand)
+{
+    double a = 2 * (double)rand.next_float() - 1;
+    double b = 2 * (double)rand.next_float() - 1;
+    if (a == 0 && b == 0)
+        return {0, 0, 0};
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b))
+    {
+        r = a;
+        phi = pi / 4 * (b / a);
+    }
+    else
+    {
+        r = b;
+        phi = pi / 2 - pi / 4 * (a / b);
+    }
+    return {r * std::cos(phi), r * std::sin(phi), 0};
+}
+
+/* Largest errors seen by one check */
+struct error_stats
+{
+    string name;
+    double tolerance; // on max_rel
+    double max_abs = 0, max_rel = 0, max_ulp = 0;
+
+    void add(double got, double want, double magnitude)
+    {
+        double abs = std::fabs(got - want);
+        max_abs = std::fmax(max_abs, abs);
+        if (magnitude > 0)
+            max_rel = std::fmax(max_rel, abs / magnitude);
+        // One ulp of a float the size of the reference's largest component
+        double ulp = std::ldexp(1.0, std::ilogb(std::fmax(magnitude, 1e-30)) - 23);
+        max_ulp = std::fmax(max_ulp, abs / ulp);
+    }
+
+    void add(const vec3 &got, dvec want)
+    {
+        add(got, want, std::fmax(std::fabs(want.x), std::fmax(std::fabs(want.y), std::fabs(want.z))));
+    }
+
+    void add(const vec3 &got, dvec want, double magnitude)
+    {
+        add(got.x(), want.x, magnitude);
+        add(got.y(), want.y, magnitude);
+        add(got.z(), want.z, magnitude);
+    }
+
+    bool passed() const { return max_rel <= tolerance; }
+};
+
+int main(int argc, char **argv)
+{
+    int count = DEFAULT_COUNT;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--count") && i + 1 < argc)
+            count = std::atoi(argv[++i]);
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--count N]" << endl;
+            return 2;
+        }
+    }
+
+#if defined(VEC3_SSE)
+    cout << "vec3 backend: SSE" << endl;
+#elif defined(VEC3_NEON)
+    cout << "vec3 backend: NEON" << endl;
+#else
+    cout << "vec3 backend: scalar" << endl;
+#endif
+
+    /* Relative to the largest component of the reference. The arithmetic
+       checks allow a few float roundings; the sampling functions also take
+       sin and cos of an angle rounded to float. */
+    error_stats dot_error{"dot", 1e-6}, cross_error{"cross", 1e-6}, unit_error{"unit_vector", 1e-6},
+        length_error{"|unit_vector| - 1", 1e-6}, reflect_error{"reflect", 1e-6},
+        refract_error{"refract", 1e-6}, surface_error{"random_unit_vector", 1e-5},
+        ball_error{"random_in_unit_sphere", 1e-5}, disk_error{"random_in_unit_disk", 1e-5};
+    int out_of_range = 0;
+
+    rng inputs(0x5eed, 0);
+    for (int i = 0; i < count; i++)
+    {
+        vec3 a = vec3::random(inputs, -100, 100);
+        vec3 b = vec3::random(inputs, -1, 1);
+        dvec da = widen(a), db = widen(b);
+
+        double want_dot = ref_dot(da, db);
+        double dot_magnitude = std::fabs(da.x * db.x) + std::fabs(da.y * db.y) + std::fabs(da.z * db.z);
+        dot_error.add(dot(a, b), want_dot, dot_magnitude);
+        /* Components of a cross product cancel, so its error is measured
+           against |a| |b| rather than the result */
+        cross_error.add(cross(a, b), ref_cross(da, db), std::sqrt(ref_dot(da, da) * ref_dot(db, db)));
+
+        if (b.near_zero())
+            continue;
+        vec3 n = unit_vector(b);
+        unit_error.add(n, ref_unit_vector(db));
+        length_error.add(std::sqrt((double)dot(n, n)), 1.0, 1.0);
+
+        /* Unit incoming direction, as the materials use them */
+        vec3 v = unit_vector(a);
+        dvec dv = widen(v), dn = widen(n);
+        reflect_error.add(reflect(v, n), ref_reflect(dv, dn));
+        float eta = inputs.next_float(0.5f, 1.0f);
+        if (eta * eta * (1 - std::pow(ref_dot(dv, dn), 2)) < 0.9) // not close to total internal reflection
+            refract_error.add(refract(v, n, eta), ref_refract(dv, dn, eta));
+
+        rng draws(i, 1), same_draws(i, 1);
+        vec3 s = random_unit_vector(draws);
+        surface_error.add(s, ref_unit_sphere_surface(same_draws));
+        vec3 ball = random_in_unit_sphere(draws);
+        ball_error.add(ball, ref_unit_ball(same_draws));
+        vec3 disk = random_in_unit_disk(draws);
+        disk_error.add(disk, ref_unit_disk(same_draws));
+        out_of_range += ball.length_squared() > 1.0f + 1e-5f || disk.length_squared() > 1.0f + 1e-5f ||
+                        disk.z() != 0 || std::fabs(s.length_squared() - 1) > 1e-5f;
+    }
+
+    const error_stats *all[] = {&dot_error, &cross_error, &unit_error, &length_error, &reflect_error,
+                                &refract_error, &surface_error, &ball_error, &disk_error};
+    cout << std::left << std::setw(24) << "function" << std::right << std::setw(14) << "max abs"
+         << std::setw(14) << "max rel" << std::setw(10) << "max ulp" << std::setw(12) << "tolerance" << endl;
+    bool ok = out_of_range == 0;
+    for (const error_stats *e : all)
+    {
+        cout << std::left << std::setw(24) << e->name << std::right << std::scientific << std::setprecision(3)
+             << std::setw(14) << e->max_abs << std::setw(14) << e->max_rel << std::fixed << std::setprecision(1)
+             << std::setw(10) << e->max_ulp << std::scientific << std::setprecision(0) << std::setw(12)
+             << e->tolerance << (e->passed() ? "" : "  FAILED") << endl;
+        ok = ok && e->passed();
+    }
+    cout << count << " inputs, " << out_of_range << " samples outside their domain" << endl;
+    cout << (ok ? "passed" : "FAILED") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable.h"
+#include "integrator.h"
+#include "material.h"
+#include "scheduler.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Structure-of-arrays batch of path segments waiting to be traced
+struct ray_queue
+{
+    std::vector<float> ox, oy, oz;
+    std::vector<float> dx, dy, dz;
+    std::vector<float> tr, tg, tb; // path throughput
+    std::vector<uint32_t> path;    // index into the renderer's path table
+
+    size_t size() const { return path.size(); }
+
+    void clear()
+    {
+        ox.clear(), oy.clear(), oz.clear();
+        dx.clear(), dy.clear(), dz.clear();
+        tr.clear(), tg.clear(), tb.clear();
+        path.clear();
+    }
+
+    void push(const ray &r, const color &throughput, uint32_t p)
+    {
+        ox.push_back(r.orig.x()), oy.push_back(r.orig.y()), oz.push_back(r.orig.z());
+        dx.push_back(r.dir.x()), dy.push_back(r.dir.y()), dz.push_back(r.dir.z());
+        tr.push_back(throughput.x()), tg.push_back(throughput.y()), tb.push_back(throughput.z());
+        path.push_back(p);
+    }
+
+    ray get_ray(size_t i) const
+    {
+        return ray(point3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]));
+    }
+
+    color throughput(size_t i) const { return color(tr[i], tg[i], tb[i]); }
+};
+
+// Structure-of-arrays batch of hits on one material type waiting to be shaded
+struct hit_queue
+{
+    std::vector<float> px, py, pz; // hit point
+    std::vector<float> nx, ny, nz; // normal, facing the incoming ray
+    std::vector<float> dx, dy, dz; // incoming direction
+    std::vector<float> tr, tg, tb; // path throughput
+    std::vector<uint8_t> front_face;
+    std::vector<uint32_t> mat;
+    std::vector<uint32_t> path;
+
+    size_t size() const { return path.size(); }
+
+    void clear()
+    {
+        px.clear(), py.clear(), pz.clear();
+        nx.clear(), ny.clear(), nz.clear();
+        dx.clear(), dy.clear(), dz.clear();
+        tr.clear(), tg.clear(), tb.clear();
+        front_face.clear(), mat.clear(), path.clear();
+    }
+
+    void push(const hit_record &rec, const vec3 &dir, const color &throughput, uint32_t p)
+    {
+        px.push_back(rec.p.x()), py.push_back(rec.p.y()), pz.push_back(rec.p.z());
+        nx.push_back(rec.normal.x()), ny.push_back(rec.normal.y()), nz.push_back(rec.normal.z());
+        dx.push_back(dir.x()), dy.push_back(dir.y()), dz.push_back(dir.z());
+        tr.push_back(throughput.x()), tg.push_back(throughput.y()), tb.push_back(throughput.z());
+        front_face.push_back(rec.front_face);
+        mat.push_back(rec.mat_id);
+        path.push_back(p);
+    }
+};
+
+// Streaming path tracer. Instead of following one path to the end, it keeps
+// every path of a tile (all pixels x all samples) in flight and advances
+// them one bounce at a time through separate stages:
+//
+//   generate  -> camera rays for every pixel and sample of the tile
+//   intersect -> closest hit for every queued ray; misses pick up the sky,
+//                hits are queued by material type
+//   shade     -> one tight loop per material type, writing surviving rays
+//                into the next queue, which compacts out terminated paths
+//
+// Because the next queue is filled one material at a time, rays leaving the
+// same kind of surface stay together for the following bounce. Draws come
+// from the same (pixel, sample, bounce) rng streams as ray_color, so the
+// result matches the per-pixel kernels.
+//
+// One instance per worker thread; the queues are reused between tiles.
+class wavefront_renderer
+{
+public:
+    wavefront_renderer(int width, int height, int samples_per_pixel, int max_depth,
+                       sample_pattern pattern = sample_pattern::independent)
+        : width(width), height(height), spp(samples_per_pixel), max_depth(max_depth), pattern(pattern) {}
+
+    void render_tile(const camera &cam, const hittable &world, const material_table &materials,
+                     color pixel_colors[], const tile &t);
+
+private:
+    void generate(const camera &cam, const tile &t);
+    void intersect(const hittable &world, const material_table &materials, int bounce);
+    template <typename M>
+    void shade(const hit_queue &hits, const material_table &materials, int bounce);
+
+    int width, height, spp, max_depth;
+    sample_pattern pattern;
+
+    // Per path: rng key and the radiance it has gathered
+    std::vector<uint32_t> path_pixel, path_sample;
+    std::vector<color> path_radiance;
+
+    ray_queue current, next;
+    hit_queue hits[(int)material_kind::count];
+};
+
+void wavefront_renderer::generate(const camera &cam, const tile &t)
+{
+    path_pixel.clear();
+    path_sample.clear();
+    current.clear();
+
+    for (int j = t.y0; j < t.y1; ++j)
+    {
+        for (int i = t.x0; i < t.x1; ++i)
+        {
+            uint32_t pixel = j * width + i;
+            for (int s = 0; s < spp; ++s)
+            {
+                rng rand(pixel, s, 0, pattern);
+                auto u = (i + rand.next_float()) / (width - 1);
+                auto v = (j + rand.next_float()) / (height - 1);
+                current.push(cam.get_ray(u, v, rand), color(1, 1, 1), (uint32_t)path_pixel.size());
+                path_pixel.push_back(pixel);
+                path_sample.push_back(s);
+            }
+        }
+    }
+
+    path_radiance.assign(path_pixel.size(), color(0, 0, 0));
+    thread_paths += path_pixel.size();
+}
+
+void wavefront_renderer::intersect(const hittable &world, const material_table &materials, int bounce)
+{
+    for (auto &queue : hits)
+        queue.clear();
+
+    hit_record rec;
+    for (size_t k = 0; k < current.size(); k++)
+    {
+        ray r = current.get_ray(k);
+        if (world.hit(r, 0.001, infinity, rec))
+            hits[(int)materials[rec.mat_id].kind].push(rec, r.dir, current.throughput(k), current.path[k]);
+        else
+        {
+            path_radiance[current.path[k]] = current.throughput(k) * sky_color(r.dir);
+            STAT_END_PATH(path_end::sky, bounce);
+        }
+    }
+    thread_segments += current.size();
+    STAT_ADD(segments, current.size());
+}
+
+template <typename M>
+void wavefront_renderer::shade(const hit_queue &q, const material_table &materials, int bounce)
+{
+    for (size_t k = 0; k < q.size(); k++)
+    {
+        uint32_t p = q.path[k];
+        rng rand(path_pixel[p], path_sample[p], bounce, pattern);
+
+        hit_record rec;
+        rec.p = point3(q.px[k], q.py[k], q.pz[k]);
+        rec.normal = vec3(q.nx[k], q.ny[k], q.nz[k]);
+        rec.front_face = q.front_face[k];
+        ray r_in(rec.p, vec3(q.dx[k], q.dy[k], q.dz[k]));
+
+        // The queue holds one kind only, so skip the switch and call it directly
+        ray scattered;
+        color attenuation;
+        STAT_ADD(scatter_calls, 1);
+        if (!materials[q.mat[k]].as<M>().scatter(r_in, rec, attenuation, scattered, rand))
+        {
+            STAT_END_PATH(path_end::absorbed, bounce);
+            continue;
+        }
+
+        color throughput = color(q.tr[k], q.tg[k], q.tb[k]) * attenuation;
+        if (!russian_roulette(bounce, throughput, rand))
+        {
+            STAT_END_PATH(path_end::roulette, bounce);
+            continue;
+        }
+
+        next.push(scattered, throughput, p);
+    }
+}
+
+void wavefront_renderer::render_tile(const camera &cam, const hittable &world, const material_table &materials,
+                                     color pixel_colors[], const tile &t)
+{
+    generate(cam, t);
+
+    for (int bounce = 1; bounce <= max_depth && current.size() > 0; bounce++)
+    {
+        intersect(world, materials, bounce);
+
+        next.clear();
+        shade<lambertian>(hits[(int)material_kind::lambertian], materials, bounce);
+        shade<metal>(hits[(int)material_kind::metal], materials, bounce);
+        shade<dielectric>(hits[(int)material_kind::dielectric], materials, bounce);
+        std::swap(current, next);
+    }
+    // Whatever is still queued has hit the bounce limit
+    for (size_t k = 0; k < current.size(); k++)
+        STAT_END_PATH(path_end::depth_limit, max_depth);
+
+    // Sum each pixel's samples in sample order, like the per-pixel kernels
+    for (size_t first = 0; first < path_pixel.size(); first += spp)
+    {
+        color pixel_color(0, 0, 0);
+        for (int s = 0; s < spp; s++)
+            pixel_color += path_radiance[first + s];
+
+        int i = path_pixel[first] % width;
+        int j = path_pixel[first] / width;
+        pixel_colors[((height - j - 1) * width) + i] = pixel_color;
+    }
+}